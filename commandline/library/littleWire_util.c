@@ -11,3 +11,29 @@ void delay(unsigned int duration) {
     usleep(duration*1000);
   #endif
 }
+
+/* Time in milliseconds, only differences are meaningful */
+unsigned int millis(void) {
+  #if defined _WIN32 || defined _WIN64
+    return GetTickCount();
+  #else
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return now.tv_sec * 1000 + now.tv_usec / 1000;
+  #endif
+}
+
+/* Time in microseconds, only differences are meaningful */
+unsigned int micros(void) {
+  #if defined _WIN32 || defined _WIN64
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (counter.QuadPart / frequency.QuadPart) * 1000000
+           + (counter.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+  #else
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return now.tv_sec * 1000000 + now.tv_usec;
+  #endif
+}
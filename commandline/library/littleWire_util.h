@@ -5,10 +5,17 @@
   #include <windows.h>
 #else
   #include <unistd.h>
+  #include <sys/time.h>
 #endif
 
 /* Delay in milliseconds */
 void delay(unsigned int duration);
 
+/* Time in milliseconds, only differences are meaningful */
+unsigned int millis(void);
+
+/* Time in microseconds, only differences are meaningful */
+unsigned int micros(void);
+
 // end LITTLEWIRE_UTIL_H section:
 #endif
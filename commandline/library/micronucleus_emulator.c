@@ -0,0 +1,500 @@
+/*
+  Transport of the Micronucleus library which talks to an emulated bootloader instead of USB.
+  It answers the requests like firmware/main.c of the selected configuration and models the time
+  the CPU is halted by SPM and the USB frame latency, so the library and the command line tool
+  can be benchmarked and tested without an AVR attached.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "micronucleus_transport.h"
+#include "littleWire_util.h"
+
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#define MICRONUCLEUS_EMULATOR_FLASH 0x8000  // largest flash of the configurations
+
+enum {
+  cmd_device_info = 0,
+  cmd_transfer_page = 1,
+  cmd_erase_application = 2,
+  cmd_write_data = 3,
+  cmd_exit = 4,
+  cmd_transfer_page_data = 5,
+  cmd_get_status = 6,
+  cmd_get_page_crc = 7,
+  cmd_erase_page = 8,
+  cmd_fill_words = 9,
+  cmd_copy_words = 10,
+  cmd_set_idle = 11,
+  cmd_write_page = 64
+};
+
+// settings given to micronucleus_setTransport() after "emulator:", for the device of one library handle
+typedef struct _micronucleus_emulatorSettings {
+  const micronucleus_geometry* geometry;
+  unsigned int spm_time;    // microseconds the CPU is halted by a page write or erase
+  unsigned int frame_time;  // microseconds a control transfer takes on the bus
+  unsigned char extensions; // EXTENSION_FEATURE_FLAGS the firmware was compiled with
+  unsigned char osccal;     // OSCCAL value saved in the postscript
+  char load[256];           // file with the initial flash content, empty if erased
+  char save[256];           // file the flash is written to when the device is closed
+} micronucleus_emulatorSettings;
+
+// state of the emulated device and context of the transport, the flash is kept until the library handle is closed
+typedef struct _micronucleus_emulated {
+  micronucleus_emulatorSettings settings;
+  int loaded;                    // flash initialized
+  int opened;
+  int exited;                    // the application runs, the device is gone from the bus
+  unsigned char flash[MICRONUCLEUS_EMULATOR_FLASH];
+  unsigned char page_buffer[256];
+  unsigned int current_address;  // currentAddress of the firmware
+  unsigned int erase_end;        // eraseEndAddress of the firmware
+  int command;                   // command pending for the main loop
+  unsigned int command_time;     // micros() when the main loop runs the pending command
+  unsigned int busy_until;       // micros() when SPM has finished
+} micronucleus_emulated;
+
+static const micronucleus_emulatorSettings micronucleus_defaultSettings = {
+  micronucleus_geometries, 4500, 1000, 0, 0x80, "", ""
+};
+
+/*
+ * Sleep for microseconds, the last millisecond is waited actively since most systems sleep longer
+ */
+static void micronucleus_emulatorSleep(unsigned int microseconds) {
+  unsigned int until = micros() + microseconds;
+  int remaining;
+
+  while ((remaining = (int) (until - micros())) > 0) {
+    if (remaining > 2000) delay(remaining / 1000 - 1);
+  }
+}
+
+static unsigned int micronucleus_eraseBlockSize(micronucleus_emulated* device) {
+  return device->settings.geometry->page_size * device->settings.geometry->erase_block_pages;
+}
+
+/*
+ * Erase the page at address, or the block of 4 pages on the ATtiny841.
+ * The CPU is busy until the erase is finished.
+ */
+static void micronucleus_emulatorErase(micronucleus_emulated* device, unsigned int address) {
+  memset(device->flash + (address & ~(micronucleus_eraseBlockSize(device) - 1)), 0xFF, micronucleus_eraseBlockSize(device));
+  device->command_time += device->settings.spm_time;
+  device->busy_until = device->command_time;
+}
+
+// writeFlashPage() of the firmware, unerased bits of the page stay 0
+static void micronucleus_emulatorWritePage(micronucleus_emulated* device) {
+  const micronucleus_geometry* geometry = device->settings.geometry;
+  unsigned int address = (device->current_address - 2) & ~(geometry->page_size - 1);
+  unsigned int i;
+
+  if (device->current_address - 2 < geometry->bootloader_address) {
+    if ((device->settings.extensions & ERASE_ON_WRITE_FEATURE_FLAG)
+        && ((device->current_address - 2) % micronucleus_eraseBlockSize(device)) < geometry->page_size) {
+      micronucleus_emulatorErase(device, device->current_address - 2);
+    }
+    for (i = 0; i < geometry->page_size; i++) device->flash[address + i] &= device->page_buffer[i];
+    device->command_time += device->settings.spm_time;
+    device->busy_until = device->command_time;
+  }
+  memset(device->page_buffer, 0xFF, sizeof(device->page_buffer)); // SPM clears the page buffer
+}
+
+/*
+ * One pass of eraseApplication() of the firmware, which erases all pages down from the end or
+ * with the incremental erase extension only the next one.
+ */
+static void micronucleus_emulatorEraseApplication(micronucleus_emulated* device) {
+  const micronucleus_geometry* geometry = device->settings.geometry;
+  unsigned int block_size = micronucleus_eraseBlockSize(device);
+  int incremental = device->settings.extensions & INCREMENTAL_ERASE_FEATURE_FLAG;
+  unsigned int ptr = incremental ? device->current_address : geometry->bootloader_address;
+  unsigned int last_used = ((incremental ? device->erase_end : device->current_address) - 1) & 0xFFFF;
+
+  while (ptr) {
+    ptr -= block_size;
+    if ((device->settings.extensions & BOUNDED_ERASE_FEATURE_FLAG)
+        && ptr > last_used && ptr != geometry->bootloader_address - block_size) {
+      continue; // page is not used by the new application
+    }
+    micronucleus_emulatorErase(device, ptr);
+    if (incremental) break;
+  }
+  device->current_address = ptr;
+}
+
+static void micronucleus_emulatorSaveFlash(micronucleus_emulated* device) {
+  FILE* file;
+
+  if (!device->settings.save[0]) return;
+  file = fopen(device->settings.save, "wb");
+  if (!file) {
+    fprintf(stderr, "Error writing emulated flash to %s: %s\n", device->settings.save, strerror(errno));
+    return;
+  }
+  fwrite(device->flash, 1, device->settings.geometry->bootloader_address, file);
+  fclose(file);
+}
+
+/*
+ * The main loop of the firmware. Runs the pending command if its time has come.
+ * The incremental erase runs one page per pass, the host may poll the status in between.
+ */
+static void micronucleus_emulatorRun(micronucleus_emulated* device) {
+  while (device->command && (int) (micros() - device->command_time) >= 0) {
+    int command = device->command;
+
+    device->command = 0;
+    if (command == cmd_erase_application) {
+      micronucleus_emulatorEraseApplication(device);
+      if ((device->settings.extensions & INCREMENTAL_ERASE_FEATURE_FLAG) && device->current_address) {
+        device->command = cmd_erase_application; // continue erasing in the next loop
+      }
+    } else if (command == cmd_write_page) {
+      micronucleus_emulatorWritePage(device);
+    } else if (command == cmd_erase_page) {
+      if (device->current_address < device->settings.geometry->bootloader_address) {
+        micronucleus_emulatorErase(device, device->current_address);
+      }
+    } else if (command == cmd_exit || command == cmd_set_idle) {
+      device->exited = 1;
+    }
+  }
+}
+
+// writeWordToPageBuffer() of the firmware
+static void micronucleus_emulatorWriteWord(micronucleus_emulated* device, unsigned int data) {
+  const micronucleus_geometry* geometry = device->settings.geometry;
+  unsigned int offset = device->current_address & (geometry->page_size - 1);
+
+  if (geometry->bootloader_address < 8192) {
+    if (device->current_address == 0) data = 0xC000 + (geometry->bootloader_address / 2) - 1; // rjmp
+  } else {
+    if (device->current_address == 0) data = 0x940C; // far jmp
+    else if (device->current_address == 2) data = geometry->bootloader_address / 2;
+  }
+  if (geometry->osccal_save_calib && device->current_address == geometry->bootloader_address - TINYVECTOR_OSCCAL_OFFSET) {
+    data = device->settings.osccal;
+  }
+
+  device->page_buffer[offset] = data & 0xFF;
+  device->page_buffer[offset + 1] = (data >> 8) & 0xFF;
+  device->current_address = (device->current_address + 2) & 0xFFFF;
+}
+
+// true after the last word of a page was written to the page buffer
+static int micronucleus_emulatorPageFull(micronucleus_emulated* device) {
+  return (device->current_address & 0xFF) % device->settings.geometry->page_size == 0;
+}
+
+/*
+ * usbFunctionSetup() of the firmware, and usbFunctionWrite() for the data stage of cmd_transfer_page_data.
+ * Returns the length of the reply.
+ */
+static int micronucleus_emulatorSetup(micronucleus_emulated* device, int request, int value, int index,
+                                      unsigned char* bytes, int size) {
+  const micronucleus_geometry* geometry = device->settings.geometry;
+  unsigned char extensions = device->settings.extensions;
+  unsigned char reply[9];
+  int length = 0;
+
+  if (request == cmd_device_info) {
+    length = micronucleus_geometryConfiguration(device->settings.geometry, device->settings.extensions, reply);
+  } else if (request == cmd_transfer_page || (request == cmd_transfer_page_data && (extensions & PAGE_DATA_TRANSFER_FEATURE_FLAG))) {
+    // Address zero always has to be written first to ensure reset vector patching
+    if (device->current_address != 0) {
+      device->current_address = index & 0xFFFF & ~(geometry->page_size - 1);
+      memset(device->page_buffer, 0xFF, sizeof(device->page_buffer));
+    }
+    if (request == cmd_transfer_page_data) {
+      int i;
+
+      for (i = 0; i + 1 < size; i += 2) {
+        micronucleus_emulatorWriteWord(device, bytes[i] | (bytes[i + 1] << 8));
+        if (micronucleus_emulatorPageFull(device)) {
+          device->command = cmd_write_page;
+          device->command_time = micros(); // the data stage skips the end of this function
+          i += 2;
+          break;
+        }
+      }
+      return i;
+    }
+  } else if (request == cmd_get_status && (extensions & STATUS_REQUEST_FEATURE_FLAG)) {
+    reply[0] = device->command;
+    reply[1] = (int) (device->busy_until - micros()) > 0;
+    reply[2] = device->current_address & 0xFF;
+    reply[3] = device->current_address >> 8;
+    length = (extensions & INCREMENTAL_ERASE_FEATURE_FLAG) ? 4 : 2;
+  } else if (request == cmd_get_page_crc && (extensions & PAGE_CRC_FEATURE_FLAG)) {
+    unsigned int address = index & ~(geometry->page_size - 1);
+    unsigned int crc = 0xFFFF;
+    unsigned int i;
+    int bit;
+
+    for (i = 0; i < geometry->page_size; i++) {
+      unsigned int osccal = geometry->bootloader_address - TINYVECTOR_OSCCAL_OFFSET;
+
+      // _crc16_update() of avr-libc, the stored OSCCAL is reported as erased
+      if (geometry->osccal_save_calib && (address + i == osccal || address + i == osccal + 1)) {
+        crc ^= 0xFF;
+      } else {
+        crc ^= device->flash[(address + i) % MICRONUCLEUS_EMULATOR_FLASH];
+      }
+      for (bit = 0; bit < 8; bit++) crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : (crc >> 1);
+    }
+    reply[0] = crc & 0xFF;
+    reply[1] = crc >> 8;
+    length = 2;
+  } else if (request == cmd_erase_page && (extensions & PAGE_CRC_FEATURE_FLAG)) {
+    // The erased address is also used by the next cmd_transfer_page, even if it is zero
+    device->current_address = (index & 0xFF & ~(micronucleus_eraseBlockSize(device) - 1)) | (index & 0xFF00);
+    device->command = cmd_erase_page;
+  } else if (request == cmd_erase_application && (extensions & (BOUNDED_ERASE_FEATURE_FLAG | INCREMENTAL_ERASE_FEATURE_FLAG))) {
+    if (extensions & INCREMENTAL_ERASE_FEATURE_FLAG) {
+      device->current_address = geometry->bootloader_address;
+      device->erase_end = index & 0xFFFF;
+    } else {
+      device->current_address = index & 0xFFFF;
+    }
+    device->command = cmd_erase_application;
+  } else if (request == cmd_write_data) {
+    micronucleus_emulatorWriteWord(device, value);
+    micronucleus_emulatorWriteWord(device, index);
+    if (micronucleus_emulatorPageFull(device)) device->command = cmd_write_page;
+  } else if ((request == cmd_fill_words || request == cmd_copy_words) && (extensions & FILL_AND_COPY_FEATURE_FLAG)) {
+    unsigned int count = index & 0xFF;
+    unsigned int source = value & 0xFFFF;
+
+    do {
+      unsigned int data = source;
+
+      if (request == cmd_copy_words) {
+        data = device->flash[source % MICRONUCLEUS_EMULATOR_FLASH] | (device->flash[(source + 1) % MICRONUCLEUS_EMULATOR_FLASH] << 8);
+        source += 2;
+      }
+      micronucleus_emulatorWriteWord(device, data);
+      if (micronucleus_emulatorPageFull(device)) {
+        device->command = cmd_write_page;
+        break;
+      }
+    } while (--count & 0xFF);
+  } else if (request == cmd_set_idle && (extensions & IDLE_CONTROL_FEATURE_FLAG)) {
+    // The emulated bootloader has no idle timeout, only the immediate start is emulated
+    if ((value & 0xFFFF) == 0) device->command = cmd_set_idle;
+  } else {
+    // cmd_erase_application and cmd_exit
+    device->command = request & 0x3F;
+  }
+
+  if (device->command == cmd_exit) {
+    device->command_time = micros() + 5000; // only exit after 5 ms timeout
+  } else if (device->command) {
+    device->command_time = micros();
+  }
+  if (length > size) length = size;
+  memcpy(bytes, reply, length);
+  return length;
+}
+
+static void* micronucleus_emulatorInit(void) {
+  micronucleus_emulated* device = calloc(1, sizeof(micronucleus_emulated));
+
+  if (device) device->settings = micronucleus_defaultSettings;
+  return device;
+}
+
+static void micronucleus_emulatorExit(void* context) {
+  free(context);
+}
+
+static int micronucleus_emulatorScan(void* context, micronucleus_found* found, int max_found, const char* port_path) {
+  micronucleus_emulated* device = context;
+
+  if (!device || max_found < 1 || device->opened || (port_path && strcmp(port_path, "emulator"))) return 0;
+
+  if (!device->loaded) {
+    memset(device->flash, 0xFF, sizeof(device->flash));
+    if (device->settings.load[0]) {
+      FILE* file = fopen(device->settings.load, "rb");
+
+      if (!file) {
+        fprintf(stderr, "Error reading emulated flash from %s: %s\n", device->settings.load, strerror(errno));
+        return 0;
+      }
+      if (fread(device->flash, 1, device->settings.geometry->bootloader_address, file)) {}
+      fclose(file);
+    }
+    device->loaded = 1;
+  }
+
+  // the bootloader starts again after a reset
+  device->opened = 1;
+  device->exited = 0;
+  device->current_address = 0;
+  device->command = 0;
+  device->busy_until = micros();
+  memset(device->page_buffer, 0xFF, sizeof(device->page_buffer));
+
+  found[0].handle = device;
+  found[0].bcdDevice = MICRONUCLEUS_FIRMWARE_VERSION;
+  found[0].bus = 0;
+  strcpy(found[0].port_path, "emulator");
+  return 1;
+}
+
+/*
+ * Waits until the CPU of the device can answer. A halted CPU does not answer at all,
+ * the ATmegas NAK the request until they are ready.
+ * Returns 0 or a negative errno value.
+ */
+static int micronucleus_emulatorReady(micronucleus_emulated* device, int timeout) {
+  int busy;
+
+  micronucleus_emulatorRun(device);
+  if (device->exited) return -ENODEV;
+
+  busy = (int) (device->busy_until - micros());
+  if (busy <= 0) {
+    device->busy_until = micros(); // keeps the difference small while the device is idle
+    return 0;
+  }
+  if (device->settings.geometry->halts) {
+    micronucleus_emulatorSleep(device->settings.frame_time);
+    return -EPROTO;
+  }
+  if (busy > timeout * 1000) {
+    micronucleus_emulatorSleep(timeout * 1000);
+    return -ETIMEDOUT;
+  }
+  micronucleus_emulatorSleep(busy);
+  micronucleus_emulatorRun(device);
+  return 0;
+}
+
+static int micronucleus_emulatorControl(void* context, void* handle, int requesttype, int request, int value, int index,
+                                        char* bytes, int size, int timeout) {
+  micronucleus_emulated* device = handle;
+  int res;
+
+  (void) context;
+  (void) requesttype;
+  res = micronucleus_emulatorReady(device, timeout);
+  if (res < 0) return res;
+  micronucleus_emulatorSleep(device->settings.frame_time);
+  return micronucleus_emulatorSetup(device, request, value, index, (unsigned char*) bytes, size);
+}
+
+/*
+ * Each request is sent as soon as the previous one completed, without a round trip to the caller
+ */
+static int micronucleus_emulatorSubmit(void* context, void* handle, const micronucleus_request* requests,
+                                       unsigned int count, int timeout, micronucleus_requestDone done, void* user_data) {
+  unsigned int i;
+
+  for (i = 0; i < count; i++) {
+    int res = micronucleus_emulatorControl(context, handle, MICRONUCLEUS_REQUEST_OUT, requests[i].request,
+                                           requests[i].value, requests[i].index, NULL, 0, timeout);
+    done(user_data, &requests[i], res, micros());
+    if (res < 0) return res;
+  }
+  return 0;
+}
+
+static void micronucleus_emulatorClose(void* context, void* handle) {
+  micronucleus_emulated* device = handle;
+
+  (void) context;
+  // the pending commands are finished before the flash is saved
+  while (device->command && !device->exited) {
+    micronucleus_emulatorSleep(1000);
+    micronucleus_emulatorRun(device);
+  }
+  micronucleus_emulatorSaveFlash(device);
+  device->opened = 0;
+}
+
+/*
+ * Options are separated by commas: the name of a directory in firmware/configuration,
+ * spm=<microseconds>, frame=<microseconds>, ext=<extension flags>, osccal=<value>,
+ * load=<file> and save=<file>.
+ * Returns 0 for success, -EINVAL for unknown options.
+ */
+static int micronucleus_emulatorConfigure(void* context, const char* options) {
+  micronucleus_emulated* device = context;
+  micronucleus_emulatorSettings settings;
+  char buffer[1024];
+  char* option;
+
+  if (!device) return -ENOMEM;
+  settings = device->settings;
+  if (strlen(options) >= sizeof(buffer)) return -EINVAL;
+  strcpy(buffer, options);
+
+  for (option = strtok(buffer, ","); option; option = strtok(NULL, ",")) {
+    char* value = strchr(option, '=');
+    char* end = NULL;
+
+    if (!value) {
+      settings.geometry = micronucleus_findGeometry(option);
+      if (!settings.geometry) return -EINVAL;
+      continue;
+    }
+    *value++ = 0;
+    if (strcmp(option, "spm") == 0) {
+      settings.spm_time = strtoul(value, &end, 0);
+    } else if (strcmp(option, "frame") == 0) {
+      settings.frame_time = strtoul(value, &end, 0);
+    } else if (strcmp(option, "ext") == 0) {
+      settings.extensions = strtoul(value, &end, 0);
+    } else if (strcmp(option, "osccal") == 0) {
+      settings.osccal = strtoul(value, &end, 0);
+    } else if ((strcmp(option, "load") == 0 || strcmp(option, "save") == 0) && strlen(value) < sizeof(settings.load)) {
+      strcpy(option[0] == 'l' ? settings.load : settings.save, value);
+      continue;
+    } else {
+      return -EINVAL;
+    }
+    if (end == value || *end) return -EINVAL;
+  }
+
+  if (device->opened) return -EBUSY;
+  device->settings = settings;
+  device->loaded = 0; // load the flash of the new device
+  return 0;
+}
+
+const micronucleus_transport micronucleus_emulator = {
+  "emulator",
+  micronucleus_emulatorInit,
+  micronucleus_emulatorExit,
+  micronucleus_emulatorScan,
+  micronucleus_emulatorControl,
+  micronucleus_emulatorSubmit,
+  micronucleus_emulatorClose,
+  NULL, // no hotplug events, the device is always there
+  NULL,
+  micronucleus_emulatorConfigure
+};
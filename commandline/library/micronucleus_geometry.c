@@ -0,0 +1,61 @@
+/*
+  Table of the bootloaders of firmware/configuration for the Micronucleus library. It lets the emulated
+  bootloader answer like one of them and micronucleus_targetDevice() prepare plans without a device.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "micronucleus_transport.h"
+
+#include <string.h>
+
+// generated from firmware/configuration by the Makefile, see micronucleus_geometry.in
+const micronucleus_geometry micronucleus_geometries[] = {
+#include "micronucleus_geometry.h"
+  { NULL, 0, 0, 0, 0, 0, 0, 0, 0, 0 }
+};
+
+const micronucleus_geometry* micronucleus_findGeometry(const char* name) {
+  const micronucleus_geometry* geometry;
+
+  for (geometry = micronucleus_geometries; geometry->name && strcmp(geometry->name, name); geometry++);
+  return geometry->name ? geometry : NULL;
+}
+
+unsigned int micronucleus_geometryConfiguration(const micronucleus_geometry* geometry, unsigned char extensions,
+                                                unsigned char* reply) {
+  unsigned int progmem_size = geometry->bootloader_address
+                              - (geometry->osccal_save_calib ? TINYVECTOR_OSCCAL_OFFSET : TINYVECTOR_RESET_OFFSET);
+  unsigned char write_sleep = geometry->write_sleep;
+
+  if (extensions & ERASE_ON_WRITE_FEATURE_FLAG) {
+    // the reported page write time includes the erase
+    write_sleep = ((write_sleep & 0x7F) * 2) | (write_sleep & 0x80);
+  }
+  reply[0] = progmem_size >> 8;
+  reply[1] = progmem_size & 0xFF;
+  reply[2] = geometry->page_size;
+  reply[3] = write_sleep;
+  reply[4] = geometry->signature1;
+  reply[5] = geometry->signature2;
+  reply[6] = geometry->entrymode;
+  reply[7] = 0; // no application version
+  reply[8] = extensions;
+  return extensions ? 9 : 8;
+}
@@ -0,0 +1,359 @@
+/*
+  Loading of program files for the Micronucleus command line tool and library.
+  Replaces the Intel HEX parser taken from the bootloadHID example from obdev.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+/***************************************************************/
+/* See the micronucleus_image.h for the function descriptions/comments */
+/***************************************************************/
+#include "micronucleus_image.h"
+
+#include <string.h>
+#include <errno.h>
+
+// value of each hex digit ORed with 0x10, 0 for characters which are no hex digits
+static const unsigned char micronucleus_hexDigits[256] = {
+  ['0'] = 0x10, ['1'] = 0x11, ['2'] = 0x12, ['3'] = 0x13, ['4'] = 0x14,
+  ['5'] = 0x15, ['6'] = 0x16, ['7'] = 0x17, ['8'] = 0x18, ['9'] = 0x19,
+  ['A'] = 0x1A, ['B'] = 0x1B, ['C'] = 0x1C, ['D'] = 0x1D, ['E'] = 0x1E, ['F'] = 0x1F,
+  ['a'] = 0x1A, ['b'] = 0x1B, ['c'] = 0x1C, ['d'] = 0x1D, ['e'] = 0x1E, ['f'] = 0x1F
+};
+
+/*
+ * Read the whole file into a newly allocated buffer.
+ * Regular files are read with one fread() of their size, stdin in growing blocks.
+ */
+static int micronucleus_readFile(const char* filename, unsigned char** data, unsigned int* size) {
+  FILE* input = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "rb");
+  unsigned char* buffer = NULL;
+  size_t length = 0;
+  size_t capacity = 0;
+  int res = 0;
+
+  if (input == NULL) return -errno;
+
+  if (input != stdin && fseek(input, 0, SEEK_END) == 0) {
+    long file_size = ftell(input);
+    if (file_size > 0) capacity = file_size + 1;
+    fseek(input, 0, SEEK_SET);
+  }
+
+  while (1) {
+    size_t count;
+
+    if (buffer == NULL || length == capacity) {
+      unsigned char* larger;
+      if (buffer != NULL || capacity == 0) capacity = capacity ? 2 * capacity : 0x10000;
+      larger = realloc(buffer, capacity);
+      if (larger == NULL) {
+        res = -ENOMEM;
+        break;
+      }
+      buffer = larger;
+    }
+
+    count = fread(buffer + length, 1, capacity - length, input);
+    if (count == 0) break;
+    length += count;
+  }
+  if (res == 0 && ferror(input)) res = -EIO;
+
+  if (input != stdin) fclose(input);
+  if (res) {
+    free(buffer);
+    return res;
+  }
+  *data = buffer;
+  *size = length;
+  return 0;
+}
+
+/*
+ * Add bytes at address to the image. They are appended to the last region if they follow it.
+ */
+static int micronucleus_addBytes(micronucleus_image* image, unsigned int address, unsigned char* bytes, unsigned int count) {
+  micronucleus_region* last = image->region_count ? &image->regions[image->region_count - 1] : NULL;
+  unsigned int end_address;
+
+  if (count == 0) return 0;
+
+  // the buffers grow by doubling their size
+  if (image->data_size + count > image->data_capacity) {
+    unsigned int capacity = image->data_capacity ? image->data_capacity : 0x1000;
+    unsigned char* data;
+
+    while (capacity < image->data_size + count) capacity *= 2;
+    data = realloc(image->data, capacity);
+    if (data == NULL) return -ENOMEM;
+    image->data = data;
+    image->data_capacity = capacity;
+  }
+
+  if (!last || last->address + last->size != address) {
+    if (image->region_count == image->region_capacity) {
+      unsigned int capacity = image->region_capacity ? 2 * image->region_capacity : 16;
+      micronucleus_region* regions = realloc(image->regions, capacity * sizeof(micronucleus_region));
+
+      if (regions == NULL) return -ENOMEM;
+      image->regions = regions;
+      image->region_capacity = capacity;
+    }
+    last = &image->regions[image->region_count++];
+    last->address = address;
+    last->size = 0;
+    last->offset = image->data_size;
+  }
+
+  memcpy(image->data + image->data_size, bytes, count);
+  last->size += count;
+  image->data_size += count;
+
+  end_address = address + count;
+  if (end_address < address) end_address = 0xFFFFFFFF;
+  if (image->end_address == 0 || address < image->start_address) image->start_address = address;
+  if (end_address > image->end_address) image->end_address = end_address;
+  return 0;
+}
+
+/*
+ * Decode count bytes from pairs of hex digits. Returns 0 for success, -1 for invalid or missing digits.
+ */
+static int micronucleus_decodeHex(const unsigned char* text, unsigned int available, unsigned char* bytes, unsigned int count) {
+  unsigned int i;
+
+  if (available < 2 * count) return -1;
+  for (i = 0; i < count; i++) {
+    unsigned char high = micronucleus_hexDigits[text[2 * i]];
+    unsigned char low = micronucleus_hexDigits[text[2 * i + 1]];
+
+    if (!(high & low & 0x10)) return -1;
+    bytes[i] = (high & 0x0F) << 4 | (low & 0x0F);
+  }
+  return 0;
+}
+
+int micronucleus_loadIntelHex(const char* filename, micronucleus_image* image) {
+  unsigned char* text;
+  unsigned int size;
+  unsigned int position = 0;
+  unsigned int line = 1;
+  unsigned int base = 0;    // address set by extended segment or linear address records
+  const char* error = NULL;
+  int res;
+
+  memset(image, 0, sizeof(*image));
+  res = micronucleus_readFile(filename, &text, &size);
+  if (res) return res;
+
+  while (position < size && !error) {
+    unsigned char record[5 + 255]; // count, address, type, data, checksum
+    unsigned int count, offset, sum, i;
+    unsigned char* data = record + 4;
+
+    if (text[position] == '\n') {
+      line++;
+      position++;
+      continue;
+    }
+    if (text[position] == '\r' || text[position] == ' ' || text[position] == '\t') {
+      position++;
+      continue;
+    }
+    if (text[position] != ':') {
+      error = "expected ':' at the start of a record";
+      break;
+    }
+    position++;
+
+    if (micronucleus_decodeHex(text + position, size - position, record, 1)
+        || micronucleus_decodeHex(text + position + 2, size - position - 2, record + 1, record[0] + 4)) {
+      error = "invalid or missing hex digits";
+      break;
+    }
+    count = record[0];
+    position += 2 * (count + 5);
+
+    sum = 0;
+    for (i = 0; i < count + 5; i++) sum += record[i];
+    if (sum & 0xFF) {
+      error = "checksum error";
+      break;
+    }
+
+    offset = record[1] << 8 | record[2];
+    switch (record[3]) {
+    case 0x00: // data, the offset wraps around at 64 KB
+      if (offset + count > 0x10000) {
+        res = micronucleus_addBytes(image, base + offset, data, 0x10000 - offset);
+        if (res == 0) res = micronucleus_addBytes(image, base, data + 0x10000 - offset, offset + count - 0x10000);
+      } else {
+        res = micronucleus_addBytes(image, base + offset, data, count);
+      }
+      if (res) {
+        free(text);
+        micronucleus_freeImage(image);
+        return res;
+      }
+      break;
+    case 0x01: // end of file, anything after it is ignored
+      position = size;
+      break;
+    case 0x02: // extended segment address
+    case 0x04: // extended linear address
+      if (count != 2) {
+        error = "invalid extended address record";
+        break;
+      }
+      base = (data[0] << 8 | data[1]) << (record[3] == 0x02 ? 4 : 16);
+      break;
+    case 0x03: // start segment address
+    case 0x05: // start linear address
+      break;
+    default:
+      error = "unknown record type";
+      break;
+    }
+  }
+
+  free(text);
+  if (error) {
+    fprintf(stderr, "%s:%u: %s\n", filename, line, error);
+    micronucleus_freeImage(image);
+    return -EINVAL;
+  }
+  return 0;
+}
+
+int micronucleus_loadRaw(const char* filename, micronucleus_image* image) {
+  unsigned char* data;
+  unsigned int size;
+  int res;
+
+  memset(image, 0, sizeof(*image));
+  res = micronucleus_readFile(filename, &data, &size);
+  if (res) return res;
+
+  // the whole file is one region at address 0
+  if (size > 0) {
+    image->regions = malloc(sizeof(micronucleus_region));
+    if (image->regions == NULL) {
+      free(data);
+      return -ENOMEM;
+    }
+    image->regions[0].address = 0;
+    image->regions[0].size = size;
+    image->regions[0].offset = 0;
+    image->region_count = image->region_capacity = 1;
+    image->end_address = size;
+  }
+  image->data = data;
+  image->data_size = image->data_capacity = size;
+  return 0;
+}
+
+static unsigned int micronucleus_getElfWord(const unsigned char* buffer) {
+  return buffer[0] | buffer[1] << 8;
+}
+
+static unsigned int micronucleus_getElfLong(const unsigned char* buffer) {
+  return buffer[0] | buffer[1] << 8 | buffer[2] << 16 | (unsigned int) buffer[3] << 24;
+}
+
+#define ELF_HEADER_SIZE 52
+#define ELF_PROGRAM_HEADER_SIZE 32
+#define ELF_MACHINE_AVR 83
+#define ELF_SEGMENT_LOAD 1
+#define AVR_DATA_SPACE 0x800000 // avr-gcc puts RAM, EEPROM, fuses, lock bits and signature at 0x800000 and above
+
+int micronucleus_loadElf(const char* filename, micronucleus_image* image) {
+  unsigned char* file;
+  unsigned int size;
+  unsigned int header_offset, header_size, header_count, i;
+  const char* error = NULL;
+  int res;
+
+  memset(image, 0, sizeof(*image));
+  res = micronucleus_readFile(filename, &file, &size);
+  if (res) return res;
+
+  // 32 bit little endian ELF for AVR
+  if (size < ELF_HEADER_SIZE || memcmp(file, "\177ELF", 4) || file[4] != 1 || file[5] != 1) {
+    error = "not a 32 bit little endian ELF file";
+  } else if (micronucleus_getElfWord(file + 18) != ELF_MACHINE_AVR) {
+    error = "not an ELF file for AVR";
+  }
+
+  header_offset = error ? 0 : micronucleus_getElfLong(file + 28);
+  header_size = error ? 0 : micronucleus_getElfWord(file + 42);
+  header_count = error ? 0 : micronucleus_getElfWord(file + 44);
+  if (!error && (header_count == 0 || header_size < ELF_PROGRAM_HEADER_SIZE
+                 || header_offset > size || header_count > (size - header_offset) / header_size)) {
+    error = "invalid program headers";
+  }
+
+  // The loadable segments are placed at their physical address, which is the flash address of
+  // the initial values of .data as well. Segments in the data space, like .eeprom, are skipped.
+  for (i = 0; !error && i < header_count; i++) {
+    const unsigned char* header = file + header_offset + i * header_size;
+    unsigned int offset = micronucleus_getElfLong(header + 4);
+    unsigned int address = micronucleus_getElfLong(header + 12);
+    unsigned int file_size = micronucleus_getElfLong(header + 16);
+
+    if (micronucleus_getElfLong(header) != ELF_SEGMENT_LOAD || file_size == 0 || address >= AVR_DATA_SPACE) continue;
+    if (offset > size || file_size > size - offset) {
+      error = "segment beyond the end of the file";
+      break;
+    }
+    res = micronucleus_addBytes(image, address, file + offset, file_size);
+    if (res) {
+      free(file);
+      micronucleus_freeImage(image);
+      return res;
+    }
+  }
+
+  free(file);
+  if (error) {
+    fprintf(stderr, "%s: %s\n", filename, error);
+    micronucleus_freeImage(image);
+    return -EINVAL;
+  }
+  return 0;
+}
+
+int micronucleus_flattenImage(micronucleus_image* image, unsigned char* buffer, unsigned int size) {
+  unsigned int i;
+
+  if (image->end_address > size) return -EFBIG;
+
+  memset(buffer, 0xFF, size);
+  for (i = 0; i < image->region_count; i++) {
+    micronucleus_region* region = &image->regions[i];
+    memcpy(buffer + region->address, image->data + region->offset, region->size);
+  }
+  return 0;
+}
+
+void micronucleus_freeImage(micronucleus_image* image) {
+  free(image->regions);
+  free(image->data);
+  memset(image, 0, sizeof(*image));
+}
@@ -0,0 +1,97 @@
+#ifndef MICRONUCLEUS_IMAGE_H
+#define MICRONUCLEUS_IMAGE_H
+
+/*
+  Loading of program files for the Micronucleus command line tool and library.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "micronucleus_lib.h"   // MICRONUCLEUS_API
+
+/********************************************************************************
+* Declarations
+********************************************************************************/
+// contiguous bytes of a program file
+typedef struct _micronucleus_region {
+  unsigned int address;     // first address of the region, up to 32 bit
+  unsigned int size;        // number of bytes
+  unsigned int offset;      // position of the bytes in data of the image
+} micronucleus_region;
+
+// content of a program file as list of regions, in the order of the file
+typedef struct _micronucleus_image {
+  micronucleus_region* regions;
+  unsigned int region_count;
+  unsigned int region_capacity; // allocated entries of regions
+  unsigned char* data;      // bytes of all regions
+  unsigned int data_size;
+  unsigned int data_capacity; // allocated size of data
+  unsigned int start_address; // lowest address with data
+  unsigned int end_address;   // highest address with data + 1, 0 if the image is empty
+} micronucleus_image;
+
+/*******************************************************************************/
+
+/********************************************************************************
+* Load an Intel HEX file
+*     Supports data, end of file, extended segment address and extended linear
+*     address records, start address records are ignored.
+*     filename: "-" to read from stdin
+*     Returns: 0 for success, -EINVAL for format errors which are printed to stderr,
+*              or another negative error
+********************************************************************************/
+MICRONUCLEUS_API int micronucleus_loadIntelHex(const char* filename, micronucleus_image* image);
+/*******************************************************************************/
+
+/********************************************************************************
+* Load a raw binary file, which starts at address 0
+*     filename: "-" to read from stdin
+*     Returns: 0 for success, a negative error otherwise
+********************************************************************************/
+MICRONUCLEUS_API int micronucleus_loadRaw(const char* filename, micronucleus_image* image);
+/*******************************************************************************/
+
+/********************************************************************************
+* Load the loadable segments of an AVR ELF file, like .text and .data
+*     The segments are placed at their physical (flash) address. Segments in the
+*     avr-gcc data address space at 0x800000 and above, like .eeprom or .fuse, are skipped.
+*     filename: "-" to read from stdin
+*     Returns: 0 for success, -EINVAL for format errors which are printed to stderr,
+*              or another negative error
+********************************************************************************/
+MICRONUCLEUS_API int micronucleus_loadElf(const char* filename, micronucleus_image* image);
+/*******************************************************************************/
+
+/********************************************************************************
+* Copy the image into buffer, which holds the addresses 0 to size - 1
+*     Bytes not contained in the image are set to 0xFF. Later regions overwrite
+*     earlier ones, as if the file was written in order.
+*     Returns: 0 for success, -EFBIG if the image contains data at size or above
+********************************************************************************/
+MICRONUCLEUS_API int micronucleus_flattenImage(micronucleus_image* image, unsigned char* buffer, unsigned int size);
+/*******************************************************************************/
+
+/********************************************************************************
+* Free the regions and data of an image
+********************************************************************************/
+MICRONUCLEUS_API void micronucleus_freeImage(micronucleus_image* image);
+/*******************************************************************************/
+
+#endif
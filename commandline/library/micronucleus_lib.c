@@ -30,147 +30,699 @@
 /* See the micronucleus_lib.h for the function descriptions/comments */
 /***************************************************************/
 #include "micronucleus_lib.h"
+#include "micronucleus_transport.h"
 #include "littleWire_util.h"
 
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+
+#if !defined _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+// transports compiled into the library, the first one is used by default
+static const micronucleus_transport* micronucleus_transports[] = {
+#if defined MICRONUCLEUS_LIBUSB1
+  &micronucleus_libusb1,
+#endif
+#if defined MICRONUCLEUS_LIBUSB0
+  &micronucleus_libusb0,
+#endif
+#if defined MICRONUCLEUS_USBFS
+  &micronucleus_usbfs,
+#endif
+#if defined MICRONUCLEUS_EMULATOR
+  &micronucleus_emulator,
+#endif
+  NULL
+};
+
+#define MICRONUCLEUS_TRANSPORTS (sizeof(micronucleus_transports) / sizeof(micronucleus_transports[0]))
+
+struct _micronucleus_library {
+  int used;                                // index of the transport used to find new devices
+  void* contexts[MICRONUCLEUS_TRANSPORTS]; // state of each transport, NULL if it keeps none
+};
+
+/*
+ * Record a control transfer in the statistics of the device, if they are collected.
+ */
+static void micronucleus_recordTransfer(micronucleus* deviceHandle, unsigned int latency, int error) {
+  micronucleus_stats* stats = deviceHandle->stats;
+
+  if (!stats) return;
+  stats->transfer_count++;
+  if (error) stats->transfer_errors++;
+
+  if (stats->latency_count == stats->latency_capacity) {
+    unsigned int capacity = stats->latency_capacity ? 2 * stats->latency_capacity : 1024;
+    unsigned int* latencies = realloc(stats->latencies, capacity * sizeof(unsigned int));
+
+    if (!latencies) return; // the sample is dropped
+    stats->latencies = latencies;
+    stats->latency_capacity = capacity;
+  }
+  stats->latencies[stats->latency_count++] = latency;
+}
+
+#define MICRONUCLEUS_TRACE_VERSION 1
+#define MICRONUCLEUS_TRACE_LINE 1024 // longest line of a trace, a page of data takes 512 characters
+
+struct _micronucleus_trace {
+  FILE* file;
+  int replay;               // transfers are read from file instead of being sent to a device
+  unsigned int start;       // micros() when the trace was opened, timestamps are relative to it
+  unsigned int line;        // number of the last line read, for replay errors
+  int device_pending;       // a device line was read which belongs to the next replayed device
+  char port_path[sizeof(((micronucleus*) 0)->port_path)]; // of the pending device line
+  unsigned int bcdDevice;   // of the pending device line
+};
+
+/*
+ * Append a control transfer to a trace: start time and duration in microseconds, request type,
+ * request, value, index, length, result and the bytes transferred in hex or "-".
+ */
+static void micronucleus_traceTransfer(micronucleus_trace* trace, unsigned int start, unsigned int duration, int requesttype,
+                                       int request, int value, int index, int size, int result, const unsigned char* bytes) {
+  int count = 0;
+  int i;
+
+  if (bytes && result >= 0) count = (requesttype & 0x80) ? result : size;
+  fprintf(trace->file, "%u %u %02x %d %d %d %d %d ", start - trace->start, duration, requesttype & 0xFF,
+          request, value, index, size, result);
+  for (i = 0; i < count; i++) fprintf(trace->file, "%02x", bytes[i]);
+  fputs(count ? "\n" : "-\n", trace->file);
+}
+
+/*
+ * Read the next line of a trace which is not a comment.
+ * Returns 1 for a transfer, 0 at the start of the next device or at the end of the trace.
+ */
+static int micronucleus_traceLine(micronucleus_trace* trace, char* line) {
+  unsigned int major, minor;
+
+  if (trace->device_pending) return 0;
+  while (fgets(line, MICRONUCLEUS_TRACE_LINE, trace->file)) {
+    trace->line++;
+    if (sscanf(line, "# device %u.%u %31s", &major, &minor, trace->port_path) == 3) {
+      trace->bcdDevice = (major << 8) | minor;
+      trace->device_pending = 1;
+      return 0;
+    }
+    if (line[0] != '#' && line[0] != '\n') return 1;
+  }
+  return 0;
+}
+
+/*
+ * Answer a control transfer with the next transfer of a trace, which must have the same
+ * request type, request, value, index and length. Takes as long as the recorded transfer.
+ * Returns the recorded result, -ENODEV at the end of the trace of this device or -EBADMSG
+ * if the transfer differs. micronucleus_noAnswer() does not count -EBADMSG, so a status poll
+ * does not take a mismatch for a busy device.
+ */
+static int micronucleus_replayTransfer(micronucleus_trace* trace, int requesttype, int request, int value, int index,
+                                       char* bytes, int size) {
+  char line[MICRONUCLEUS_TRACE_LINE];
+  char data[MICRONUCLEUS_TRACE_LINE];
+  unsigned int time, duration, type;
+  int trace_request, trace_value, trace_index, trace_size, result, i;
+
+  if (!micronucleus_traceLine(trace, line)) return -ENODEV;
+  if (sscanf(line, "%u %u %x %d %d %d %d %d %1023s", &time, &duration, &type, &trace_request, &trace_value,
+             &trace_index, &trace_size, &result, data) != 9) {
+    fprintf(stderr, "Trace line %u: invalid transfer\n", trace->line);
+    return -EBADMSG;
+  }
+  if ((int) type != (requesttype & 0xFF) || trace_request != request || trace_value != value
+      || trace_index != index || trace_size != size) {
+    fprintf(stderr, "Trace line %u: recorded request %d value %d index %d length %d, but got request %d value %d index %d length %d\n",
+            trace->line, trace_request, trace_value, trace_index, trace_size, request, value, index, size);
+    return -EBADMSG;
+  }
+
+  if ((requesttype & 0x80) && result > 0) {
+    if (result > size || strlen(data) != 2 * (size_t) result) {
+      fprintf(stderr, "Trace line %u: invalid data\n", trace->line);
+      return -EBADMSG;
+    }
+    for (i = 0; i < result; i++) {
+      unsigned int byte;
+      sscanf(data + 2 * i, "%2x", &byte);
+      bytes[i] = (char) byte;
+    }
+  }
+  delay(duration / 1000);
+  return result;
+}
+
+/*
+ * Blocking vendor request to the device.
+ * Returns the number of bytes transferred or a negative errno value.
+ */
+static int micronucleus_controlMsg(micronucleus* deviceHandle, int requesttype, int request, int value, int index,
+                                   char* bytes, int size, int timeout) {
+  unsigned int start = micros();
+  int res;
+
+  if (deviceHandle->trace && deviceHandle->trace->replay) {
+    res = micronucleus_replayTransfer(deviceHandle->trace, requesttype, request, value, index, bytes, size);
+  } else {
+    res = deviceHandle->transport->control(deviceHandle->transport_context, deviceHandle->device, requesttype, request, value, index, bytes, size, timeout);
+    if (deviceHandle->trace) {
+      micronucleus_traceTransfer(deviceHandle->trace, start, micros() - start, requesttype, request, value, index,
+                                 size, res, (unsigned char *)bytes);
+    }
+  }
+  micronucleus_recordTransfer(deviceHandle, micros() - start, res < 0);
+  return res;
+}
+
+// requests submitted to the transport at once
+typedef struct _micronucleus_pipeline {
+  micronucleus* device;
+  unsigned int last_time; // micros() when the previous request completed
+} micronucleus_pipeline;
+
+static void micronucleus_pipelineDone(void* user_data, const micronucleus_request* request, int result, unsigned int time) {
+  micronucleus_pipeline *pipeline = user_data;
+
+  if (pipeline->device->trace) {
+    micronucleus_traceTransfer(pipeline->device->trace, pipeline->last_time, time - pipeline->last_time, MICRONUCLEUS_REQUEST_OUT,
+                               request->request, request->value, request->index, 0, result, NULL);
+  }
+  micronucleus_recordTransfer(pipeline->device, time - pipeline->last_time, result < 0);
+  pipeline->last_time = time;
+}
+
+/*
+ * Send a sequence of vendor requests without data stage, e.g. all requests for one page.
+ * With the libusb-1.0 and usbfs transports all requests are submitted at once and the host controller
+ * sends them back to back, otherwise and when replaying a trace they are sent one after the other.
+ * Returns 0 or the first error.
+ */
+static int micronucleus_sendRequests(micronucleus* deviceHandle, micronucleus_request* requests, unsigned int count) {
+  unsigned int i;
+
+  if (!(deviceHandle->trace && deviceHandle->trace->replay) && deviceHandle->transport->submit) {
+    micronucleus_pipeline pipeline = { deviceHandle, micros() };
+    return deviceHandle->transport->submit(deviceHandle->transport_context, deviceHandle->device, requests, count, MICRONUCLEUS_USB_TIMEOUT,
+                                           micronucleus_pipelineDone, &pipeline);
+  }
+
+  for (i = 0; i < count; i++) {
+    int res = micronucleus_controlMsg(deviceHandle, MICRONUCLEUS_REQUEST_OUT, requests[i].request,
+                                      requests[i].value, requests[i].index, NULL, 0, MICRONUCLEUS_USB_TIMEOUT);
+    if (res) return res;
+  }
+  return 0;
+}
+
+static void micronucleus_closeDevice(micronucleus* deviceHandle) {
+  deviceHandle->transport->close(deviceHandle->transport_context, deviceHandle->device);
+  deviceHandle->device = NULL;
+}
+
+/*
+ * True if a status poll failed only because the device did not answer. The CPU of most devices is halted
+ * during SPM and does not answer at all, the ATmegas NAK the request until the timeout.
+ */
+static int micronucleus_noAnswer(int res) {
+  return res == -EIO || res == -EPROTO || res == -EILSEQ || res == -ETIMEDOUT;
+}
+
+/*
+ * Wait until the device has finished the last page write or erase.
+ * Sleeps for min_sleep milliseconds and then polls the device status. The device executes a command
+ * before it processes the next request, so any reply means that the write or erase is finished.
+ * A poll the device does not answer counts as busy, any other error is returned at once.
+ * Returns 0 if the device is ready, the last error or -ETIMEDOUT if it is not ready after max_sleep milliseconds.
+ */
+static int micronucleus_waitReady(micronucleus* deviceHandle, unsigned int min_sleep, unsigned int max_sleep) {
+  unsigned char status[2];
+  unsigned int waited = min_sleep;
+  int res;
+
+  delay(min_sleep);
+  while (1) {
+    res = micronucleus_controlMsg(deviceHandle, MICRONUCLEUS_REQUEST_IN, 6, 0, 0, (char *)status, 2, MICRONUCLEUS_POLL_TIMEOUT);
+    if (deviceHandle->stats) deviceHandle->stats->status_polls++;
+    if (res == 2 && status[0] == 0 && status[1] == 0) return 0;
+    if (res >= 0 && res != 2) return -EIO;
+    if (res < 0 && !micronucleus_noAnswer(res)) return res;
+    if (deviceHandle->stats) deviceHandle->stats->busy_polls++;
+
+    if (waited >= max_sleep) {
+      return (res < 0) ? res : -ETIMEDOUT;
+    }
+    delay(1);
+    waited += 1;
+  }
+}
+
+/*
+ * Take the geometry of a device with protocol v2 from its configuration reply of 6, 8 or 9 bytes.
+ */
+static void micronucleus_setConfiguration(micronucleus* nucleus, unsigned char* buffer, int res, int fast_mode) {
+  if (res>=8) {
+    nucleus->bootloader_feature_flags = buffer[6];
+    nucleus->application_version = buffer[7];
+  }
+
+  // Byte 8 is only sent if the firmware was compiled with protocol extensions
+  nucleus->extension_feature_flags = 0;
+  if (res>=9) {
+    nucleus->extension_feature_flags = buffer[8];
+  }
+
+  nucleus->flash_size = (buffer[0]<<8) + buffer[1];
+  nucleus->page_size = buffer[2];
+  nucleus->pages = (nucleus->flash_size / nucleus->page_size);
+  if (nucleus->pages * nucleus->page_size < nucleus->flash_size) nucleus->pages += 1;
+
+  nucleus->bootloader_start = nucleus->pages*nucleus->page_size;
+
+  if ((nucleus->version.major>=2)&&(!fast_mode)&&!(nucleus->extension_feature_flags & STATUS_REQUEST_FEATURE_FLAG)) {
+    // firmware v2 reports more agressive write times. Add 2ms if fast mode is not used.
+    // Not required if we can poll the device for completion.
+    nucleus->write_sleep = (buffer[3] & 127) + 2;
+  } else {
+    nucleus->write_sleep = (buffer[3] & 127);
+  }
+
+  // if bit 7 of write sleep time is set, divide the erase time by four to
+  // accommodate to the 4*page erase of the ATtiny841/441
+  if (buffer[3]&128) {
+       nucleus->erase_block_pages = 4;
+  } else {
+       nucleus->erase_block_pages = 1;
+  }
+  nucleus->erase_sleep = nucleus->write_sleep * nucleus->pages / nucleus->erase_block_pages;
+
+  nucleus->signature1 = buffer[4];
+  nucleus->signature2 = buffer[5];
+}
+
+/*
+ * Read the configuration reply of an opened device.
+ * Returns 0 for success, -1 if the device does not answer properly.
+ */
+static int micronucleus_readConfiguration(micronucleus* nucleus, int fast_mode) {
+  if (nucleus->version.major>=2) {  // Version 2.x
+    // get 6, 8 or 9 byte nucleus info
+    unsigned char buffer[9];
+    errno = 0;
+    int res = micronucleus_controlMsg(nucleus, MICRONUCLEUS_REQUEST_IN, 0, 0, 0, (char *)buffer, 9, MICRONUCLEUS_USB_TIMEOUT);
+
+    if (res<0){
+        // Device descriptor was found, but talking to it was not successful. This can happen when the device is being reset.
+        return -1;
+    }
+
+    // Only seen on windows.
+    // This happens if the USB device is not listening, but did not disconnect from the USB bus,
+    // which is a desirable behavior, since otherwise you get that nasty error in device manager.
+    if (res<6) {
+    	fprintf(stderr, "%s. Micronucleus device seems to be inactive. Please unplug and replug or reset the device.\n", strerror(errno));
+    	return -1;
+    }
+
+    assert(res >= 6);
+
+    micronucleus_setConfiguration(nucleus, buffer, res, fast_mode);
+
+  } else {  // Version 1.x
+    // get 4 byte nucleus info
+    unsigned char buffer[4];
+    int res = micronucleus_controlMsg(nucleus, MICRONUCLEUS_REQUEST_IN, 0, 0, 0, (char *)buffer, 4, MICRONUCLEUS_USB_TIMEOUT);
+
+    // Device descriptor was found, but talking to it was not successful. This can happen when the device is being reset.
+    if (res<0) return -1;
+
+    assert(res >= 4);
+
+    nucleus->flash_size = (buffer[0]<<8) + buffer[1];
+    nucleus->page_size = buffer[2];
+    nucleus->pages = (nucleus->flash_size / nucleus->page_size);
+    if (nucleus->pages * nucleus->page_size < nucleus->flash_size) nucleus->pages += 1;
+
+    nucleus->bootloader_start = nucleus->pages*nucleus->page_size;
+
+    nucleus->write_sleep = (buffer[3] & 127);
+    nucleus->erase_sleep = nucleus->write_sleep * nucleus->pages;
+    nucleus->erase_block_pages = 1;
+
+    nucleus->signature1 = 0;
+    nucleus->signature2 = 0;
+    nucleus->extension_feature_flags = 0;
+  }
+
+  return 0;
+}
+
+/*
+ * Open a device found on the bus and read its configuration.
+ * Returns NULL if it can not be opened or does not answer, the reason is printed.
+ */
+static micronucleus* micronucleus_openDevice(const micronucleus_transport* transport, void* context,
+                                             micronucleus_found* found, int fast_mode) {
+  micronucleus *nucleus = calloc(1, sizeof(micronucleus));
+
+  if (!nucleus) {
+    transport->close(context, found->handle);
+    return NULL;
+  }
+  nucleus->device = found->handle;
+  nucleus->transport = transport;
+  nucleus->transport_context = context;
+  nucleus->bus = found->bus;
+  strcpy(nucleus->port_path, found->port_path);
+  nucleus->version.major = (found->bcdDevice >> 8) & 0xFF;
+  nucleus->version.minor = found->bcdDevice & 0xFF;
+
+  if (micronucleus_readConfiguration(nucleus, fast_mode)) {
+    micronucleus_close(nucleus);
+    return NULL;
+  }
+  return nucleus;
+}
+
+/*
+ * Scan the bus for micronucleus devices and open them.
+ * If port_path is not NULL, only the device at this port is opened.
+ * Returns the number of devices stored in devices, at most max_devices.
+ */
+static int micronucleus_scan(micronucleus_library* library, micronucleus** devices, int max_devices,
+                             const char* port_path, int fast_mode) {
+  const micronucleus_transport* transport = micronucleus_transports[library->used];
+  void* context = library->contexts[library->used];
+  micronucleus_found found[max_devices > 0 ? max_devices : 1];
+  int count, i;
+  int opened = 0;
+
+  if (!transport || max_devices <= 0) return 0;
+  count = transport->scan(context, found, max_devices, port_path);
+
+  for (i = 0; i < count; i++) {
+    if (((found[i].bcdDevice >> 8) & 0xFF) > MICRONUCLEUS_MAX_MAJOR_VERSION) {
+      fprintf(stderr,
+              "Warning: device with unknown new version of Micronucleus detected.\n"
+              "This tool doesn't know how to upload to this new device. Updates may be available.\n"
+              "Device reports version as: %d.%d\n",
+              (found[i].bcdDevice >> 8) & 0xFF, found[i].bcdDevice & 0xFF);
+      transport->close(context, found[i].handle);
+      continue;
+    }
+
+    devices[opened] = micronucleus_openDevice(transport, context, &found[i], fast_mode);
+    if (devices[opened]) opened++;
+  }
+  return opened;
+}
+
+const char* micronucleus_libraryVersion(void) {
+  return MICRONUCLEUS_LIB_VERSION;
+}
+
+micronucleus_library* micronucleus_openLibrary(void) {
+  micronucleus_library* library = calloc(1, sizeof(micronucleus_library));
+  int i;
+
+  if (!library) return NULL;
+  for (i = 0; micronucleus_transports[i]; i++) {
+    if (micronucleus_transports[i]->init) library->contexts[i] = micronucleus_transports[i]->init();
+  }
+  return library;
+}
+
+void micronucleus_closeLibrary(micronucleus_library* library) {
+  int i;
+
+  if (!library) return;
+  for (i = 0; micronucleus_transports[i]; i++) {
+    if (micronucleus_transports[i]->exit && library->contexts[i]) micronucleus_transports[i]->exit(library->contexts[i]);
+  }
+  free(library);
+}
 
 // called every 100 ms
-micronucleus* micronucleus_connect(int fast_mode) {
+micronucleus* micronucleus_connect(micronucleus_library* library, int fast_mode) {
   micronucleus *nucleus = NULL;
-  struct usb_bus *busses;
-
-  // Initialize USB and find micronucleus device
-  usb_init();
-  usb_find_busses();
-  usb_find_devices();
-
-  busses = usb_get_busses();
-
-  struct usb_bus *bus;
-  for (bus = busses; bus; bus = bus->next) {
-    struct usb_device *dev;
-
-    for (dev = bus->devices; dev; dev = dev->next) {
-      /* Check if this device is a micronucleus */
-      if (dev->descriptor.idVendor == MICRONUCLEUS_VENDOR_ID && dev->descriptor.idProduct == MICRONUCLEUS_PRODUCT_ID)  {
-        nucleus = malloc(sizeof(micronucleus));
-        nucleus->version.major = (dev->descriptor.bcdDevice >> 8) & 0xFF;
-        nucleus->version.minor = dev->descriptor.bcdDevice & 0xFF;
-
-        if (nucleus->version.major > MICRONUCLEUS_MAX_MAJOR_VERSION) {
-          fprintf(stderr,
-                  "Warning: device with unknown new version of Micronucleus detected.\n"
-                  "This tool doesn't know how to upload to this new device. Updates may be available.\n"
-                  "Device reports version as: %d.%d\n",
-                  nucleus->version.major, nucleus->version.minor);
-          return NULL;
-        }
 
-        errno = 0;
-        nucleus->device = usb_open(dev);
-        if (errno == 13) {
-                fprintf(stderr, "usb_open(): %s. For Linux, copy file https://github.com/micronucleus/micronucleus/blob/master/commandline/49-micronucleus.rules to /etc/udev/rules.d.\n", strerror(errno));
-                return NULL;
-        }
-        if (!nucleus->device) {
-                fprintf(stderr, "Error opening bus %s device %s: %s\n", bus->dirname, dev->filename, strerror(errno));
-                return NULL;
-        }
+  micronucleus_scan(library, &nucleus, 1, NULL, fast_mode);
+  return nucleus;
+}
 
-        if (nucleus->version.major>=2) {  // Version 2.x
-          // get 6 or 8 byte nucleus info
-          unsigned char buffer[8];
-          errno = 0;
-          int res = usb_control_msg(nucleus->device, USB_ENDPOINT_IN| USB_TYPE_VENDOR | USB_RECIP_DEVICE, 0, 0, 0, (char *)buffer, 8, MICRONUCLEUS_USB_TIMEOUT);
-
-          if (res<0){
-              // Device descriptor was found, but talking to it was not successful. This can happen when the device is being reset.
-              return NULL;
-          }
-
-          // Only seen on windows.
-          // This happens if the USB device is not listening, but did not disconnect from the USB bus,
-          // which is a desirable behavior, since otherwise you get that nasty error in device manager.
-          if (res<6) {
-          	fprintf(stderr, "%s. Micronucleus device seems to be inactive. Please unplug and replug or reset the device.\n", strerror(errno));
-          	return NULL;
-          }
-
-          assert(res >= 6);
-
-          if (res==8) {
-            nucleus->bootloader_feature_flags = buffer[6];
-            nucleus->application_version = buffer[7];
-          }
-
-          nucleus->flash_size = (buffer[0]<<8) + buffer[1];
-          nucleus->page_size = buffer[2];
-          nucleus->pages = (nucleus->flash_size / nucleus->page_size);
-          if (nucleus->pages * nucleus->page_size < nucleus->flash_size) nucleus->pages += 1;
-
-          nucleus->bootloader_start = nucleus->pages*nucleus->page_size;
-
-          if ((nucleus->version.major>=2)&&(!fast_mode)) {
-            // firmware v2 reports more agressive write times. Add 2ms if fast mode is not used.
-            nucleus->write_sleep = (buffer[3] & 127) + 2;
-          } else {
-            nucleus->write_sleep = (buffer[3] & 127);
-          }
-
-          // if bit 7 of write sleep time is set, divide the erase time by four to
-          // accommodate to the 4*page erase of the ATtiny841/441
-          if (buffer[3]&128) {
-               nucleus->erase_sleep = nucleus->write_sleep * nucleus->pages / 4;
-          } else {
-               nucleus->erase_sleep = nucleus->write_sleep * nucleus->pages;
-          }
-
-          nucleus->signature1 = buffer[4];
-          nucleus->signature2 = buffer[5];
-
-        } else {  // Version 1.x
-          // get 4 byte nucleus info
-          unsigned char buffer[4];
-          int res = usb_control_msg(nucleus->device, USB_ENDPOINT_IN| USB_TYPE_VENDOR | USB_RECIP_DEVICE, 0, 0, 0, (char *)buffer, 4, MICRONUCLEUS_USB_TIMEOUT);
-
-          // Device descriptor was found, but talking to it was not successful. This can happen when the device is being reset.
-          if (res<0) return NULL;
-
-          assert(res >= 4);
-
-          nucleus->flash_size = (buffer[0]<<8) + buffer[1];
-          nucleus->page_size = buffer[2];
-          nucleus->pages = (nucleus->flash_size / nucleus->page_size);
-          if (nucleus->pages * nucleus->page_size < nucleus->flash_size) nucleus->pages += 1;
-
-          nucleus->bootloader_start = nucleus->pages*nucleus->page_size;
-
-          nucleus->write_sleep = (buffer[3] & 127);
-          nucleus->erase_sleep = nucleus->write_sleep * nucleus->pages;
-
-          nucleus->signature1 = 0;
-          nucleus->signature2 = 0;
-        }
+int micronucleus_enumerate(micronucleus_library* library, micronucleus** devices, int max_devices, int fast_mode) {
+  return micronucleus_scan(library, devices, max_devices, NULL, fast_mode);
+}
+
+micronucleus* micronucleus_open(micronucleus_library* library, const char* port_path, int fast_mode) {
+  micronucleus *nucleus = NULL;
+
+  micronucleus_scan(library, &nucleus, 1, port_path, fast_mode);
+  return nucleus;
+}
+
+int micronucleus_setTransport(micronucleus_library* library, const char* name) {
+  const char* options = strchr(name, ':');
+  size_t length = options ? (size_t) (options - name) : strlen(name);
+  int i;
+
+  for (i = 0; micronucleus_transports[i]; i++) {
+    if (strlen(micronucleus_transports[i]->name) == length && strncmp(micronucleus_transports[i]->name, name, length) == 0) {
+      if (options) {
+        int res = micronucleus_transports[i]->configure ?
+                  micronucleus_transports[i]->configure(library->contexts[i], options + 1) : -EINVAL;
+        if (res < 0) return res;
       }
+      library->used = i;
+      return 0;
     }
   }
+  return -ENOENT;
+}
+
+const char* micronucleus_getTransport(int index) {
+  int i;
+
+  for (i = 0; i < index && micronucleus_transports[i]; i++);
+  return micronucleus_transports[i] ? micronucleus_transports[i]->name : NULL;
+}
+
+void micronucleus_close(micronucleus* deviceHandle) {
+  if (!deviceHandle) return;
+  if (deviceHandle->device) micronucleus_closeDevice(deviceHandle);
+  free(deviceHandle);
+}
+
+micronucleus_trace* micronucleus_openTrace(const char* filename, int replay) {
+  micronucleus_trace* trace = calloc(1, sizeof(micronucleus_trace));
+  char line[MICRONUCLEUS_TRACE_LINE];
+  int version;
+
+  if (!trace) return NULL;
+  trace->replay = replay;
+  trace->start = micros();
+  trace->file = fopen(filename, replay ? "r" : "w");
+  if (!trace->file) {
+    free(trace);
+    return NULL;
+  }
+
+  if (replay) {
+    if (!fgets(line, sizeof(line), trace->file) || sscanf(line, "# micronucleus trace %d", &version) != 1
+        || version != MICRONUCLEUS_TRACE_VERSION) {
+      micronucleus_closeTrace(trace);
+      errno = EINVAL;
+      return NULL;
+    }
+    trace->line = 1;
+  } else {
+    fprintf(trace->file, "# micronucleus trace %d\n", MICRONUCLEUS_TRACE_VERSION);
+    fprintf(trace->file, "# time duration type request value index length result data\n");
+  }
+  return trace;
+}
+
+void micronucleus_closeTrace(micronucleus_trace* trace) {
+  if (!trace) return;
+  fclose(trace->file);
+  free(trace);
+}
+
+int micronucleus_traceDevice(micronucleus* deviceHandle, micronucleus_trace* trace) {
+  unsigned char buffer[9];
+
+  if (trace->replay) return -EINVAL;
+  fprintf(trace->file, "# device %d.%d %s\n", deviceHandle->version.major, deviceHandle->version.minor,
+          deviceHandle->port_path);
+  deviceHandle->trace = trace;
+
+  // The configuration is requested again, so the replayed device can be set up from the trace
+  micronucleus_controlMsg(deviceHandle, MICRONUCLEUS_REQUEST_IN, 0, 0, 0, (char *)buffer,
+                          deviceHandle->version.major >= 2 ? 9 : 4, MICRONUCLEUS_USB_TIMEOUT);
+  return 0;
+}
 
+micronucleus* micronucleus_replayDevice(micronucleus_trace* trace, int fast_mode) {
+  char line[MICRONUCLEUS_TRACE_LINE];
+  micronucleus *nucleus;
+
+  if (!trace->replay) return NULL;
+  // transfers left over from the previous device are skipped
+  while (micronucleus_traceLine(trace, line));
+  if (!trace->device_pending) return NULL;
+  trace->device_pending = 0;
+
+  nucleus = calloc(1, sizeof(micronucleus));
+  if (!nucleus) return NULL;
+  nucleus->trace = trace;
+  strcpy(nucleus->port_path, trace->port_path);
+  nucleus->version.major = (trace->bcdDevice >> 8) & 0xFF;
+  nucleus->version.minor = trace->bcdDevice & 0xFF;
+
+  if (micronucleus_readConfiguration(nucleus, fast_mode)) {
+    micronucleus_close(nucleus);
+    return NULL;
+  }
   return nucleus;
 }
 
-int micronucleus_eraseFlash(micronucleus* deviceHandle, micronucleus_callback progress) {
+micronucleus* micronucleus_targetDevice(const char* configuration) {
+  const micronucleus_geometry* geometry = micronucleus_findGeometry(configuration);
+  unsigned char buffer[9];
+  micronucleus *nucleus;
+
+  if (!geometry) return NULL;
+  nucleus = calloc(1, sizeof(micronucleus));
+  if (!nucleus) return NULL;
+  snprintf(nucleus->port_path, sizeof(nucleus->port_path), "%s", configuration);
+  nucleus->version.major = (MICRONUCLEUS_FIRMWARE_VERSION >> 8) & 0xFF;
+  nucleus->version.minor = MICRONUCLEUS_FIRMWARE_VERSION & 0xFF;
+
+  // the bootloader of the configuration would answer with this reply, there is no device to ask
+  micronucleus_setConfiguration(nucleus, buffer, micronucleus_geometryConfiguration(geometry, 0, buffer), 1);
+  return nucleus;
+}
+
+micronucleus* micronucleus_waitForDevice(micronucleus_library* library, const char* port_path, int fast_mode,
+                                         unsigned int timeout) {
+  micronucleus *nucleus = NULL;
+  time_t start_time = time(NULL);
+
+  const micronucleus_transport* transport = micronucleus_transports[library->used];
+  void* context = library->contexts[library->used];
+
+  if (transport && transport->watch && transport->watch(context, 1) == 0) {
+    // The bus is only scanned after a matching device arrived. A device which is being reset
+    // does not answer yet, so it is tried again every 100 ms for one second.
+    int retries = 0;
+
+    while (nucleus == NULL && !(timeout && start_time + timeout < time(NULL))) {
+      if (transport->arrived(context, 100)) {
+        retries = 10;
+      }
+      if (retries) {
+        retries--;
+        nucleus = micronucleus_open(library, port_path, fast_mode);
+      }
+    }
+    transport->watch(context, 0);
+    return nucleus;
+  }
+
+  // Scan the bus every 100 ms
+  while (nucleus == NULL) {
+    delay(100);
+    nucleus = micronucleus_open(library, port_path, fast_mode);
+
+    if (timeout && start_time + timeout < time(NULL)) {
+      break;
+    }
+  }
+  return nucleus;
+}
+
+/*
+ * Get the end address sent with the erase request and the time the erase takes.
+ */
+static unsigned int micronucleus_eraseTime(micronucleus* deviceHandle, unsigned int program_size, unsigned int* end_address) {
+  unsigned int erase_sleep = deviceHandle->erase_sleep;
+
+  *end_address = 0;
+  if ((deviceHandle->extension_feature_flags & BOUNDED_ERASE_FEATURE_FLAG) && program_size > 0) {
+    // The device erases only the pages below end_address and the last page with the tiny vector table
+    unsigned int block_size = deviceHandle->page_size * deviceHandle->erase_block_pages;
+    unsigned int blocks = (program_size + block_size - 1) / block_size + 1;
+    unsigned int total_blocks = deviceHandle->pages / deviceHandle->erase_block_pages;
+
+    if (blocks < total_blocks) {
+      *end_address = program_size;
+      erase_sleep = erase_sleep * blocks / total_blocks;
+    }
+  }
+  return erase_sleep;
+}
+
+int micronucleus_eraseFlash(micronucleus* deviceHandle, unsigned int program_size, micronucleus_callback progress, void* user_data) {
+  unsigned int start = micros();
   int res;
-  res = usb_control_msg(deviceHandle->device, USB_ENDPOINT_OUT| USB_TYPE_VENDOR | USB_RECIP_DEVICE, 2, 0, 0, NULL, 0, MICRONUCLEUS_USB_TIMEOUT);
+  unsigned int end_address;
+  unsigned int erase_sleep = micronucleus_eraseTime(deviceHandle, program_size, &end_address);
 
-  // give microcontroller enough time to erase all writable pages and come back online
-  float i = 0;
-  while (i < 1.0) {
-    // update progress callback if one was supplied
-    if (progress) progress(i);
+  res = micronucleus_controlMsg(deviceHandle, MICRONUCLEUS_REQUEST_OUT, 2, 0, end_address, NULL, 0, MICRONUCLEUS_USB_TIMEOUT);
 
-    delay(((float) deviceHandle->erase_sleep) / 100.0f);
-    i += 0.01;
+  if (res == 0 && (deviceHandle->extension_feature_flags & INCREMENTAL_ERASE_FEATURE_FLAG)) {
+    // The device erases one page per main loop pass and answers status requests in between.
+    // It reports the address of the last erased page, erasing proceeds downwards to 0.
+    unsigned char status[4];
+    unsigned int waited = 0;
+
+    while (1) {
+      delay(deviceHandle->write_sleep);
+      waited += deviceHandle->write_sleep;
+
+      res = micronucleus_controlMsg(deviceHandle, MICRONUCLEUS_REQUEST_IN, 6, 0, 0, (char *)status, 4, MICRONUCLEUS_POLL_TIMEOUT);
+      if (deviceHandle->stats) deviceHandle->stats->status_polls++;
+      if (res == 4) {
+        if (status[0] == 0 && status[1] == 0) {
+          res = 0;
+          break;
+        }
+        if (deviceHandle->stats) deviceHandle->stats->busy_polls++;
+        if (progress) progress(user_data, 1.0f - (float) ((status[3] << 8) + status[2]) / (float) deviceHandle->bootloader_start);
+      } else if (res >= 0) {
+        res = -EIO;
+        break;
+      } else if (!micronucleus_noAnswer(res)) {
+        break; // only a device halted by the erase of a page may not answer
+      }
+
+      // USB is serviced between the pages, so allow a generous margin
+      if (waited >= 4 * erase_sleep) {
+        res = (res < 0) ? res : -ETIMEDOUT;
+        break;
+      }
+    }
+  } else {
+    // give microcontroller enough time to erase all writable pages and come back online
+    float i = 0;
+    while (i < 1.0) {
+      // update progress callback if one was supplied
+      if (progress) progress(user_data, i);
+
+      delay(((float) erase_sleep) / 100.0f);
+      i += 0.01;
+    }
+
+    // the erase time is not padded if the device can tell us when it is done
+    if (res == 0 && (deviceHandle->extension_feature_flags & STATUS_REQUEST_FEATURE_FLAG)) {
+      res = micronucleus_waitReady(deviceHandle, 0, erase_sleep);
+    }
   }
 
   /* Under Linux, the erase process is often aborted with errors such as:
@@ -184,10 +736,11 @@ int micronucleus_eraseFlash(micronucleus* deviceHandle, micronucleus_callback pr
    On Mac OS a common error is -34 = epipe, but adding it to this list causes:
    Assertion failed: (res >= 4), function micronucleus_connect, file library/micronucleus_lib.c, line 63.
   */
+  if (deviceHandle->stats) deviceHandle->stats->erase_time = micros() - start;
+
   if (res == -5 || res == -32 || res == -34 || res == -71 || res == -84) {
     if (res == -34) {
-      usb_close(deviceHandle->device);
-      deviceHandle->device = NULL;
+      micronucleus_closeDevice(deviceHandle);
     }
 
     return 1; // recoverable errors
@@ -196,154 +749,513 @@ int micronucleus_eraseFlash(micronucleus* deviceHandle, micronucleus_callback pr
   }
 }
 
-int micronucleus_writeFlash(micronucleus* deviceHandle, unsigned int program_size, unsigned char* program, micronucleus_callback prog) {
-  unsigned char page_length = deviceHandle->page_size;
-  unsigned char page_buffer[page_length];
-  unsigned int  address; // overall flash memory address
-  unsigned int  page_address; // address within this page when copying buffer
-  unsigned int  res;
-  unsigned int  pagecontainsdata;
-  unsigned int  userReset;
+/*
+ * CRC16 as computed by the firmware with _crc16_update() for the page CRC request.
+ * Polynomial 0xA001 (reversed 0x8005), initial value 0xFFFF.
+ */
+static unsigned int micronucleus_crc16(unsigned char* data, unsigned int length) {
+  unsigned int crc = 0xFFFF;
+  unsigned int i, bit;
 
-  for (address = 0; address < deviceHandle->flash_size; address += deviceHandle->page_size) {
-    // work around a bug in older bootloader versions
-    if (deviceHandle->version.major == 1 && deviceHandle->version.minor <= 2
-        && address / deviceHandle->page_size == deviceHandle->pages - 1) {
-      page_length = deviceHandle->flash_size % deviceHandle->page_size;
+  for (i = 0; i < length; i++) {
+    crc ^= data[i];
+    for (bit = 0; bit < 8; bit++) {
+      if (crc & 1) {
+        crc = (crc >> 1) ^ 0xA001;
+      } else {
+        crc = (crc >> 1);
+      }
     }
+  }
+  return crc;
+}
 
-    pagecontainsdata=0;
+/*
+ * CRC-32 as used by zip and Ethernet, identifies the content of a plan.
+ */
+static unsigned int micronucleus_crc32(unsigned char* data, unsigned int length) {
+  unsigned int crc = 0xFFFFFFFF;
+  unsigned int i, bit;
 
-    // copy in bytes from user program
-    for (page_address = 0; page_address < page_length; page_address += 1) {
-      if (address + page_address > program_size) {
-        page_buffer[page_address] = 0xFF; // pad out remainder with unprogrammed bytes
+  for (i = 0; i < length; i++) {
+    crc ^= data[i];
+    for (bit = 0; bit < 8; bit++) {
+      if (crc & 1) {
+        crc = (crc >> 1) ^ 0xEDB88320;
       } else {
-        pagecontainsdata=1; // page contains data and needs to be written
-        page_buffer[page_address] = program[address + page_address]; // load from user program
+        crc = (crc >> 1);
       }
     }
+  }
+  return ~crc;
+}
 
-    // Reset vector patching is done in the host tool in micronucleus >=2
-    if (deviceHandle->version.major >=2)
-    {
-      if ( address == 0 ) {
-        // save user reset vector (bootloader will patch with its vector)
-        unsigned int word0, word1;
-        word0 = page_buffer [1] * 0x100 + page_buffer [0];
-        word1 = page_buffer [3] * 0x100 + page_buffer [2];
-
-        if (word0==0x940c) {  // long jump
-          userReset = word1;
-        } else if ((word0&0xf000)==0xc000) {  // rjmp
-          userReset = (word0 & 0x0fff) - 0 + 1;
-        } else {
-          fprintf(stderr,
-                  "The reset vector of the user program does not contain a branch instruction,\n"
-                  "therefore the bootloader can not be inserted. Please rearrange your code.\n"
-                  );
-          return -8;  // choose #define ENOEXEC     8   /* Exec format error */
-        }
+/*
+ * Get the target of the branch in the reset vector of the user program.
+ * Returns 0 for success, -ENOEXEC if the vector does not contain a branch instruction.
+ */
+static int micronucleus_getUserReset(unsigned char* vector, unsigned int* userReset) {
+  unsigned int word0, word1;
+  word0 = vector [1] * 0x100 + vector [0];
+  word1 = vector [3] * 0x100 + vector [2];
 
-        // Patch in jmp to bootloader.
-        if (deviceHandle->bootloader_start > 0x2000) {
-          //  jmp
-          unsigned data = 0x940c;
-          page_buffer [ 0 ] = data >> 0 & 0xff;
-          page_buffer [ 1 ] = data >> 8 & 0xff;
-          page_buffer [ 2 ] = deviceHandle->bootloader_start >> 0 & 0xff;
-          page_buffer [ 3 ] = deviceHandle->bootloader_start >> 8 & 0xff;
-        } else {
-          // rjmp
-          unsigned data =  0xc000 | ((deviceHandle->bootloader_start/2 - 1) & 0x0fff);
-          page_buffer [ 0 ] = data >> 0 & 0xff;
-          page_buffer [ 1 ] = data >> 8 & 0xff;
-        }
+  if (word0==0x940c) {  // long jump
+    *userReset = word1;
+  } else if ((word0&0xf000)==0xc000) {  // rjmp
+    *userReset = (word0 & 0x0fff) - 0 + 1;
+  } else {
+    return -ENOEXEC;
+  }
+  return 0;
+}
+
+int micronucleus_checkProgram(unsigned int program_size, unsigned char* program) {
+  unsigned int userReset;
 
+  if (program_size < 4) return -ENOEXEC;
+  return micronucleus_getUserReset(program, &userReset);
+}
+
+/*
+ * Copy the content of the page at address from the user program into page_buffer
+ * and patch the reset vectors for protocol v2. Page 0 must be prepared first to get userReset.
+ * Returns 1 if the page has to be written, 0 if it is not used by the program or, for protocol v2,
+ * only contains 0xFF like an erased page, or a negative error.
+ */
+static int micronucleus_preparePage(micronucleus* deviceHandle, unsigned int address, unsigned int page_length,
+                                    unsigned int program_size, unsigned char* program,
+                                    unsigned char* page_buffer, unsigned int* userReset) {
+  unsigned int  page_address; // address within this page when copying buffer
+  int           pagecontainsdata = 0;
+
+  // copy in bytes from user program
+  for (page_address = 0; page_address < page_length; page_address += 1) {
+    if (address + page_address >= program_size) {
+      page_buffer[page_address] = 0xFF; // pad out remainder with unprogrammed bytes
+    } else {
+      pagecontainsdata=1; // page contains data and needs to be written
+      page_buffer[page_address] = program[address + page_address]; // load from user program
+    }
+  }
+
+  // Reset vector patching is done in the host tool in micronucleus >=2
+  if (deviceHandle->version.major >=2)
+  {
+    if ( address == 0 ) {
+      // save user reset vector (bootloader will patch with its vector)
+      if (micronucleus_getUserReset(page_buffer, userReset)) {
+        fprintf(stderr,
+                "The reset vector of the user program does not contain a branch instruction,\n"
+                "therefore the bootloader can not be inserted. Please rearrange your code.\n"
+                );
+        return -8;  // choose #define ENOEXEC     8   /* Exec format error */
       }
 
-      if ( address >= deviceHandle->bootloader_start - deviceHandle->page_size ) {
-        // move user reset vector to end of last page
-        // The reset vector is always the last vector in the tinyvectortable
-        unsigned int user_reset_addr = (deviceHandle->pages*deviceHandle->page_size) - 4;
-
-        if (user_reset_addr > 0x2000) {
-          //  jmp
-          unsigned data = 0x940c;
-          page_buffer [user_reset_addr - address + 0] = data >> 0 & 0xff;
-          page_buffer [user_reset_addr - address + 1] = data >> 8 & 0xff;
-          page_buffer [user_reset_addr - address + 2] = userReset >> 0 & 0xff;
-          page_buffer [user_reset_addr - address + 3] = userReset >> 8 & 0xff;
-        } else {
-          // rjmp
-          unsigned data =  0xc000 | ((userReset - user_reset_addr/2 - 1) & 0x0fff);
-          page_buffer [user_reset_addr - address + 0] = data >> 0 & 0xff;
-          page_buffer [user_reset_addr - address + 1] = data >> 8 & 0xff;
-        }
+      // Patch in jmp to bootloader.
+      if (deviceHandle->bootloader_start > 0x2000) {
+        //  jmp
+        unsigned data = 0x940c;
+        page_buffer [ 0 ] = data >> 0 & 0xff;
+        page_buffer [ 1 ] = data >> 8 & 0xff;
+        page_buffer [ 2 ] = deviceHandle->bootloader_start >> 0 & 0xff;
+        page_buffer [ 3 ] = deviceHandle->bootloader_start >> 8 & 0xff;
+      } else {
+        // rjmp
+        unsigned data =  0xc000 | ((deviceHandle->bootloader_start/2 - 1) & 0x0fff);
+        page_buffer [ 0 ] = data >> 0 & 0xff;
+        page_buffer [ 1 ] = data >> 8 & 0xff;
+      }
+
+    }
+
+    if ( address >= deviceHandle->bootloader_start - deviceHandle->page_size ) {
+      // move user reset vector to end of last page
+      // The reset vector is always the last vector in the tinyvectortable
+      unsigned int user_reset_addr = (deviceHandle->pages*deviceHandle->page_size) - 4;
+
+      if (user_reset_addr > 0x2000) {
+        //  jmp
+        unsigned data = 0x940c;
+        page_buffer [user_reset_addr - address + 0] = data >> 0 & 0xff;
+        page_buffer [user_reset_addr - address + 1] = data >> 8 & 0xff;
+        page_buffer [user_reset_addr - address + 2] = *userReset >> 0 & 0xff;
+        page_buffer [user_reset_addr - address + 3] = *userReset >> 8 & 0xff;
+      } else {
+        // rjmp
+        unsigned data =  0xc000 | ((*userReset - user_reset_addr/2 - 1) & 0x0fff);
+        page_buffer [user_reset_addr - address + 0] = data >> 0 & 0xff;
+        page_buffer [user_reset_addr - address + 1] = data >> 8 & 0xff;
+      }
+    }
+  }
+
+  // a page of 0xFF in a gap of the program is left erased, older bootloaders get all pages up to the end
+  if (deviceHandle->version.major >= 2 && pagecontainsdata) {
+    pagecontainsdata = 0;
+    for (page_address = 0; page_address < page_length; page_address++) {
+      if (page_buffer[page_address] != 0xFF) {
+        pagecontainsdata = 1;
+        break;
       }
     }
+  }
+
+  // always write last page so bootloader can insert the tiny vector table
+  if ( address >= deviceHandle->bootloader_start - deviceHandle->page_size )
+    pagecontainsdata = 1;
+
+  return pagecontainsdata;
+}
+
+/*
+ * True if the page at address is the first one of an erase block. A device with erase on write erases
+ * the block when this page is written, so it is written even if empty. Otherwise pages without data
+ * would keep the content of the previous program, since such a device is not erased before.
+ */
+static int micronucleus_firstPageOfBlock(micronucleus* deviceHandle, unsigned int address) {
+  return address % (deviceHandle->page_size * deviceHandle->erase_block_pages) == 0;
+}
+
+#define COPY_CANDIDATE_LIMIT 256 // words compared per search, keeps long chains of common words fast
+
+/*
+ * Index of the flash content written in this session, to find words which the device
+ * can copy from its own flash instead of receiving them with cmd_write_data.
+ */
+typedef struct _micronucleus_copyIndex {
+  unsigned char *flash; // flash content below end
+  unsigned int end;     // flash is written up to this address, copies must not read beyond
+  int *head;            // index of the last word with this value, -1 = none
+  int *prev;            // index of the previous word with the same value, -1 = none
+} micronucleus_copyIndex;
+
+static int micronucleus_initCopyIndex(micronucleus_copyIndex* index, unsigned int flash_size) {
+  unsigned int i;
+
+  index->end = 0;
+  index->flash = malloc(flash_size);
+  index->head = malloc(0x10000 * sizeof(int));
+  index->prev = malloc(flash_size / 2 * sizeof(int));
+  if (!index->flash || !index->head || !index->prev) return -ENOMEM;
+
+  for (i = 0; i < 0x10000; i++) index->head[i] = -1;
+  return 0;
+}
+
+static void micronucleus_freeCopyIndex(micronucleus_copyIndex* index) {
+  free(index->flash);
+  free(index->head);
+  free(index->prev);
+}
+
+/*
+ * Add a written page to the index. Only pages directly following the indexed content are added.
+ */
+static void micronucleus_addToCopyIndex(micronucleus_copyIndex* index, unsigned int address,
+                                        unsigned char* page_buffer, unsigned int page_length) {
+  unsigned int i;
+
+  if (address != index->end) return;
+
+  memcpy(index->flash + address, page_buffer, page_length);
+  for (i = address / 2; i < (address + page_length) / 2; i++) {
+    unsigned int word = (index->flash[2 * i + 1] << 8) + index->flash[2 * i];
+    index->prev[i] = index->head[word];
+    index->head[word] = i;
+  }
+  index->end = address + page_length;
+}
+
+/*
+ * Search the indexed flash for the longest match of up to max_words words of data.
+ * Returns the number of matching words and their flash address in source.
+ */
+static unsigned int micronucleus_findCopy(micronucleus_copyIndex* index, unsigned char* data, unsigned int max_words,
+                                          unsigned int* source) {
+  unsigned int best = 0;
+  unsigned int candidates = 0;
+  int i = index->head[(data[1] << 8) + data[0]];
 
+  while (i >= 0 && candidates++ < COPY_CANDIDATE_LIMIT && best < max_words) {
+    unsigned int length = 0;
+    while (length < max_words && 2 * (i + length) < index->end
+           && !memcmp(index->flash + 2 * (i + length), data + 2 * length, 2)) {
+      length++;
+    }
+    if (length > best) {
+      best = length;
+      *source = 2 * i;
+    }
+    i = index->prev[i];
+  }
+  return best;
+}
 
-    // always write last page so bootloader can insert the tiny vector table
-    if ( address >= deviceHandle->bootloader_start - deviceHandle->page_size )
-      pagecontainsdata = 1;
+/*
+ * Ask the microcontroller to write the page at address, without waiting until it is written.
+ * With the fill and copy extension, runs of equal words and words found in copy_index (may be NULL)
+ * are sent with one request each.
+ */
+static int micronucleus_sendPage(micronucleus* deviceHandle, unsigned int address, unsigned int page_length,
+                                 unsigned char* page_buffer, micronucleus_copyIndex* copy_index) {
+  int res = 0;
 
+  if (deviceHandle->version.major == 1) {
+    // Firmware rev.1 transfers a page as a single block and does not report errors
     // ask microcontroller to write this page's data
-    if (pagecontainsdata) {
-
-      if (deviceHandle->version.major == 1) {
-        // Firmware rev.1 transfers a page as a single block
-        // ask microcontroller to write this page's data
-        res = usb_control_msg(deviceHandle->device,
-               USB_ENDPOINT_OUT| USB_TYPE_VENDOR | USB_RECIP_DEVICE,
-               1,
-               page_length, address,
-               page_buffer, page_length,
-               MICRONUCLEUS_USB_TIMEOUT);
-      } else if (deviceHandle->version.major >= 2) {
-        // Firmware rev.2 uses individual set up packets to transfer data
-        res = usb_control_msg(deviceHandle->device, USB_ENDPOINT_OUT| USB_TYPE_VENDOR | USB_RECIP_DEVICE, 1, page_length, address, NULL, 0, MICRONUCLEUS_USB_TIMEOUT);
-        if (res) return res;
-        int i;
+    micronucleus_controlMsg(deviceHandle,
+           MICRONUCLEUS_REQUEST_OUT,
+           1,
+           page_length, address,
+           (char *)page_buffer, page_length,
+           MICRONUCLEUS_USB_TIMEOUT);
+  } else if (deviceHandle->extension_feature_flags & PAGE_DATA_TRANSFER_FEATURE_FLAG) {
+    // Firmware with the page data transfer extension takes the whole page in the data stage of one transfer
+    res = micronucleus_controlMsg(deviceHandle, MICRONUCLEUS_REQUEST_OUT, 5, page_length, address, (char *)page_buffer, page_length, MICRONUCLEUS_USB_TIMEOUT);
+    if (res < 0) return res;
+    if (res != (int) page_length) return -EIO;
+    res = 0;
+  } else if (deviceHandle->version.major >= 2) {
+    // Firmware rev.2 uses individual set up packets to transfer data, which are sent as one sequence
+    micronucleus_request requests[page_length / 2 + 1];
+    unsigned int count = 0;
+    unsigned int i = 0;
 
-        for (i=0; i< page_length; i+=4)
-        {
-          int w1,w2;
-          w1=(page_buffer[i+1]<<8)+(page_buffer[i+0]<<0);
-          w2=(page_buffer[i+3]<<8)+(page_buffer[i+2]<<0);
+    requests[count++] = (micronucleus_request) { 1, page_length, address };
 
-          res = usb_control_msg(deviceHandle->device, USB_ENDPOINT_OUT| USB_TYPE_VENDOR | USB_RECIP_DEVICE, 3, w1, w2, NULL, 0, MICRONUCLEUS_USB_TIMEOUT);
-          if (res) return res;
+    while (i < page_length)
+    {
+      int w1,w2;
+      w1=(page_buffer[i+1]<<8)+(page_buffer[i+0]<<0);
+
+      if (deviceHandle->extension_feature_flags & FILL_AND_COPY_FEATURE_FLAG) {
+        // The device stops filling at the end of the page. A single remaining word must be filled,
+        // since cmd_write_data would write beyond the page.
+        unsigned int words = (page_length - i) / 2;
+        unsigned int run = 1;
+        unsigned int copy = 0;
+        unsigned int source = 0;
+
+        while (run < words && !memcmp(page_buffer + i, page_buffer + i + 2 * run, 2)) run++;
+        if (copy_index) copy = micronucleus_findCopy(copy_index, page_buffer + i, words, &source);
+
+        if (copy > run && copy >= 3) {
+          requests[count++] = (micronucleus_request) { 10, source, copy };
+          i += 2 * copy;
+          continue;
+        }
+        if (run >= 3 || words == 1) {
+          requests[count++] = (micronucleus_request) { 9, w1, run };
+          i += 2 * run;
+          continue;
         }
       }
-    /*
-      res = usb_control_msg(deviceHandle->device,
-             USB_ENDPOINT_OUT| USB_TYPE_VENDOR | USB_RECIP_DEVICE,
-             1,
-             page_length, address,
-             (char*)page_buffer, page_length,
-             MICRONUCLEUS_USB_TIMEOUT);
-
-      if (res != page_length) return -1;
-    */
-      // give microcontroller enough time to write this page and come back online
+
+      w2=(page_buffer[i+3]<<8)+(page_buffer[i+2]<<0);
+
+      requests[count++] = (micronucleus_request) { 3, w1, w2 };
+      i += 4;
+    }
+
+    res = micronucleus_sendRequests(deviceHandle, requests, count);
+  }
+  return res;
+}
+
+/*
+ * Ask the microcontroller to write the page at address and wait until it is written.
+ */
+static int micronucleus_transferPage(micronucleus* deviceHandle, unsigned int address, unsigned int page_length,
+                                     unsigned char* page_buffer, micronucleus_copyIndex* copy_index) {
+  micronucleus_stats* stats = deviceHandle->stats;
+  unsigned int start = micros();
+  unsigned int sent;
+  int res = micronucleus_sendPage(deviceHandle, address, page_length, page_buffer, copy_index);
+
+  sent = micros();
+  if (res == 0) {
+    // give microcontroller enough time to write this page and come back online
+    if (deviceHandle->extension_feature_flags & STATUS_REQUEST_FEATURE_FLAG) {
+      res = micronucleus_waitReady(deviceHandle, deviceHandle->write_sleep, 4 * deviceHandle->write_sleep);
+    } else {
       delay(deviceHandle->write_sleep);
     }
+  }
+
+  if (stats && stats->page_count < MICRONUCLEUS_MAX_PAGES) {
+    stats->page_address[stats->page_count] = address;
+    stats->page_transfer_time[stats->page_count] = sent - start;
+    stats->page_wait_time[stats->page_count] = micros() - sent;
+    stats->page_count++;
+  }
+  return res;
+}
+
+int micronucleus_writeFlash(micronucleus* deviceHandle, unsigned int program_size, unsigned char* program, micronucleus_callback prog, void* user_data) {
+  unsigned int start = micros();
+  unsigned char page_length = deviceHandle->page_size;
+  unsigned char page_buffer[page_length];
+  unsigned int  address; // overall flash memory address
+  int           res = 0;
+  unsigned int  userReset = 0;
+  micronucleus_copyIndex copy_index;
+  micronucleus_copyIndex* copy_index_ptr = NULL;
+
+  if (deviceHandle->extension_feature_flags & FILL_AND_COPY_FEATURE_FLAG) {
+    copy_index_ptr = &copy_index;
+    res = micronucleus_initCopyIndex(copy_index_ptr, deviceHandle->bootloader_start);
+    if (res) {
+      micronucleus_freeCopyIndex(copy_index_ptr);
+      return res;
+    }
+  }
+
+  for (address = 0; address < deviceHandle->flash_size; address += deviceHandle->page_size) {
+    // work around a bug in older bootloader versions
+    if (deviceHandle->version.major == 1 && deviceHandle->version.minor <= 2
+        && address / deviceHandle->page_size == deviceHandle->pages - 1) {
+      page_length = deviceHandle->flash_size % deviceHandle->page_size;
+    }
+
+    res = micronucleus_preparePage(deviceHandle, address, page_length, program_size, program, page_buffer, &userReset);
+    if (res < 0) break;
+
+    // with erase on write, the flash is not erased before, the first page of each block erases it
+    if ((deviceHandle->extension_feature_flags & ERASE_ON_WRITE_FEATURE_FLAG) && micronucleus_firstPageOfBlock(deviceHandle, address))
+      res = 1;
+
+    // ask microcontroller to write this page's data
+    if (res) {
+      res = micronucleus_transferPage(deviceHandle, address, page_length, page_buffer, copy_index_ptr);
+      if (res) break;
+      if (copy_index_ptr) micronucleus_addToCopyIndex(copy_index_ptr, address, page_buffer, page_length);
+    }
 
   // call progress update callback if that's a thing
-  if (prog) prog(((float) address) / ((float) deviceHandle->flash_size));
+  if (prog) prog(user_data, ((float) address) / ((float) deviceHandle->flash_size));
+
+  }
+
+  if (deviceHandle->stats) deviceHandle->stats->write_time = micros() - start;
+  if (copy_index_ptr) micronucleus_freeCopyIndex(copy_index_ptr);
+  if (res) return res;
+
+  // call progress update callback with completion status
+  if (prog) prog(user_data, 1.0);
+
+  return 0;
+}
+
+/*
+ * CRC16 of a prepared page as reported by cmd_get_page_crc. A device with a postscript of 6 bytes stores
+ * OSCCAL in the word before the tiny vector table and reports it as erased, so it is masked here, too.
+ */
+static unsigned int micronucleus_pageCrc(micronucleus* deviceHandle, unsigned int address, unsigned char* page_buffer) {
+  unsigned int page_length = deviceHandle->page_size;
+  unsigned int osccal = deviceHandle->bootloader_start - 6;
+  unsigned char page[page_length];
+
+  memcpy(page, page_buffer, page_length);
+  if (deviceHandle->bootloader_start - deviceHandle->flash_size >= 6 && osccal >= address && osccal < address + page_length) {
+    page[osccal - address] = 0xFF;
+    page[osccal - address + 1] = 0xFF;
+  }
+  return micronucleus_crc16(page, page_length);
+}
+
+/*
+ * Compare, erase and rewrite the erase blocks for micronucleus_updateFlash().
+ * A device with erase on write erases a block when its first page is written, so the
+ * block is not erased before and its first page is always written. Only the first block
+ * written is still erased when it is not at address zero, since the device does not take
+ * the address of a page transfer before page zero is written.
+ */
+static int micronucleus_updateBlocks(micronucleus* deviceHandle, unsigned int program_size, unsigned char* program, micronucleus_callback prog, void* user_data) {
+  unsigned int  page_length = deviceHandle->page_size;
+  unsigned int  block_pages = deviceHandle->erase_block_pages;
+  unsigned char block_buffer[page_length * block_pages];
+  int           pagecontainsdata[block_pages];
+  unsigned int  block_address; // address of the first page of an erase block
+  unsigned int  i;
+  int           res;
+  unsigned int  userReset = 0;
+  int           erase_on_write = deviceHandle->extension_feature_flags & ERASE_ON_WRITE_FEATURE_FLAG;
+  int           written = 0;
+
+  if (!(deviceHandle->extension_feature_flags & PAGE_CRC_FEATURE_FLAG)) return -ENOSYS;
+
+  for (block_address = 0; block_address < deviceHandle->bootloader_start; block_address += page_length * block_pages) {
+    int changed = 0;
+
+    for (i = 0; i < block_pages; i++) {
+      unsigned int address = block_address + i * page_length;
+      unsigned char* page_buffer = block_buffer + i * page_length;
+
+      res = micronucleus_preparePage(deviceHandle, address, page_length, program_size, program, page_buffer, &userReset);
+      if (res < 0) return res;
+      pagecontainsdata[i] = res;
+
+      // Pages not used by the program are compared, too, the block is erased if they are not empty
+      if (!changed) {
+        unsigned char crc[2];
+        res = micronucleus_controlMsg(deviceHandle, MICRONUCLEUS_REQUEST_IN, 7, 0, address, (char *)crc, 2, MICRONUCLEUS_USB_TIMEOUT);
+        if (res < 0) return res;
+        if (res != 2) return -EIO;
+        if ((unsigned int) (crc[1] << 8 | crc[0]) != micronucleus_pageCrc(deviceHandle, address, page_buffer)) changed = 1;
+      }
+    }
 
+    if (changed && (!erase_on_write || (!written && block_address))) {
+      // erase the block, which also sets the address for the following page transfers
+      res = micronucleus_controlMsg(deviceHandle, MICRONUCLEUS_REQUEST_OUT, 8, 0, block_address, NULL, 0, MICRONUCLEUS_USB_TIMEOUT);
+      if (res) return res;
+      if (deviceHandle->extension_feature_flags & STATUS_REQUEST_FEATURE_FLAG) {
+        res = micronucleus_waitReady(deviceHandle, deviceHandle->write_sleep, 4 * deviceHandle->write_sleep);
+        if (res) return res;
+      } else {
+        delay(deviceHandle->write_sleep);
+      }
+    }
+
+    if (changed) {
+      // all pages of the block are erased, so all of them which are used must be written again
+      for (i = 0; i < block_pages; i++) {
+        if (pagecontainsdata[i] || (erase_on_write && i == 0)) {
+          res = micronucleus_transferPage(deviceHandle, block_address + i * page_length, page_length, block_buffer + i * page_length, NULL);
+          if (res) return res;
+          written = 1;
+        }
+      }
+    }
+
+    // call progress update callback if that's a thing
+    if (prog) prog(user_data, ((float) block_address) / ((float) deviceHandle->flash_size));
   }
 
   // call progress update callback with completion status
-  if (prog) prog(1.0);
+  if (prog) prog(user_data, 1.0);
 
   return 0;
 }
 
+int micronucleus_updateFlash(micronucleus* deviceHandle, unsigned int program_size, unsigned char* program, micronucleus_callback prog, void* user_data) {
+  unsigned int start = micros();
+  int res = micronucleus_updateBlocks(deviceHandle, program_size, program, prog, user_data);
+
+  if (deviceHandle->stats) deviceHandle->stats->write_time = micros() - start;
+  return res;
+}
+
 int micronucleus_startApp(micronucleus* deviceHandle) {
+  unsigned int start = micros();
   int res;
-  res = usb_control_msg(deviceHandle->device, USB_ENDPOINT_OUT| USB_TYPE_VENDOR | USB_RECIP_DEVICE, 4, 0, 0, NULL, 0, MICRONUCLEUS_USB_TIMEOUT);
+  if (deviceHandle->extension_feature_flags & IDLE_CONTROL_FEATURE_FLAG) {
+    // an idle time of 0 does not wait for the 5 ms timeout of cmd_exit
+    res = micronucleus_controlMsg(deviceHandle, MICRONUCLEUS_REQUEST_OUT, 11, 0, 0, NULL, 0, MICRONUCLEUS_USB_TIMEOUT);
+  } else {
+    res = micronucleus_controlMsg(deviceHandle, MICRONUCLEUS_REQUEST_OUT, 4, 0, 0, NULL, 0, MICRONUCLEUS_USB_TIMEOUT);
+  }
+  if (deviceHandle->stats) deviceHandle->stats->run_time = micros() - start;
 
   if(res!=0)
     return res;
@@ -351,5 +1263,491 @@ int micronucleus_startApp(micronucleus* deviceHandle) {
     return 0;
 }
 
+int micronucleus_setIdleTime(micronucleus* deviceHandle, unsigned int milliseconds) {
+  unsigned int ticks = (milliseconds + 4) / 5; // the bootloader counts 5 ms main loop passes
+
+  if (!(deviceHandle->extension_feature_flags & IDLE_CONTROL_FEATURE_FLAG)) return -ENOSYS;
+  if (milliseconds > 0xFFFF * 5) return -EINVAL;
+
+  return micronucleus_controlMsg(deviceHandle, MICRONUCLEUS_REQUEST_OUT, 11, ticks, 0, NULL, 0, MICRONUCLEUS_USB_TIMEOUT);
+}
+
+
+
+
+int micronucleus_createPlan(micronucleus* deviceHandle, unsigned int program_size, unsigned char* program, micronucleus_plan* plan) {
+  unsigned int page_length = deviceHandle->page_size;
+  unsigned int address;
+  unsigned int userReset = 0;
+  int res;
 
+  memset(plan, 0, sizeof(*plan));
 
+  // Firmware rev.1 patches the vectors itself and has a different page layout
+  if (deviceHandle->version.major < 2) return -ENOSYS;
+
+  plan->flash_size = deviceHandle->flash_size;
+  plan->page_size = page_length;
+  plan->bootloader_start = deviceHandle->bootloader_start;
+  plan->erase_block_pages = deviceHandle->erase_block_pages;
+  plan->signature1 = deviceHandle->signature1;
+  plan->signature2 = deviceHandle->signature2;
+  plan->program_size = program_size;
+  plan->addresses = malloc(deviceHandle->pages * sizeof(unsigned int));
+  plan->pages = malloc(deviceHandle->pages * page_length);
+  if (!plan->addresses || !plan->pages) {
+    micronucleus_freePlan(plan);
+    return -ENOMEM;
+  }
+
+  for (address = 0; address < deviceHandle->bootloader_start; address += page_length) {
+    unsigned char* page_buffer = plan->pages + plan->page_count * page_length;
+
+    res = micronucleus_preparePage(deviceHandle, address, page_length, program_size, program, page_buffer, &userReset);
+    if (res < 0) {
+      micronucleus_freePlan(plan);
+      return res;
+    }
+
+    // the first page of each block erases it on devices with erase on write, the others skip it if empty
+    if (res || micronucleus_firstPageOfBlock(deviceHandle, address)) {
+      plan->addresses[plan->page_count++] = address;
+    }
+  }
+
+  plan->hash = micronucleus_crc32(plan->pages, plan->page_count * page_length);
+  return 0;
+}
+
+void micronucleus_freePlan(micronucleus_plan* plan) {
+  free(plan->addresses);
+  if (plan->mapping) {
+#if defined _WIN32
+    free(plan->mapping);
+#else
+    munmap(plan->mapping, plan->mapping_size);
+#endif
+  } else {
+    free(plan->pages);
+  }
+  plan->addresses = NULL;
+  plan->pages = NULL;
+  plan->mapping = NULL;
+  plan->page_count = 0;
+}
+
+/*
+ * Plan file layout, all numbers little endian:
+ *   0  "MNPL"
+ *   4  format version (2 bytes), header size (2 bytes)
+ *   8  flash_size, page_size, bootloader_start, erase_block_pages, program_size, page_count (4 bytes each)
+ *  32  signature1, signature2, 2 reserved bytes
+ *  36  CRC-32 of the pages
+ *  40  bitmap with one bit per page below bootloader_start, set if the page is written
+ *      followed by the content of the written pages
+ */
+#define PLAN_FORMAT_VERSION 2 // version 1 did not contain the first page of blocks without data
+#define PLAN_HEADER_SIZE 40
+
+static void micronucleus_putLong(unsigned char* buffer, unsigned int value) {
+  buffer[0] = value;
+  buffer[1] = value >> 8;
+  buffer[2] = value >> 16;
+  buffer[3] = value >> 24;
+}
+
+static unsigned int micronucleus_getLong(const unsigned char* buffer) {
+  return buffer[0] | buffer[1] << 8 | buffer[2] << 16 | (unsigned int) buffer[3] << 24;
+}
+
+int micronucleus_savePlan(micronucleus_plan* plan, const char* filename) {
+  unsigned int bitmap_size = (plan->bootloader_start / plan->page_size + 7) / 8;
+  unsigned char header[PLAN_HEADER_SIZE];
+  unsigned char bitmap[bitmap_size];
+  unsigned int i;
+  FILE* output;
+  int res = 0;
+
+  memset(header, 0, sizeof(header));
+  memcpy(header, "MNPL", 4);
+  header[4] = PLAN_FORMAT_VERSION;
+  header[6] = PLAN_HEADER_SIZE;
+  micronucleus_putLong(header + 8, plan->flash_size);
+  micronucleus_putLong(header + 12, plan->page_size);
+  micronucleus_putLong(header + 16, plan->bootloader_start);
+  micronucleus_putLong(header + 20, plan->erase_block_pages);
+  micronucleus_putLong(header + 24, plan->program_size);
+  micronucleus_putLong(header + 28, plan->page_count);
+  header[32] = plan->signature1;
+  header[33] = plan->signature2;
+  micronucleus_putLong(header + 36, plan->hash);
+
+  memset(bitmap, 0, bitmap_size);
+  for (i = 0; i < plan->page_count; i++) {
+    unsigned int page = plan->addresses[i] / plan->page_size;
+    bitmap[page / 8] |= 1 << (page % 8);
+  }
+
+  output = fopen(filename, "wb");
+  if (output == NULL) return -errno;
+  if (fwrite(header, sizeof(header), 1, output) != 1
+      || fwrite(bitmap, bitmap_size, 1, output) != 1
+      || (plan->page_count && fwrite(plan->pages, plan->page_count * plan->page_size, 1, output) != 1)) {
+    res = -EIO;
+  }
+  if (fclose(output) != 0 && res == 0) res = -EIO;
+  return res;
+}
+
+int micronucleus_loadPlan(const char* filename, micronucleus_plan* plan) {
+  unsigned char* data;
+  size_t size;
+  unsigned int bitmap_size, page, i;
+
+  memset(plan, 0, sizeof(*plan));
+
+#if defined _WIN32
+  FILE* input = fopen(filename, "rb");
+  if (input == NULL) return -errno;
+  fseek(input, 0, SEEK_END);
+  size = ftell(input);
+  fseek(input, 0, SEEK_SET);
+  data = malloc(size ? size : 1);
+  if (data == NULL || fread(data, 1, size, input) != size) {
+    free(data);
+    fclose(input);
+    return -EIO;
+  }
+  fclose(input);
+#else
+  struct stat file_status;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) return -errno;
+  if (fstat(fd, &file_status) < 0 || file_status.st_size < PLAN_HEADER_SIZE) {
+    close(fd);
+    return -EINVAL;
+  }
+  size = file_status.st_size;
+  data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) return -errno;
+#endif
+  plan->mapping = data;
+  plan->mapping_size = size;
+
+  if (size < PLAN_HEADER_SIZE || memcmp(data, "MNPL", 4)
+      || micronucleus_getLong(data + 4) != (PLAN_FORMAT_VERSION | PLAN_HEADER_SIZE << 16)) {
+    micronucleus_freePlan(plan);
+    return -EINVAL;
+  }
+
+  plan->flash_size = micronucleus_getLong(data + 8);
+  plan->page_size = micronucleus_getLong(data + 12);
+  plan->bootloader_start = micronucleus_getLong(data + 16);
+  plan->erase_block_pages = micronucleus_getLong(data + 20);
+  plan->program_size = micronucleus_getLong(data + 24);
+  plan->page_count = micronucleus_getLong(data + 28);
+  plan->signature1 = data[32];
+  plan->signature2 = data[33];
+  plan->hash = micronucleus_getLong(data + 36);
+
+  if (plan->page_size == 0 || plan->bootloader_start > 0x10000 || plan->page_count > plan->bootloader_start / plan->page_size) {
+    micronucleus_freePlan(plan);
+    return -EINVAL;
+  }
+  bitmap_size = (plan->bootloader_start / plan->page_size + 7) / 8;
+  if (size != PLAN_HEADER_SIZE + bitmap_size + (size_t) plan->page_count * plan->page_size) {
+    micronucleus_freePlan(plan);
+    return -EINVAL;
+  }
+
+  plan->pages = data + PLAN_HEADER_SIZE + bitmap_size;
+  plan->addresses = malloc((plan->page_count + 1) * sizeof(unsigned int));
+  if (plan->addresses == NULL) {
+    micronucleus_freePlan(plan);
+    return -ENOMEM;
+  }
+
+  i = 0;
+  for (page = 0; page < plan->bootloader_start / plan->page_size; page++) {
+    if (data[PLAN_HEADER_SIZE + page / 8] & (1 << (page % 8))) {
+      if (i == plan->page_count) break;
+      plan->addresses[i++] = page * plan->page_size;
+    }
+  }
+
+  if (page < plan->bootloader_start / plan->page_size || i != plan->page_count
+      || micronucleus_crc32(plan->pages, plan->page_count * plan->page_size) != plan->hash) {
+    micronucleus_freePlan(plan);
+    return -EINVAL;
+  }
+  return 0;
+}
+
+int micronucleus_checkPlan(micronucleus* deviceHandle, micronucleus_plan* plan) {
+  if (deviceHandle->version.major < 2
+      || deviceHandle->flash_size != plan->flash_size
+      || deviceHandle->page_size != plan->page_size
+      || deviceHandle->bootloader_start != plan->bootloader_start
+      || deviceHandle->erase_block_pages != plan->erase_block_pages
+      || deviceHandle->signature1 != plan->signature1
+      || deviceHandle->signature2 != plan->signature2) {
+    return -EINVAL;
+  }
+  return 0;
+}
+
+/*
+ * True if page i of the plan is empty and only written to erase its block on a device with erase on write.
+ * Other devices are erased before, so they skip it.
+ */
+static int micronucleus_skipPlanPage(micronucleus* deviceHandle, micronucleus_plan* plan, unsigned int i) {
+  unsigned char* page_buffer = plan->pages + i * plan->page_size;
+  unsigned int j;
+
+  if (deviceHandle->extension_feature_flags & ERASE_ON_WRITE_FEATURE_FLAG) return 0;
+  for (j = 0; j < plan->page_size; j++) {
+    if (page_buffer[j] != 0xFF) return 0;
+  }
+  return 1;
+}
+
+int micronucleus_writePlan(micronucleus* deviceHandle, micronucleus_plan* plan, micronucleus_callback progress, void* user_data) {
+  micronucleus_copyIndex copy_index;
+  micronucleus_copyIndex* copy_index_ptr = NULL;
+  unsigned int i;
+  unsigned int start = micros();
+  int res = micronucleus_checkPlan(deviceHandle, plan);
+
+  if (res) return res;
+
+  if (deviceHandle->extension_feature_flags & FILL_AND_COPY_FEATURE_FLAG) {
+    copy_index_ptr = &copy_index;
+    res = micronucleus_initCopyIndex(copy_index_ptr, deviceHandle->bootloader_start);
+    if (res) {
+      micronucleus_freeCopyIndex(copy_index_ptr);
+      return res;
+    }
+  }
+
+  // the pages are sent straight from the plan, which is already patched
+  for (i = 0; i < plan->page_count; i++) {
+    unsigned char* page_buffer = plan->pages + i * plan->page_size;
+
+    if (micronucleus_skipPlanPage(deviceHandle, plan, i)) continue;
+    res = micronucleus_transferPage(deviceHandle, plan->addresses[i], plan->page_size, page_buffer, copy_index_ptr);
+    if (res) break;
+    if (copy_index_ptr) micronucleus_addToCopyIndex(copy_index_ptr, plan->addresses[i], page_buffer, plan->page_size);
+
+    if (progress) progress(user_data, (float) i / (float) plan->page_count);
+  }
+
+  if (deviceHandle->stats) deviceHandle->stats->write_time = micros() - start;
+  if (copy_index_ptr) micronucleus_freeCopyIndex(copy_index_ptr);
+  if (res) return res;
+
+  if (progress) progress(user_data, 1.0);
+  return 0;
+}
+
+#define GANG_RECONNECT_TIME 5000 // milliseconds a device lost during the erase may take to come back after it
+
+// states of a device programmed by micronucleus_gangProgram()
+enum {
+  GANG_ERASE,
+  GANG_ERASE_WAIT,
+  GANG_RECONNECT,
+  GANG_WRITE,
+  GANG_WRITE_WAIT,
+  GANG_RUN,
+  GANG_DONE
+};
+
+typedef struct _micronucleus_session {
+  micronucleus* device;
+  int state;
+  unsigned int page;        // index of the next page of the plan to write
+  unsigned int ready_time;  // millis() when the device may be polled or the next request be sent
+  unsigned int deadline;    // millis() when waiting for the device fails
+  int result;
+} micronucleus_session;
+
+/*
+ * Let the session wait at least min_sleep and, if the device answers status requests, at most max_sleep.
+ */
+static void micronucleus_sessionWait(micronucleus_session* session, int state, unsigned int min_sleep, unsigned int max_sleep) {
+  unsigned int now = millis();
+
+  session->state = state;
+  session->ready_time = now + min_sleep;
+  session->deadline = now + max_sleep;
+}
+
+/*
+ * Advance the session by one step. Returns 1 if a request was sent, 0 if the device is still busy.
+ */
+static int micronucleus_sessionStep(micronucleus_library* library, micronucleus_session* session, micronucleus_plan* plan, int run) {
+  micronucleus* deviceHandle = session->device;
+  int status_request = deviceHandle->extension_feature_flags & STATUS_REQUEST_FEATURE_FLAG;
+  int res = 0;
+
+  if ((int) (millis() - session->ready_time) < 0) return 0;
+
+  switch (session->state) {
+  case GANG_ERASE: {
+    unsigned int end_address;
+    unsigned int erase_sleep = micronucleus_eraseTime(deviceHandle, plan->program_size, &end_address);
+
+    res = micronucleus_controlMsg(deviceHandle, MICRONUCLEUS_REQUEST_OUT, 2, 0, end_address, NULL, 0, MICRONUCLEUS_USB_TIMEOUT);
+    // the erase request is often aborted by the busy device, which may reconnect, see micronucleus_eraseFlash()
+    if (res == -5 || res == -32 || res == -34 || res == -71 || res == -84) {
+      micronucleus_closeDevice(deviceHandle);
+      micronucleus_sessionWait(session, GANG_RECONNECT, erase_sleep, erase_sleep + GANG_RECONNECT_TIME);
+      res = 0;
+    } else if (deviceHandle->extension_feature_flags & INCREMENTAL_ERASE_FEATURE_FLAG) {
+      micronucleus_sessionWait(session, GANG_ERASE_WAIT, deviceHandle->write_sleep, 4 * erase_sleep);
+    } else {
+      micronucleus_sessionWait(session, GANG_ERASE_WAIT, erase_sleep, 2 * erase_sleep);
+    }
+    break;
+  }
+  case GANG_RECONNECT: {
+    // open the device at the same port again, like the command line tool does after a lost erase
+    micronucleus* reopened = micronucleus_open(library, deviceHandle->port_path, 1);
+
+    if (deviceHandle->stats) deviceHandle->stats->retries++;
+    if (reopened) {
+      // the handle of the caller is kept, only the handle of the transport is replaced
+      deviceHandle->device = reopened->device;
+      reopened->device = NULL;
+      micronucleus_close(reopened);
+      micronucleus_sessionWait(session, GANG_ERASE_WAIT, 0, deviceHandle->erase_sleep);
+    } else if ((int) (millis() - session->deadline) >= 0) {
+      res = -ENODEV;
+    } else {
+      session->ready_time = millis() + 100;
+    }
+    break;
+  }
+  case GANG_WRITE: {
+    unsigned char* page_buffer;
+
+    // the last page holds the tiny vector table and is never skipped
+    while (micronucleus_skipPlanPage(deviceHandle, plan, session->page)) session->page++;
+    page_buffer = plan->pages + session->page * plan->page_size;
+
+    res = micronucleus_sendPage(deviceHandle, plan->addresses[session->page], plan->page_size, page_buffer, NULL);
+    session->page++;
+    micronucleus_sessionWait(session, GANG_WRITE_WAIT, deviceHandle->write_sleep, 4 * deviceHandle->write_sleep);
+    break;
+  }
+  case GANG_ERASE_WAIT:
+  case GANG_WRITE_WAIT:
+    if (status_request) {
+      unsigned char status[2];
+
+      res = micronucleus_controlMsg(deviceHandle, MICRONUCLEUS_REQUEST_IN, 6, 0, 0, (char *)status, 2, MICRONUCLEUS_POLL_TIMEOUT);
+      if (res >= 0 && res != 2) {
+        res = -EIO;
+        break;
+      }
+      if (res < 0 && !micronucleus_noAnswer(res)) break;
+      if (res != 2 || status[0] != 0 || status[1] != 0) {
+        if ((int) (millis() - session->deadline) >= 0) {
+          res = (res < 0) ? res : -ETIMEDOUT;
+        } else {
+          session->ready_time = millis() + 1;
+          res = 0;
+        }
+        break;
+      }
+      res = 0;
+    }
+    session->state = (session->page < plan->page_count) ? GANG_WRITE : GANG_RUN;
+    break;
+  case GANG_RUN:
+    if (run) res = micronucleus_startApp(deviceHandle);
+    session->state = GANG_DONE;
+    break;
+  }
+
+  if (res < 0) {
+    session->result = res;
+    session->state = GANG_DONE;
+  }
+  return 1;
+}
+
+int micronucleus_gangProgram(micronucleus_library* library, micronucleus** devices, int count, micronucleus_plan* plan, int run,
+                             int* results, micronucleus_callback progress, void* user_data) {
+  micronucleus_session sessions[count];
+  unsigned int total_pages = count * plan->page_count;
+  int failed = 0;
+  int active = count;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    micronucleus* deviceHandle = devices[i];
+
+    sessions[i].device = deviceHandle;
+    sessions[i].page = 0;
+    sessions[i].ready_time = millis();
+    sessions[i].result = 0;
+    // devices with erase on write do not need to be erased before
+    sessions[i].state = (deviceHandle->extension_feature_flags & ERASE_ON_WRITE_FEATURE_FLAG) ? GANG_WRITE : GANG_ERASE;
+
+    if (micronucleus_checkPlan(deviceHandle, plan)) {
+      sessions[i].result = -EINVAL;
+      sessions[i].state = GANG_DONE;
+      active--;
+    }
+  }
+
+  // The devices are served round robin, so one of them is sent requests while the others write their flash
+  while (active > 0) {
+    int busy = 1;
+    unsigned int written = 0;
+
+    active = 0;
+    for (i = 0; i < count; i++) {
+      if (sessions[i].state != GANG_DONE) {
+        if (micronucleus_sessionStep(library, &sessions[i], plan, run)) busy = 0;
+      }
+      if (sessions[i].state != GANG_DONE) active++;
+      written += (sessions[i].state == GANG_DONE) ? plan->page_count : sessions[i].page;
+    }
+
+    if (progress) progress(user_data, total_pages ? (float) written / (float) total_pages : 1.0f);
+    if (busy) delay(1);
+  }
+
+  for (i = 0; i < count; i++) {
+    if (results) results[i] = sessions[i].result;
+    if (sessions[i].result) failed++;
+  }
+  return failed;
+}
+
+static int micronucleus_compareLatency(const void* a, const void* b) {
+  unsigned int x = *(const unsigned int*) a;
+  unsigned int y = *(const unsigned int*) b;
+  return (x > y) - (x < y);
+}
+
+unsigned int micronucleus_getLatency(micronucleus_stats* stats, unsigned int percent) {
+  unsigned int index;
+
+  if (stats->latency_count == 0) return 0;
+  qsort(stats->latencies, stats->latency_count, sizeof(unsigned int), micronucleus_compareLatency);
+
+  // nearest rank
+  index = (stats->latency_count * percent + 99) / 100;
+  if (index > 0) index--;
+  if (index >= stats->latency_count) index = stats->latency_count - 1;
+  return stats->latencies[index];
+}
+
+void micronucleus_resetStats(micronucleus_stats* stats) {
+  free(stats->latencies);
+  memset(stats, 0, sizeof(*stats));
+}
@@ -29,24 +29,38 @@
 /********************************************************************************
 * Header files
 ********************************************************************************/
-#if defined _WIN32
-#include <lusb0_usb.h>         // libusb-win32
-#else
-#include <usb.h>
-#endif
-
 //#include "opendevice.h"      // common code moved to separate module
 #include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
 /*******************************************************************************/
 
+/********************************************************************************
+* Library version
+*     The major version changes with incompatible changes of the API or of the
+*     micronucleus struct, it is the soname version of the shared library.
+********************************************************************************/
+#define MICRONUCLEUS_LIB_VERSION_MAJOR 1
+#define MICRONUCLEUS_LIB_VERSION_MINOR 0
+#define MICRONUCLEUS_LIB_VERSION "1.0"
+
+// Only the functions declared here are exported from the shared library, which is built with -fvisibility=hidden
+#if defined _WIN32 && defined MICRONUCLEUS_SHARED
+#define MICRONUCLEUS_API __declspec(dllexport)
+#elif defined __GNUC__
+#define MICRONUCLEUS_API __attribute__((visibility("default")))
+#else
+#define MICRONUCLEUS_API
+#endif
+/*******************************************************************************/
+
 /********************************************************************************
 * USB details
 ********************************************************************************/
 #define MICRONUCLEUS_VENDOR_ID   0x16D0
 #define MICRONUCLEUS_PRODUCT_ID  0x0753
 #define MICRONUCLEUS_USB_TIMEOUT 0x2800 // 10 seconds - timeout is in milliseconds. 65 seconds makes no sense for an individual USB transfer.
+#define MICRONUCLEUS_POLL_TIMEOUT 50 // milliseconds. Status polls fail fast while the device CPU is halted by SPM.
 #define MICRONUCLEUS_MAX_MAJOR_VERSION 2
 
 /*******************************************************************************/
@@ -74,9 +88,57 @@ typedef struct _micronucleus_version {
 #define FAST_EXIT_FEATURE_FLAG 0x10
 #define SAVE_MCUSR_FEATURE_FLAG 0x20
 
+// Definitions for extension_feature_flags below. Must be the same as used in firmware/main.c.
+#define PAGE_DATA_TRANSFER_FEATURE_FLAG 0x01
+#define STATUS_REQUEST_FEATURE_FLAG 0x02
+#define BOUNDED_ERASE_FEATURE_FLAG 0x04
+#define PAGE_CRC_FEATURE_FLAG 0x08
+#define INCREMENTAL_ERASE_FEATURE_FLAG 0x10
+#define ERASE_ON_WRITE_FEATURE_FLAG 0x20
+#define FILL_AND_COPY_FEATURE_FLAG 0x40
+#define IDLE_CONTROL_FEATURE_FLAG 0x80
+
+#define MICRONUCLEUS_MAX_PAGES 2048 // 64 KB of 32 byte pages
+
+// timing statistics of an upload in microseconds, collected if the stats of the device handle are set
+typedef struct _micronucleus_stats {
+  // wall clock time of the phases
+  unsigned int erase_time;
+  unsigned int write_time;
+  unsigned int run_time;
+  // written pages with the time to send them and the time until the device finished writing them
+  unsigned int page_count;
+  unsigned int page_address[MICRONUCLEUS_MAX_PAGES];
+  unsigned int page_transfer_time[MICRONUCLEUS_MAX_PAGES];
+  unsigned int page_wait_time[MICRONUCLEUS_MAX_PAGES];
+  // control transfers
+  unsigned int transfer_count;
+  unsigned int transfer_errors;
+  unsigned int retries;       // attempts to open the device again after the connection was lost during the erase
+  unsigned int status_polls;
+  unsigned int busy_polls;    // polls repeated because the device was busy or did not answer
+  unsigned int* latencies;    // latency of each transfer, see micronucleus_getLatency()
+  unsigned int latency_count;
+  unsigned int latency_capacity;
+} micronucleus_stats;
+
+// file of recorded control transfers, see micronucleus_openTrace()
+typedef struct _micronucleus_trace micronucleus_trace;
+
+// USB library or kernel interface used to talk to the devices, see micronucleus_setTransport()
+typedef struct _micronucleus_transport micronucleus_transport;
+
+// transport selection and transport state of one user of the library, see micronucleus_openLibrary()
+typedef struct _micronucleus_library micronucleus_library;
+
 // handle representing one micronucleus device
 typedef struct _micronucleus {
-  usb_dev_handle *device;
+  void *device;             // handle of the transport
+  const micronucleus_transport *transport;
+  void *transport_context;  // state of the transport in the library handle the device was opened with
+  // position on the bus
+  unsigned int bus;         // bus number
+  char port_path[32];       // bus and port numbers like "1-2.4", "bus:device" like "001:005" with libusb-0.1
   // general information about device
   micronucleus_version version;
   unsigned int flash_size;  // programmable size (in bytes) of progmem
@@ -85,40 +147,294 @@ typedef struct _micronucleus {
   unsigned int pages;       // total number of pages to program
   unsigned int write_sleep; // milliseconds
   unsigned int erase_sleep; // milliseconds
+  unsigned int erase_block_pages; // pages erased at once, 4 for the ATtiny841/441
   unsigned char signature1; // only used in protocol v2
   unsigned char signature2; // only used in protocol v2
   unsigned char bootloader_feature_flags; // additions to protocol v2
   unsigned char application_version; // additions to protocol v2
+  unsigned char extension_feature_flags; // optional protocol extensions, 0 for older firmware
+  micronucleus_stats* stats; // timing statistics, NULL if not collected
+  micronucleus_trace* trace; // control transfers are recorded to or replayed from this trace, NULL if none
 } micronucleus;
 
-typedef void (*micronucleus_callback)(float progress);
+// progress callback, user_data is passed through unchanged from the caller
+typedef void (*micronucleus_callback)(void* user_data, float progress);
 
+// pages of a program prepared for all devices of the same type, see micronucleus_createPlan()
+typedef struct _micronucleus_plan {
+  // geometry of the devices the plan is made for
+  unsigned int flash_size;
+  unsigned int page_size;
+  unsigned int bootloader_start;
+  unsigned int erase_block_pages;
+  unsigned char signature1;
+  unsigned char signature2;
+  unsigned int program_size;  // end address of the program, used for bounded erase
+  unsigned int page_count;    // number of pages to write
+  unsigned int* addresses;    // address of each page to write
+  unsigned char* pages;       // page_count * page_size bytes with the patched page content
+  unsigned int hash;          // CRC-32 of the pages, identifies the build
+  void* mapping;              // file mapped by micronucleus_loadPlan(), NULL if the pages are allocated
+  size_t mapping_size;
+} micronucleus_plan;
+
+/*******************************************************************************/
+
+/********************************************************************************
+* Get the version of the library, which may differ from MICRONUCLEUS_LIB_VERSION
+* of the header the program was compiled with
+*     Returns: version string like "1.0"
+********************************************************************************/
+MICRONUCLEUS_API const char* micronucleus_libraryVersion(void);
+/*******************************************************************************/
+
+/********************************************************************************
+* Create a library handle, which holds the selected transport and the state of the
+* transports, like the libusb-1.0 context or the emulated device.
+* Library handles share nothing, so each thread or job can use its own.
+*     Returns: library handle for success, NULL if out of memory
+********************************************************************************/
+MICRONUCLEUS_API micronucleus_library* micronucleus_openLibrary(void);
+/*******************************************************************************/
+
+/********************************************************************************
+* Free the library handle, the devices opened with it must be closed before
+********************************************************************************/
+MICRONUCLEUS_API void micronucleus_closeLibrary(micronucleus_library* library);
+/*******************************************************************************/
+
+/********************************************************************************
+* Select the transport used to find and open devices
+*     name: "libusb0", "libusb1", "usbfs" (Linux only) or "emulator", if it was compiled into the library.
+*           Options follow after a colon, like "emulator:t841_default,spm=4500,frame=1000".
+*     The first transport returned by micronucleus_getTransport() is used by default.
+*     The options apply to this library handle only.
+*     Returns: 0 for success, -ENOENT if the transport is not available,
+*              -EINVAL if it has no such options, -EBUSY if its device is open
+********************************************************************************/
+MICRONUCLEUS_API int micronucleus_setTransport(micronucleus_library* library, const char* name);
+/*******************************************************************************/
+
+/********************************************************************************
+* Get the name of an available transport
+*     index: 0 for the default transport
+*     Returns: name, NULL if index is not less than the number of transports
+********************************************************************************/
+MICRONUCLEUS_API const char* micronucleus_getTransport(int index);
 /*******************************************************************************/
 
 /********************************************************************************
 * Try to connect to the device
 *     Returns: device handle for success, NULL for fail
 ********************************************************************************/
-micronucleus* micronucleus_connect(int fast_mode);
+MICRONUCLEUS_API micronucleus* micronucleus_connect(micronucleus_library* library, int fast_mode);
+/*******************************************************************************/
+
+/********************************************************************************
+* Connect to all devices on the bus
+*     devices: array of at least max_devices entries, receives the device handles
+*     Returns: number of devices found
+********************************************************************************/
+MICRONUCLEUS_API int micronucleus_enumerate(micronucleus_library* library, micronucleus** devices, int max_devices, int fast_mode);
+/*******************************************************************************/
+
+/********************************************************************************
+* Connect to the device at port_path, as reported in port_path by micronucleus_enumerate()
+*     port_path: NULL to connect to any device
+*     Returns: device handle for success, NULL for fail
+********************************************************************************/
+MICRONUCLEUS_API micronucleus* micronucleus_open(micronucleus_library* library, const char* port_path, int fast_mode);
+/*******************************************************************************/
+
+/********************************************************************************
+* Close the device and free the device handle
+********************************************************************************/
+MICRONUCLEUS_API void micronucleus_close(micronucleus* deviceHandle);
+/*******************************************************************************/
+
+/********************************************************************************
+* Wait until a device is plugged in and connect to it
+*     port_path: NULL to connect to any device, see micronucleus_open()
+*     timeout: seconds, 0 to wait forever
+*     With libusb-1.0 hotplug support the device is connected as soon as it is
+*     enumerated, otherwise the bus is scanned every 100 ms.
+*     Returns: device handle for success, NULL for timeout
+********************************************************************************/
+MICRONUCLEUS_API micronucleus* micronucleus_waitForDevice(micronucleus_library* library, const char* port_path, int fast_mode, unsigned int timeout);
+/*******************************************************************************/
+
+/********************************************************************************
+* Open a trace of control transfers
+*     replay: 0 to create filename and record the transfers of the devices passed to
+*             micronucleus_traceDevice(), 1 to read it for micronucleus_replayDevice()
+*     The trace is a text file with one line per transfer: start time and duration in
+*     microseconds, request type, request, value, index, length, result and the bytes
+*     transferred in hex. Lines starting with # are comments or start a new device.
+*     Returns: trace for success, NULL with errno set for fail
+********************************************************************************/
+MICRONUCLEUS_API micronucleus_trace* micronucleus_openTrace(const char* filename, int replay);
+/*******************************************************************************/
+
+/********************************************************************************
+* Close a trace, after all devices using it have been closed
+********************************************************************************/
+MICRONUCLEUS_API void micronucleus_closeTrace(micronucleus_trace* trace);
+/*******************************************************************************/
+
+/********************************************************************************
+* Record all further control transfers of the device to a trace opened for recording
+*     The configuration of the device is requested once more, so the trace starts
+*     with it. A device connected again after a lost connection is added the same way.
+*     Returns: 0 for success, -EINVAL if the trace is opened for replay
+********************************************************************************/
+MICRONUCLEUS_API int micronucleus_traceDevice(micronucleus* deviceHandle, micronucleus_trace* trace);
+/*******************************************************************************/
+
+/********************************************************************************
+* Create a device handle which answers all control transfers from the next device of a trace
+*     The transfers must be made in the recorded order with the same request, value,
+*     index and length, otherwise they fail with -EBADMSG. Each transfer takes as long
+*     as the recorded one, so the timing of an upload can be compared offline.
+*     Returns: device handle for success, NULL if the trace contains no further device
+********************************************************************************/
+MICRONUCLEUS_API micronucleus* micronucleus_replayDevice(micronucleus_trace* trace, int fast_mode);
+/*******************************************************************************/
+
+/********************************************************************************
+* Create a device handle for the bootloader of a firmware/configuration directory without a device
+*     It has the geometry of the bootloader without protocol extensions and can only be
+*     passed to micronucleus_createPlan() and micronucleus_close().
+*     Returns: device handle for success, NULL if the configuration is unknown
+********************************************************************************/
+MICRONUCLEUS_API micronucleus* micronucleus_targetDevice(const char* configuration);
 /*******************************************************************************/
 
 /********************************************************************************
 * Erase the flash memory
+*     program_size: end address of the program to be written afterwards, 0 to erase all.
+*                   Only used if the device supports bounded erase.
 ********************************************************************************/
-int micronucleus_eraseFlash(micronucleus* deviceHandle, micronucleus_callback progress);
+MICRONUCLEUS_API int micronucleus_eraseFlash(micronucleus* deviceHandle, unsigned int program_size, micronucleus_callback progress, void* user_data);
+/*******************************************************************************/
+
+/********************************************************************************
+* Check a program before a device is connected
+*     The reset vector must contain a branch, so the bootloader can patch in its own.
+*     Returns: 0 for success, -ENOEXEC otherwise
+********************************************************************************/
+MICRONUCLEUS_API int micronucleus_checkProgram(unsigned int program_length, unsigned char* program);
 /*******************************************************************************/
 
 /********************************************************************************
 * Write the flash memory
+*     The flash must be erased before, unless the device supports erase on write.
+********************************************************************************/
+MICRONUCLEUS_API int micronucleus_writeFlash(micronucleus* deviceHandle, unsigned int program_length,
+                            unsigned char* program, micronucleus_callback progress, void* user_data);
+/*******************************************************************************/
+
+/********************************************************************************
+* Write only the pages which differ from the flash content of the device
+*     Requires a device with the page CRC extension, returns -ENOSYS otherwise.
+*     The flash must not be erased before. Blocks with old content past the end of the
+*     program are erased.
 ********************************************************************************/
-int micronucleus_writeFlash(micronucleus* deviceHandle, unsigned int program_length,
-                            unsigned char* program, micronucleus_callback progress);
+MICRONUCLEUS_API int micronucleus_updateFlash(micronucleus* deviceHandle, unsigned int program_length,
+                             unsigned char* program, micronucleus_callback progress, void* user_data);
 /*******************************************************************************/
 
 /********************************************************************************
 * Starts the user application
+*     A device with idle control starts it right after the reply, others after a 5 ms timeout.
+********************************************************************************/
+MICRONUCLEUS_API int micronucleus_startApp(micronucleus* deviceHandle);
+/*******************************************************************************/
+
+/********************************************************************************
+* Set the time the bootloader waits for further requests before it starts the user application
+*     milliseconds: rounded up to 5 ms, at most 327675. 0 starts the application at once.
+*     Each further request restarts the timeout of the bootloader configuration.
+*     Requires a device with idle control, returns -ENOSYS otherwise.
+*     Returns: 0 for success, -EINVAL if milliseconds is too large, a negative error otherwise
+********************************************************************************/
+MICRONUCLEUS_API int micronucleus_setIdleTime(micronucleus* deviceHandle, unsigned int milliseconds);
+/*******************************************************************************/
+
+/********************************************************************************
+* Prepare the pages of a program for writing them to devices of the same type as deviceHandle
+*     The plan is only read by micronucleus_gangProgram() and can be shared by any
+*     number of sessions. Requires protocol v2, returns -ENOSYS otherwise.
+*     Empty pages are left out, except the first page of each erase block, which erases
+*     the block on devices with erase on write. Other devices skip it.
+*     Returns: 0 for success, a negative error otherwise
+********************************************************************************/
+MICRONUCLEUS_API int micronucleus_createPlan(micronucleus* deviceHandle, unsigned int program_length,
+                            unsigned char* program, micronucleus_plan* plan);
+/*******************************************************************************/
+
+/********************************************************************************
+* Free the pages of a plan created by micronucleus_createPlan() or micronucleus_loadPlan()
+********************************************************************************/
+MICRONUCLEUS_API void micronucleus_freePlan(micronucleus_plan* plan);
+/*******************************************************************************/
+
+/********************************************************************************
+* Save a plan to a file, which can be loaded again without parsing and patching the program
+*     Returns: 0 for success, a negative error otherwise
+********************************************************************************/
+MICRONUCLEUS_API int micronucleus_savePlan(micronucleus_plan* plan, const char* filename);
+/*******************************************************************************/
+
+/********************************************************************************
+* Load a plan saved by micronucleus_savePlan()
+*     The file is memory mapped where possible, the pages are sent from the mapping.
+*     Returns: 0 for success, -EINVAL if the file is no valid plan or another negative error
+********************************************************************************/
+MICRONUCLEUS_API int micronucleus_loadPlan(const char* filename, micronucleus_plan* plan);
+/*******************************************************************************/
+
+/********************************************************************************
+* Check if the plan was made for a device of the same type as deviceHandle
+*     Returns: 0 if it matches, -EINVAL otherwise
+********************************************************************************/
+MICRONUCLEUS_API int micronucleus_checkPlan(micronucleus* deviceHandle, micronucleus_plan* plan);
+/*******************************************************************************/
+
+/********************************************************************************
+* Write the pages of a plan to the flash memory
+*     The flash must be erased before, unless the device supports erase on write.
+*     Returns: 0 for success, -EINVAL if the plan does not match the device or another negative error
+********************************************************************************/
+MICRONUCLEUS_API int micronucleus_writePlan(micronucleus* deviceHandle, micronucleus_plan* plan,
+                                            micronucleus_callback progress, void* user_data);
+/*******************************************************************************/
+
+/********************************************************************************
+* Get a percentile of the control transfer latencies collected in stats
+*     percent: 0 to 100, 50 for the median and 100 for the maximum
+*     With libusb-1.0 and usbfs the latency of a queued request is the time since the previous one completed.
+*     Returns: latency in microseconds, 0 if no transfer was recorded
+********************************************************************************/
+MICRONUCLEUS_API unsigned int micronucleus_getLatency(micronucleus_stats* stats, unsigned int percent);
+/*******************************************************************************/
+
+/********************************************************************************
+* Free the latencies collected in stats and reset all statistics
+********************************************************************************/
+MICRONUCLEUS_API void micronucleus_resetStats(micronucleus_stats* stats);
+/*******************************************************************************/
+
+/********************************************************************************
+* Erase and write the plan to all devices at once, and start the application if run is set
+*     Each device is erased, written and started by its own state machine. Requests are
+*     sent to one device while the others are busy writing their flash.
+*     A device lost during the erase is opened again at its port_path with library.
+*     results: array of count entries (may be NULL), receives 0 or a negative error per device.
+*              Devices which do not match the geometry of the plan fail with -EINVAL.
+*     Returns: number of devices which failed
 ********************************************************************************/
-int micronucleus_startApp(micronucleus* deviceHandle);
+MICRONUCLEUS_API int micronucleus_gangProgram(micronucleus_library* library, micronucleus** devices, int count,
+                             micronucleus_plan* plan, int run, int* results, micronucleus_callback progress, void* user_data);
 /*******************************************************************************/
 
 #endif
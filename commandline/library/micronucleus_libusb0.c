@@ -0,0 +1,102 @@
+/*
+  USB transport of the Micronucleus library with libusb-0.1, libusb-compat or libusb-win32
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "micronucleus_transport.h"
+
+#include <string.h>
+#include <errno.h>
+
+#if defined _WIN32
+#include <lusb0_usb.h>         // libusb-win32
+#else
+#include <usb.h>
+#endif
+
+static int micronucleus_libusb0Scan(void* context, micronucleus_found* found, int max_found, const char* port_path) {
+  struct usb_bus *bus;
+  char path[sizeof(found->port_path)];
+  int count = 0;
+
+  (void) context;
+  // Initialize USB and find micronucleus device
+  usb_init();
+  usb_find_busses();
+  usb_find_devices();
+
+  for (bus = usb_get_busses(); bus && count < max_found; bus = bus->next) {
+    struct usb_device *dev;
+
+    for (dev = bus->devices; dev && count < max_found; dev = dev->next) {
+      usb_dev_handle *handle;
+
+      /* Check if this device is a micronucleus */
+      if (dev->descriptor.idVendor != MICRONUCLEUS_VENDOR_ID || dev->descriptor.idProduct != MICRONUCLEUS_PRODUCT_ID) continue;
+
+      // libusb-0.1 does not know the ports, the device number changes with each enumeration
+      snprintf(path, sizeof(path), "%.15s:%.15s", bus->dirname, dev->filename);
+      if (port_path && strcmp(port_path, path)) continue;
+
+      errno = 0;
+      handle = usb_open(dev);
+      if (errno == 13) {
+              fprintf(stderr, "usb_open(): %s. For Linux, copy file https://github.com/micronucleus/micronucleus/blob/master/commandline/49-micronucleus.rules to /etc/udev/rules.d.\n", strerror(errno));
+              if (handle) usb_close(handle);
+              continue;
+      }
+      if (!handle) {
+              fprintf(stderr, "Error opening bus %s device %s: %s\n", bus->dirname, dev->filename, strerror(errno));
+              continue;
+      }
+
+      found[count].handle = handle;
+      found[count].bcdDevice = dev->descriptor.bcdDevice;
+      found[count].bus = atoi(bus->dirname);
+      strcpy(found[count].port_path, path);
+      count++;
+    }
+  }
+  return count;
+}
+
+static int micronucleus_libusb0Control(void* context, void* handle, int requesttype, int request, int value, int index,
+                                       char* bytes, int size, int timeout) {
+  (void) context;
+  return usb_control_msg(handle, requesttype, request, value, index, bytes, size, timeout);
+}
+
+static void micronucleus_libusb0Close(void* context, void* handle) {
+  (void) context;
+  usb_close(handle);
+}
+
+const micronucleus_transport micronucleus_libusb0 = {
+  "libusb0",
+  NULL, // no state
+  NULL,
+  micronucleus_libusb0Scan,
+  micronucleus_libusb0Control,
+  NULL, // one request at a time
+  micronucleus_libusb0Close,
+  NULL, // no hotplug events, the bus is scanned
+  NULL,
+  NULL  // no options
+};
@@ -0,0 +1,269 @@
+/*
+  USB transport of the Micronucleus library with libusb-1.0, which queues all requests of a page
+  at once and connects to a device as soon as the hotplug event arrives
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "micronucleus_transport.h"
+#include "littleWire_util.h"
+
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <libusb.h>
+
+// state of the transport in a library handle
+typedef struct _micronucleus_usbContext {
+  libusb_context *usb;
+  libusb_hotplug_callback_handle hotplug;
+  int hotplug_arrived;
+} micronucleus_usbContext;
+
+/*
+ * Convert libusb-1.0 error codes to the negative errno values returned by libusb-0.1 and this library
+ */
+static int micronucleus_errno(int libusb_error) {
+  switch (libusb_error) {
+    case LIBUSB_ERROR_INVALID_PARAM: return -EINVAL;
+    case LIBUSB_ERROR_ACCESS:        return -EACCES;
+    case LIBUSB_ERROR_NO_DEVICE:     return -ENODEV;
+    case LIBUSB_ERROR_NOT_FOUND:     return -ENOENT;
+    case LIBUSB_ERROR_BUSY:          return -EBUSY;
+    case LIBUSB_ERROR_TIMEOUT:       return -ETIMEDOUT;
+    case LIBUSB_ERROR_OVERFLOW:      return -EOVERFLOW;
+    case LIBUSB_ERROR_PIPE:          return -EPIPE;
+    case LIBUSB_ERROR_INTERRUPTED:   return -EINTR;
+    case LIBUSB_ERROR_NO_MEM:        return -ENOMEM;
+    case LIBUSB_ERROR_NOT_SUPPORTED: return -ENOSYS;
+    default:                         return -EIO;
+  }
+}
+
+static void* micronucleus_libusb1Init(void) {
+  micronucleus_usbContext *context = calloc(1, sizeof(micronucleus_usbContext));
+
+  if (context && libusb_init(&context->usb) < 0) {
+    free(context);
+    return NULL;
+  }
+  return context;
+}
+
+static void micronucleus_libusb1Exit(void* context) {
+  libusb_exit(((micronucleus_usbContext *) context)->usb);
+  free(context);
+}
+
+static int micronucleus_libusb1Scan(void* context, micronucleus_found* found, int max_found, const char* port_path) {
+  micronucleus_usbContext *usb_context = context;
+  char path[sizeof(found->port_path)];
+  libusb_device **list;
+  ssize_t count, i;
+  int opened = 0;
+
+  // Find micronucleus device, USB was initialized with the library handle
+  if (!usb_context) return 0;
+
+  count = libusb_get_device_list(usb_context->usb, &list);
+  if (count < 0) return 0;
+
+  for (i = 0; i < count && opened < max_found; i++) {
+    struct libusb_device_descriptor descriptor;
+    libusb_device_handle *handle;
+    uint8_t ports[7];
+    int port_count, port, length;
+
+    if (libusb_get_device_descriptor(list[i], &descriptor) < 0) continue;
+
+    /* Check if this device is a micronucleus */
+    if (descriptor.idVendor != MICRONUCLEUS_VENDOR_ID || descriptor.idProduct != MICRONUCLEUS_PRODUCT_ID) continue;
+
+    // Same format as the Linux sysfs device names, e.g. 1-2.4
+    length = snprintf(path, sizeof(path), "%d", libusb_get_bus_number(list[i]));
+    port_count = libusb_get_port_numbers(list[i], ports, sizeof(ports));
+    for (port = 0; port < port_count && length < (int) sizeof(path); port++) {
+      length += snprintf(path + length, sizeof(path) - length, "%c%d", port ? '.' : '-', ports[port]);
+    }
+    if (port_path && strcmp(port_path, path)) continue;
+
+    int res = libusb_open(list[i], &handle);
+    if (res == LIBUSB_ERROR_ACCESS) {
+      fprintf(stderr, "libusb_open(): %s. For Linux, copy file https://github.com/micronucleus/micronucleus/blob/master/commandline/49-micronucleus.rules to /etc/udev/rules.d.\n", libusb_strerror(res));
+      continue;
+    }
+    if (res < 0) {
+      fprintf(stderr, "Error opening device %s: %s\n", path, libusb_strerror(res));
+      continue;
+    }
+
+    found[opened].handle = handle;
+    found[opened].bcdDevice = descriptor.bcdDevice;
+    found[opened].bus = libusb_get_bus_number(list[i]);
+    strcpy(found[opened].port_path, path);
+    opened++;
+  }
+
+  libusb_free_device_list(list, 1);
+  return opened;
+}
+
+static int micronucleus_libusb1Control(void* context, void* handle, int requesttype, int request, int value, int index,
+                                       char* bytes, int size, int timeout) {
+  int res;
+
+  (void) context;
+  res = libusb_control_transfer(handle, requesttype, request, value, index, (unsigned char *)bytes, size, timeout);
+  return (res < 0) ? micronucleus_errno(res) : res;
+}
+
+typedef struct _micronucleus_pipeline {
+  int pending; // submitted transfers not yet completed
+  int error;   // first error, 0 if all transfers completed
+  micronucleus_requestDone done;
+  void* user_data;
+} micronucleus_pipeline;
+
+// user data of a transfer, the request it sends and the pipeline it belongs to
+typedef struct _micronucleus_submitted {
+  micronucleus_pipeline* pipeline;
+  const micronucleus_request* request;
+} micronucleus_submitted;
+
+static void LIBUSB_CALL micronucleus_transferDone(struct libusb_transfer *transfer) {
+  micronucleus_submitted *submitted = transfer->user_data;
+  micronucleus_pipeline *pipeline = submitted->pipeline;
+  int res;
+
+  switch (transfer->status) {
+    case LIBUSB_TRANSFER_COMPLETED: res = transfer->actual_length; break;
+    case LIBUSB_TRANSFER_TIMED_OUT: res = -ETIMEDOUT; break;
+    case LIBUSB_TRANSFER_STALL:     res = -EPIPE; break;
+    case LIBUSB_TRANSFER_NO_DEVICE: res = -ENODEV; break;
+    case LIBUSB_TRANSFER_OVERFLOW:  res = -EOVERFLOW; break;
+    default:                        res = -EIO; break;
+  }
+
+  pipeline->done(pipeline->user_data, submitted->request, res, micros());
+  pipeline->pending--;
+  if (res < 0 && !pipeline->error) pipeline->error = res;
+}
+
+static int micronucleus_libusb1Submit(void* context, void* handle, const micronucleus_request* requests,
+                                      unsigned int count, int timeout, micronucleus_requestDone done, void* user_data) {
+  struct libusb_transfer *transfers[count];
+  unsigned char setup[count][LIBUSB_CONTROL_SETUP_SIZE];
+  micronucleus_submitted submitted_requests[count];
+  micronucleus_pipeline pipeline = { 0, 0, done, user_data };
+  unsigned int submitted, i;
+  int cancelled = 0;
+
+  for (submitted = 0; submitted < count; submitted++) {
+    transfers[submitted] = libusb_alloc_transfer(0);
+    if (!transfers[submitted]) {
+      pipeline.error = -ENOMEM;
+      break;
+    }
+    submitted_requests[submitted].pipeline = &pipeline;
+    submitted_requests[submitted].request = &requests[submitted];
+    libusb_fill_control_setup(setup[submitted], MICRONUCLEUS_REQUEST_OUT, requests[submitted].request,
+                              requests[submitted].value, requests[submitted].index, 0);
+    libusb_fill_control_transfer(transfers[submitted], handle, setup[submitted],
+                                 micronucleus_transferDone, &submitted_requests[submitted], timeout);
+    int res = libusb_submit_transfer(transfers[submitted]);
+    if (res) {
+      libusb_free_transfer(transfers[submitted]);
+      pipeline.error = micronucleus_errno(res);
+      break;
+    }
+    pipeline.pending++;
+  }
+
+  while (pipeline.pending) {
+    if (pipeline.error && !cancelled) {
+      // the device did not get all requests of this sequence, drop the rest
+      for (i = 0; i < submitted; i++) libusb_cancel_transfer(transfers[i]);
+      cancelled = 1;
+    }
+    libusb_handle_events(((micronucleus_usbContext *) context)->usb);
+  }
+
+  for (i = 0; i < submitted; i++) libusb_free_transfer(transfers[i]);
+  return pipeline.error;
+}
+
+static void micronucleus_libusb1Close(void* context, void* handle) {
+  (void) context;
+  libusb_close(handle);
+}
+
+static int LIBUSB_CALL micronucleus_deviceArrived(libusb_context *context, libusb_device *device,
+                                                  libusb_hotplug_event event, void *user_data) {
+  (void) context;
+  (void) device;
+  (void) event;
+  *(int *) user_data = 1;
+  return 0; // keep the callback registered
+}
+
+static int micronucleus_libusb1Watch(void* context, int enable) {
+  micronucleus_usbContext *usb_context = context;
+
+  if (!usb_context) return -ENOSYS;
+  if (!enable) {
+    libusb_hotplug_deregister_callback(usb_context->usb, usb_context->hotplug);
+    return 0;
+  }
+
+  // Registering reports the devices which are already plugged in, too
+  usb_context->hotplug_arrived = 0;
+  if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)
+      || libusb_hotplug_register_callback(usb_context->usb, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+                                          LIBUSB_HOTPLUG_ENUMERATE, MICRONUCLEUS_VENDOR_ID, MICRONUCLEUS_PRODUCT_ID,
+                                          LIBUSB_HOTPLUG_MATCH_ANY, micronucleus_deviceArrived,
+                                          &usb_context->hotplug_arrived, &usb_context->hotplug) != 0) {
+    return -ENOSYS;
+  }
+  return 0;
+}
+
+static int micronucleus_libusb1Arrived(void* context, unsigned int milliseconds) {
+  micronucleus_usbContext *usb_context = context;
+  struct timeval poll_time = { milliseconds / 1000, (milliseconds % 1000) * 1000 };
+
+  if (!usb_context->hotplug_arrived) {
+    libusb_handle_events_timeout_completed(usb_context->usb, &poll_time, &usb_context->hotplug_arrived);
+  }
+  if (!usb_context->hotplug_arrived) return 0;
+  usb_context->hotplug_arrived = 0;
+  return 1;
+}
+
+const micronucleus_transport micronucleus_libusb1 = {
+  "libusb1",
+  micronucleus_libusb1Init,
+  micronucleus_libusb1Exit,
+  micronucleus_libusb1Scan,
+  micronucleus_libusb1Control,
+  micronucleus_libusb1Submit,
+  micronucleus_libusb1Close,
+  micronucleus_libusb1Watch,
+  micronucleus_libusb1Arrived,
+  NULL  // no options
+};
@@ -0,0 +1,157 @@
+#ifndef MICRONUCLEUS_TRANSPORT_H
+#define MICRONUCLEUS_TRANSPORT_H
+
+/*
+  USB transports of the Micronucleus library, the interface between micronucleus_lib.c
+  and libusb-0.1, libusb-1.0, the Linux usbfs ioctls or the emulated bootloader. Not installed with the library.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "micronucleus_lib.h"
+
+/********************************************************************************
+* Declarations
+********************************************************************************/
+// bmRequestType of the vendor requests to the device
+#define MICRONUCLEUS_REQUEST_IN  0xC0 // device to host, vendor, device
+#define MICRONUCLEUS_REQUEST_OUT 0x40 // host to device, vendor, device
+
+// vendor request without data stage
+typedef struct _micronucleus_request {
+  int request;
+  int value;
+  int index;
+} micronucleus_request;
+
+// micronucleus device found on the bus and opened by a transport
+typedef struct _micronucleus_found {
+  void* handle;             // passed to the other functions of the transport
+  unsigned int bcdDevice;   // firmware version
+  unsigned int bus;         // bus number
+  char port_path[sizeof(((micronucleus*) 0)->port_path)];
+} micronucleus_found;
+
+// called by submit for each completed request with its result and the micros() of its completion
+typedef void (*micronucleus_requestDone)(void* user_data, const micronucleus_request* request, int result, unsigned int time);
+
+struct _micronucleus_transport {
+  const char* name;
+
+  /*
+   * Create the state of the transport for a library handle, it is passed as context to the other functions.
+   * Returns NULL if the transport can not be used. NULL if the transport keeps no state.
+   */
+  void* (*init)(void);
+
+  // Free the state created by init, the devices of the transport are closed already. NULL if there is no state.
+  void (*exit)(void* context);
+
+  /*
+   * Open the micronucleus devices on the bus, only the one at port_path if it is not NULL.
+   * Devices which can not be opened are skipped, the reason is printed.
+   * Returns the number of devices stored in found, at most max_found.
+   */
+  int (*scan)(void* context, micronucleus_found* found, int max_found, const char* port_path);
+
+  /*
+   * Blocking control transfer.
+   * Returns the number of bytes transferred or a negative errno value.
+   */
+  int (*control)(void* context, void* handle, int requesttype, int request, int value, int index, char* bytes, int size, int timeout);
+
+  /*
+   * Send OUT requests without data stage back to back and wait until all of them completed.
+   * The remaining requests are cancelled after the first error.
+   * Returns 0 or the first error. NULL if the transport sends only one request at a time.
+   */
+  int (*submit)(void* context, void* handle, const micronucleus_request* requests, unsigned int count, int timeout,
+                micronucleus_requestDone done, void* user_data);
+
+  void (*close)(void* context, void* handle);
+
+  /*
+   * Enable or disable hotplug events. The devices already plugged in are reported as arrived, too.
+   * Returns 0 for success. NULL if the transport has no hotplug events.
+   */
+  int (*watch)(void* context, int enable);
+
+  /*
+   * Wait up to milliseconds for a hotplug event of a micronucleus device.
+   * Returns 1 if a device arrived, 0 otherwise.
+   */
+  int (*arrived)(void* context, unsigned int milliseconds);
+
+  /*
+   * Apply the options given after the colon of "name:options" to micronucleus_setTransport().
+   * Returns 0 for success, a negative errno value otherwise. NULL if the transport has no options.
+   */
+  int (*configure)(void* context, const char* options);
+};
+
+#if defined MICRONUCLEUS_LIBUSB0
+extern const micronucleus_transport micronucleus_libusb0;
+#endif
+#if defined MICRONUCLEUS_LIBUSB1
+extern const micronucleus_transport micronucleus_libusb1;
+#endif
+#if defined MICRONUCLEUS_USBFS
+extern const micronucleus_transport micronucleus_usbfs;
+#endif
+#if defined MICRONUCLEUS_EMULATOR
+extern const micronucleus_transport micronucleus_emulator;
+#endif
+
+// values of firmware/main.c
+#define MICRONUCLEUS_FIRMWARE_VERSION 0x0206 // bcdDevice
+#define TINYVECTOR_RESET_OFFSET  4
+#define TINYVECTOR_OSCCAL_OFFSET 6
+
+// geometry of a bootloader of firmware/configuration/*, from its Makefile.inc, bootloaderconfig.h and device
+typedef struct _micronucleus_geometry {
+  const char* name;
+  unsigned int bootloader_address; // BOOTLOADER_ADDRESS
+  unsigned int page_size;          // SPM_PAGESIZE
+  unsigned int erase_block_pages;  // ERASE_BLOCK_SIZE / SPM_PAGESIZE
+  unsigned char write_sleep;       // MICRONUCLEUS_WRITE_SLEEP
+  unsigned char signature1;
+  unsigned char signature2;
+  unsigned char entrymode;         // ENTRYMODE
+  int osccal_save_calib;           // OSCCAL_SAVE_CALIB
+  int halts;                       // CPU halted during SPM, the ATmegas keep running and NAK instead
+} micronucleus_geometry;
+
+// all configurations, the first one is t85_default, ends with a NULL name, see micronucleus_geometry.c
+extern const micronucleus_geometry micronucleus_geometries[];
+
+/*
+ * Find the geometry of the configuration name.
+ * Returns NULL if there is no such configuration.
+ */
+const micronucleus_geometry* micronucleus_findGeometry(const char* name);
+
+/*
+ * Write the reply of cmd_device_info of the bootloader compiled with the extension flags to reply.
+ * Returns its length, 8 bytes or 9 bytes with extensions.
+ */
+unsigned int micronucleus_geometryConfiguration(const micronucleus_geometry* geometry, unsigned char extensions,
+                                                unsigned char* reply);
+/*******************************************************************************/
+
+#endif
@@ -0,0 +1,202 @@
+/*
+  USB transport of the Micronucleus library with the usbfs ioctls of the Linux kernel.
+  Needs no libusb, the devices are found in sysfs and opened in /dev/bus/usb.
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy of
+  this software and associated documentation files (the "Software"), to deal in
+  the Software without restriction, including without limitation the rights to
+  use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies
+  of the Software, and to permit persons to whom the Software is furnished to do
+  so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include "micronucleus_transport.h"
+#include "littleWire_util.h"
+
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/usbdevice_fs.h>
+
+#define MICRONUCLEUS_SYSFS_DEVICES "/sys/bus/usb/devices"
+
+/*
+ * Read a number from an attribute file of a device in sysfs.
+ * Returns 0 for success, -1 otherwise.
+ */
+static int micronucleus_readAttribute(const char* device, const char* attribute, int base, unsigned int* value) {
+  char path[256];
+  char text[16];
+  FILE* file;
+  int res = -1;
+
+  snprintf(path, sizeof(path), MICRONUCLEUS_SYSFS_DEVICES "/%s/%s", device, attribute);
+  file = fopen(path, "r");
+  if (!file) return -1;
+  if (fgets(text, sizeof(text), file)) {
+    *value = strtoul(text, NULL, base);
+    res = 0;
+  }
+  fclose(file);
+  return res;
+}
+
+static int micronucleus_usbfsScan(void* context, micronucleus_found* found, int max_found, const char* port_path) {
+  DIR* dir = opendir(MICRONUCLEUS_SYSFS_DEVICES);
+  struct dirent* entry;
+  int count = 0;
+
+  (void) context;
+  if (!dir) return 0;
+  while ((entry = readdir(dir)) && count < max_found) {
+    unsigned int vendor, product, bcdDevice, bus, address;
+    char path[64];
+    int fd;
+
+    // the names of devices are the bus and port numbers like 1-2.4, interfaces contain a colon
+    if (entry->d_name[0] == '.' || strchr(entry->d_name, ':')) continue;
+    if (strlen(entry->d_name) >= sizeof(found->port_path)) continue;
+    if (port_path && strcmp(port_path, entry->d_name)) continue;
+
+    /* Check if this device is a micronucleus */
+    if (micronucleus_readAttribute(entry->d_name, "idVendor", 16, &vendor)
+        || micronucleus_readAttribute(entry->d_name, "idProduct", 16, &product)) continue;
+    if (vendor != MICRONUCLEUS_VENDOR_ID || product != MICRONUCLEUS_PRODUCT_ID) continue;
+
+    if (micronucleus_readAttribute(entry->d_name, "bcdDevice", 16, &bcdDevice)
+        || micronucleus_readAttribute(entry->d_name, "busnum", 10, &bus)
+        || micronucleus_readAttribute(entry->d_name, "devnum", 10, &address)) continue;
+
+    snprintf(path, sizeof(path), "/dev/bus/usb/%03u/%03u", bus, address);
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0 && errno == EACCES) {
+      fprintf(stderr, "open(%s): %s. For Linux, copy file https://github.com/micronucleus/micronucleus/blob/master/commandline/49-micronucleus.rules to /etc/udev/rules.d.\n", path, strerror(errno));
+      continue;
+    }
+    if (fd < 0) {
+      fprintf(stderr, "Error opening device %s: %s\n", entry->d_name, strerror(errno));
+      continue;
+    }
+
+    found[count].handle = (void*) (long) (fd + 1); // a handle is never NULL
+    found[count].bcdDevice = bcdDevice;
+    found[count].bus = bus;
+    strcpy(found[count].port_path, entry->d_name);
+    count++;
+  }
+  closedir(dir);
+  return count;
+}
+
+static int micronucleus_usbfsControl(void* context, void* handle, int requesttype, int request, int value, int index,
+                                     char* bytes, int size, int timeout) {
+  (void) context;
+  struct usbdevfs_ctrltransfer transfer;
+  int res;
+
+  transfer.bRequestType = requesttype;
+  transfer.bRequest = request;
+  transfer.wValue = value;
+  transfer.wIndex = index;
+  transfer.wLength = size;
+  transfer.timeout = timeout;
+  transfer.data = bytes;
+  res = ioctl((int) (long) handle - 1, USBDEVFS_CONTROL, &transfer);
+  return (res < 0) ? -errno : res;
+}
+
+/*
+ * The requests are submitted as URBs at once. The kernel signals completed URBs by POLLOUT,
+ * they are reaped without blocking. All URBs are discarded if none completes within timeout.
+ */
+static int micronucleus_usbfsSubmit(void* context, void* handle, const micronucleus_request* requests,
+                                    unsigned int count, int timeout, micronucleus_requestDone done, void* user_data) {
+  struct usbdevfs_urb urbs[count];
+  unsigned char setup[count][8];
+  int fd = (int) (long) handle - 1;
+  unsigned int submitted, pending = 0, i;
+  int error = 0, discarded = 0;
+
+  (void) context;
+  memset(urbs, 0, sizeof(urbs));
+  for (submitted = 0; submitted < count; submitted++) {
+    setup[submitted][0] = MICRONUCLEUS_REQUEST_OUT;
+    setup[submitted][1] = requests[submitted].request;
+    setup[submitted][2] = requests[submitted].value & 0xFF;
+    setup[submitted][3] = (requests[submitted].value >> 8) & 0xFF;
+    setup[submitted][4] = requests[submitted].index & 0xFF;
+    setup[submitted][5] = (requests[submitted].index >> 8) & 0xFF;
+    setup[submitted][6] = 0; // no data stage
+    setup[submitted][7] = 0;
+    urbs[submitted].type = USBDEVFS_URB_TYPE_CONTROL;
+    urbs[submitted].endpoint = 0;
+    urbs[submitted].buffer = setup[submitted];
+    urbs[submitted].buffer_length = sizeof(setup[submitted]);
+    urbs[submitted].usercontext = (void*) &requests[submitted];
+    if (ioctl(fd, USBDEVFS_SUBMITURB, &urbs[submitted]) < 0) {
+      error = -errno;
+      break;
+    }
+    pending++;
+  }
+
+  while (pending) {
+    struct pollfd poll_fd = { fd, POLLOUT, 0 };
+    struct usbdevfs_urb *urb;
+
+    if (error && !discarded) {
+      // the device did not get all requests of this sequence, drop the rest
+      for (i = 0; i < submitted; i++) ioctl(fd, USBDEVFS_DISCARDURB, &urbs[i]);
+      discarded = 1;
+    }
+
+    // discarded URBs complete at once and are reaped blocking, so none is left for the next call
+    if (ioctl(fd, discarded ? USBDEVFS_REAPURB : USBDEVFS_REAPURBNDELAY, &urb) < 0) {
+      if (errno != EAGAIN) {
+        // the device is gone, the kernel has given up the URBs
+        if (!error) error = -errno;
+        break;
+      }
+      if (poll(&poll_fd, 1, timeout) == 0) error = -ETIMEDOUT;
+      continue;
+    }
+
+    pending--;
+    done(user_data, urb->usercontext, urb->status < 0 ? urb->status : urb->actual_length, micros());
+    if (urb->status < 0 && !error) error = urb->status;
+  }
+  return error;
+}
+
+static void micronucleus_usbfsClose(void* context, void* handle) {
+  (void) context;
+  close((int) (long) handle - 1);
+}
+
+const micronucleus_transport micronucleus_usbfs = {
+  "usbfs",
+  NULL, // no state
+  NULL,
+  micronucleus_usbfsScan,
+  micronucleus_usbfsControl,
+  micronucleus_usbfsSubmit,
+  micronucleus_usbfsClose,
+  NULL, // no hotplug events, the bus is scanned
+  NULL,
+  NULL  // no options
+};
@@ -29,82 +29,183 @@
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
-#include <time.h>
+#if defined(WIN)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
 #include "micronucleus_lib.h"
+#include "micronucleus_image.h"
 #include "littleWire_util.h"
 
 #define FILE_TYPE_INTEL_HEX 1
 #define FILE_TYPE_RAW 2
+#define FILE_TYPE_PLAN 3
+#define FILE_TYPE_ELF 4
+#define MAX_DEVICES 64 /* maximum number of devices listed by --list */
 #define CONNECT_WAIT 250 /* milliseconds to wait after detecting device on usb bus - probably excessive */
 
+#define MAX_PROGRAM_SIZE 0x10000 /* addresses of the bootloader protocol are 16 bit */
+
 /******************************************************************************
- * Global definitions
+ * Type definitions
  ******************************************************************************/
-unsigned char dataBuffer[65536 + 256]; /* buffer for file data */
+// options, program image and progress state of one upload, passed to the progress callback
+typedef struct _upload_context {
+    unsigned char *data_buffer; // buffer for file data, as many bytes as the program is long
+    int erase_only; // only erase, dont't write file
+    int fast_mode; // normal mode adds 2ms to page writing times and waits longer for connect.
+    int info_only; // only info no device programming.
+    int timeout;
+    char *port_path; // only connect to the device at this port
+    int dump_progress; // output computer friendly progress info
+    int use_ansi; // output ansi control character stuff
+    int progress_step; // current step
+    int progress_total_steps; // total steps for upload
+    char *progress_friendly_name; // name of progress section
+    int last_step; // step of the last progress output
+    int last_integer_total_progress;
+    FILE *report; // stream for the JSON run report, NULL if no report is requested
+    char *file; // uploaded file, NULL for --erase-only and --info
+    int have_device; // device holds the information of the connected device
+    micronucleus device;
+    // microseconds spent in the phases before the upload, the upload itself is timed in stats
+    unsigned int parse_time;
+    unsigned int detect_time;
+    unsigned int connect_time;
+    micronucleus_stats stats;
+    micronucleus_trace *trace; // control transfers are recorded to or replayed from this trace, NULL if none
+    int replay; // the device is replayed from trace
+    micronucleus_library *library; // transport and its state used to find the devices
+} upload_context;
 /*****************************************************************************/
 
 /******************************************************************************
  * Function prototypes
  ******************************************************************************/
-static int parseRaw(char *hexfile, unsigned char *buffer, int *startAddr, int *endAddr);
-static int parseIntelHex(char *hexfile, unsigned char *buffer, int *startAddr, int *endAddr); /* taken from bootloadHID example from obdev */
-static int parseUntilColon(FILE *fp); /* taken from bootloadHID example from obdev */
-static int parseHex(FILE *fp, int numDigits); /* taken from bootloadHID example from obdev */
-static void printProgress(float progress);
-static void setProgressData(char *friendly, int step);
-static int progress_step = 0; // current step
-static int progress_total_steps = 0; // total steps for upload
-static char *progress_friendly_name; // name of progress section
-static int dump_progress = 0; // output computer friendly progress info
-static int use_ansi = 0; // output ansi control character stuff
-static int erase_only = 0; // only erase, dont't write file
-static int fast_mode = 0; // normal mode adds 2ms to page writing times and waits longer for connect.
-static int info_only = 0; // only info no device programming.
-static int timeout = 0;
+static void printProgress(void *user_data, float progress);
+static void setProgressData(upload_context *context, char *friendly, int step);
+static int finish(upload_context *context, int status);
+static void printJsonString(FILE *out, const char *string);
 /*****************************************************************************/
 
 /******************************************************************************
  * Main function!
  ******************************************************************************/
 int main(int argc, char **argv) {
-    int res;
+    int res, i;
     char *file = NULL;
     micronucleus *my_device = NULL;
+    upload_context context;
+    micronucleus_plan plan; // pages prepared for the device, loaded or compiled from the file
 
     // parse arguments
     int run = 0;
+    int list_only = 0;
+    int all_devices = 0;
+    int idle_time = -1; // milliseconds the bootloader waits after the upload, -1 for its own timeout
     int file_type = FILE_TYPE_INTEL_HEX;
+    char *compile_plan = NULL; // write the plan to this file instead of uploading
+    char *target = NULL; // compile the plan for this firmware configuration instead of a connected device
+    char *trace_file = NULL; // record the control transfers to or replay them from this file
     int arg_pointer = 1;
+    int startAddress = 1, endAddress = 0;
+    unsigned int start_time;
 #if defined(WIN)
-  char* usage = "usage: micronucleus [--help] [--run] [--dump-progress] [--fast-mode] [--type intel-hex|raw] [--timeout integer] (--erase-only | --info | filename)";
+  char* usage = "usage: micronucleus [--help] [--run] [--dump-progress] [--fast-mode] [--type intel-hex|raw|elf|plan] [--compile-plan filename] [--target configuration] [--timeout integer] [--idle milliseconds] [--port path] [--transport name] [--all] [--report=json] [--trace filename | --replay filename] (--erase-only | --info | --list | filename)";
   #else
     char *usage =
-            "usage: micronucleus [--help] [--run] [--dump-progress] [--fast-mode] [--type intel-hex|raw] [--timeout integer] [--no-ansi] (--erase-only | --info | filename)";
+            "usage: micronucleus [--help] [--run] [--dump-progress] [--fast-mode] [--type intel-hex|raw|elf|plan] [--compile-plan filename] [--target configuration] [--timeout integer] [--idle milliseconds] [--port path] [--transport name] [--all] [--report=json] [--trace filename | --replay filename] [--no-ansi] (--erase-only | --info | --list | filename)";
 #endif
-    progress_step = 0;
-    progress_total_steps = 5; // steps: waiting, connecting, parsing, erasing, writing, (running)?
-    dump_progress = 0;
-    erase_only = 0;
-    fast_mode = 0;
-    timeout = 0; // no timeout by default
+    memset(&context, 0, sizeof(context));
+    memset(&plan, 0, sizeof(plan));
+    context.library = micronucleus_openLibrary();
+    if (context.library == NULL) {
+        printf("> Out of memory\n");
+        return EXIT_FAILURE;
+    }
+    context.progress_step = 0;
+    context.progress_total_steps = 5; // steps: parsing, waiting, connecting, erasing, writing, (running)?
+    context.dump_progress = 0;
+    context.erase_only = 0;
+    context.fast_mode = 0;
+    context.timeout = 0; // no timeout by default
 #if defined(WIN)
-    use_ansi = 0;
+    context.use_ansi = 0;
   #else
-    use_ansi = 1;
+    context.use_ansi = 1;
 #endif
 
     while (arg_pointer < argc) {
         if (strcmp(argv[arg_pointer], "--run") == 0) {
             run = 1;
-            progress_total_steps += 1;
+            context.progress_total_steps += 1;
         } else if (strcmp(argv[arg_pointer], "--info") == 0) {
-            info_only = 1;
+            context.info_only = 1;
+        } else if (strcmp(argv[arg_pointer], "--list") == 0) {
+            list_only = 1;
+        } else if (strcmp(argv[arg_pointer], "--all") == 0) {
+            all_devices = 1;
+        } else if (strcmp(argv[arg_pointer], "--compile-plan") == 0) {
+            arg_pointer += 1;
+            if (arg_pointer >= argc) {
+                printf("Missing --compile-plan value\n");
+                return EXIT_FAILURE;
+            }
+            compile_plan = argv[arg_pointer];
+        } else if (strcmp(argv[arg_pointer], "--target") == 0) {
+            arg_pointer += 1;
+            if (arg_pointer >= argc) {
+                printf("Missing --target value\n");
+                return EXIT_FAILURE;
+            }
+            target = argv[arg_pointer];
+        } else if (strcmp(argv[arg_pointer], "--port") == 0) {
+            arg_pointer += 1;
+            if (arg_pointer >= argc) {
+                printf("Missing --port value\n");
+                return EXIT_FAILURE;
+            }
+            context.port_path = argv[arg_pointer];
+        } else if (strcmp(argv[arg_pointer], "--transport") == 0) {
+            arg_pointer += 1;
+            if (arg_pointer >= argc) {
+                printf("Missing --transport value\n");
+                return EXIT_FAILURE;
+            }
+            res = micronucleus_setTransport(context.library, argv[arg_pointer]);
+            if (res == -ENOENT) {
+                printf("Transport %s is not available\n", argv[arg_pointer]);
+                return EXIT_FAILURE;
+            } else if (res != 0) {
+                printf("Invalid transport options %s\n", argv[arg_pointer]);
+                return EXIT_FAILURE;
+            }
+        } else if (strcmp(argv[arg_pointer], "--trace") == 0 || strcmp(argv[arg_pointer], "--replay") == 0) {
+            context.replay = strcmp(argv[arg_pointer], "--replay") == 0;
+            arg_pointer += 1;
+            if (arg_pointer >= argc) {
+                printf("Missing %s value\n", argv[arg_pointer - 1]);
+                return EXIT_FAILURE;
+            }
+            trace_file = argv[arg_pointer];
+        } else if (strcmp(argv[arg_pointer], "--report=json") == 0) {
+            // The human readable output is moved to stderr, so stdout holds only the report
+            int fd = dup(fileno(stdout));
+            if (fd < 0 || (context.report = fdopen(fd, "w")) == NULL || dup2(fileno(stderr), fileno(stdout)) < 0) {
+                fprintf(stderr, "Can not redirect the output for --report\n");
+                return EXIT_FAILURE;
+            }
         } else if (strcmp(argv[arg_pointer], "--type") == 0) {
             arg_pointer += 1;
             if (strcmp(argv[arg_pointer], "intel-hex") == 0) {
                 file_type = FILE_TYPE_INTEL_HEX;
             } else if (strcmp(argv[arg_pointer], "raw") == 0) {
                 file_type = FILE_TYPE_RAW;
+            } else if (strcmp(argv[arg_pointer], "elf") == 0) {
+                file_type = FILE_TYPE_ELF;
+            } else if (strcmp(argv[arg_pointer], "plan") == 0) {
+                file_type = FILE_TYPE_PLAN;
             } else {
                 printf("Unknown File Type specified with --type option");
                 return EXIT_FAILURE;
@@ -114,8 +215,15 @@ int main(int argc, char **argv) {
             puts("");
             puts(usage);
             puts("");
-            puts("  --type [intel-hex, raw]: Set upload file type to either intel hex or raw");
-            puts("                           bytes (intel hex is default)");
+            puts("  --type [intel-hex, raw, elf, plan]: Set upload file type to either intel hex,");
+            puts("                           raw bytes, an AVR ELF file or a plan compiled with");
+            puts("                           --compile-plan (intel hex is default)");
+            puts("--compile-plan [filename]: Write the pages prepared for the connected device");
+            puts("                           type to a plan file instead of uploading them.");
+            puts("                           A plan is always erased and written in full, the");
+            puts("                           page CRC compare of the bootloader is not used");
+            puts(" --target [configuration]: Compile the plan for a firmware/configuration");
+            puts("                           directory instead of a connected device");
             puts("          --dump-progress: Output progress data in computer-friendly form");
             puts("                           for driving GUIs");
             puts("             --erase-only: Erase the device without programming. Fills the");
@@ -125,28 +233,54 @@ int main(int argc, char **argv) {
             puts("                    --run: Ask bootloader to run the program when finished");
             puts("                           uploading provided program");
             puts("                   --info: Print only bootloader information - no programming");
+            puts("                   --list: Print the port and version of all connected bootloaders");
+            puts("            --port [path]: Only use the bootloader at this port, as printed by --list");
+            printf("       --transport [name]: Talk to the bootloader with");
+            for (i = 0; micronucleus_getTransport(i); i++) {
+                printf("%s %s", i ? "," : "", micronucleus_getTransport(i));
+            }
+            printf(" (%s is default)\n", micronucleus_getTransport(0));
+#if defined MICRONUCLEUS_EMULATOR
+            puts("                           emulator:<configuration>,spm=<us>,frame=<us> emulates a bootloader");
+#endif
+            puts("                    --all: Upload to all connected bootloaders at once. They must be");
+            puts("                           of the same type and plugged in before the first one is found");
+            puts("       --trace [filename]: Record all USB control transfers with their timing to a file");
+            puts("      --replay [filename]: Upload to a device replayed from a file written by --trace");
+            puts("                           instead of a connected device");
+            puts("          --report=json: Write the timing of each phase, page and USB transfer as JSON");
+            puts("                           to stdout, all other output goes to stderr");
 #ifndef WIN
             puts("                --no-ansi: Don't use ANSI in terminal output");
 #endif
             puts("      --timeout [integer]: Timeout after waiting specified number of seconds");
-            puts("                 filename: Path to intel hex or raw data file to upload,");
+            puts("    --idle [milliseconds]: Let the bootloader wait this time after each request, during");
+            puts("                           and after the upload. 0 starts the program when finished.");
+            puts("                           Needs idle control support");
+            puts("                 filename: Path to the intel hex, raw, elf or plan file to upload,");
             puts("                           or \"-\" to read from stdin");
             return EXIT_SUCCESS;
         } else if (strcmp(argv[arg_pointer], "--dump-progress") == 0) {
-            dump_progress = 1;
+            context.dump_progress = 1;
         } else if (strcmp(argv[arg_pointer], "--no-ansi") == 0) {
-            use_ansi = 0;
+            context.use_ansi = 0;
         } else if (strcmp(argv[arg_pointer], "--fast-mode") == 0) {
-            fast_mode = 1;
+            context.fast_mode = 1;
         } else if (strcmp(argv[arg_pointer], "--erase-only") == 0) {
-            erase_only = 1;
-            progress_total_steps -= 1;
+            context.erase_only = 1;
+            context.progress_total_steps -= 1;
         } else if (strcmp(argv[arg_pointer], "--timeout") == 0) {
             arg_pointer += 1;
-            if (sscanf(argv[arg_pointer], "%d", &timeout) != 1) {
+            if (sscanf(argv[arg_pointer], "%d", &context.timeout) != 1) {
                 printf("Did not understand --timeout value\n");
                 return EXIT_FAILURE;
             }
+        } else if (strcmp(argv[arg_pointer], "--idle") == 0) {
+            arg_pointer += 1;
+            if (arg_pointer >= argc || sscanf(argv[arg_pointer], "%d", &idle_time) != 1 || idle_time < 0) {
+                printf("Did not understand --idle value\n");
+                return EXIT_FAILURE;
+            }
         } else if (strlen(argv[arg_pointer]) > 1 && argv[arg_pointer][0] == '-') {
             fprintf(stderr, "Unrecognized option: %s\n", argv[arg_pointer]);
             return EXIT_FAILURE;
@@ -163,7 +297,33 @@ int main(int argc, char **argv) {
         arg_pointer += 1;
     }
 
-    if (file == NULL && erase_only == 0 && info_only == 0) {
+    if (context.report && (list_only || all_devices || compile_plan)) {
+        printf("> --report can not be used with --list, --all or --compile-plan\n");
+        return EXIT_FAILURE;
+    }
+
+    if (list_only) {
+        micronucleus *devices[MAX_DEVICES];
+        int count = micronucleus_enumerate(context.library, devices, MAX_DEVICES, context.fast_mode);
+
+        for (i = 0; i < count; i++) {
+            printf("%s: firmware version %d.%d, %d bytes available", devices[i]->port_path, devices[i]->version.major,
+                    devices[i]->version.minor, devices[i]->flash_size);
+            if (devices[i]->signature1) {
+                printf(", signature 0x1e%02x%02x", (int) devices[i]->signature1, (int) devices[i]->signature2);
+            }
+            printf("\n");
+            micronucleus_close(devices[i]);
+        }
+        if (count == 0) {
+            printf("> No device found.\n");
+        }
+        micronucleus_closeLibrary(context.library);
+        return EXIT_SUCCESS;
+    }
+
+    context.file = file;
+    if (file == NULL && context.erase_only == 0 && context.info_only == 0) {
         // print version if we are called without any parameter
         printf(MICRONUCLEUS_COMMANDLINE_VERSION);
         printf("\nNeither filename nor --erase-only nor --info given!\n\n");
@@ -171,48 +331,169 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
-    setProgressData("waiting", 1);
-    if (dump_progress)
-        printProgress(0.5);
-    printf("> Please plug in the device");
-    if (timeout > 0)
-        printf(" (will time out in %d seconds)", timeout);
-    printf(" ... \n");
-    // printf("> Press CTRL+C to terminate the program.\n"); // only true for Linux commandline :-(
-    fflush(stdout);
+    if (all_devices && (file == NULL || context.erase_only || context.info_only)) {
+        printf("> --all requires a filename and can not be used with --erase-only or --info\n");
+        return EXIT_FAILURE;
+    }
 
-    time_t start_time, current_time;
-    time(&start_time);
+    if (trace_file && (list_only || all_devices)) {
+        printf("> --trace and --replay can not be used with --list or --all\n");
+        return EXIT_FAILURE;
+    }
 
-    while (my_device == NULL) {
-        delay(100);
-        my_device = micronucleus_connect(fast_mode);
+    if (compile_plan && (file == NULL || file_type == FILE_TYPE_PLAN || context.erase_only || context.info_only || all_devices)) {
+        printf("> --compile-plan requires an intel hex, raw or elf file and can not be used with --erase-only, --info or --all\n");
+        return EXIT_FAILURE;
+    }
 
-        time(&current_time);
-        if (timeout && start_time + timeout < current_time) {
-            break;
+    if (target) {
+        // The geometry of the configuration is built in, so no device is needed
+        if (!compile_plan || trace_file || context.port_path) {
+            printf("> --target requires --compile-plan and can not be used with --trace, --replay or --port\n");
+            return EXIT_FAILURE;
+        }
+        my_device = micronucleus_targetDevice(target);
+        if (my_device == NULL) {
+            printf("> Unknown target configuration %s\n", target);
+            return EXIT_FAILURE;
         }
+        context.fast_mode = 1; // there is no USB connection to wait for
     }
 
+    // The file is parsed and checked before the device is connected, so the time the bootloader
+    // listens is used only for the upload and a bad file does not let it time out
+    if (!context.info_only && !context.erase_only) {
+        setProgressData(&context, "parsing", 1);
+        printProgress(&context, 0.0);
+        start_time = micros();
+
+        if (file_type == FILE_TYPE_PLAN) {
+            // the plan is already prepared, its pages are sent from the mapped file
+            res = micronucleus_loadPlan(file, &plan);
+            if (res != 0) {
+                printf("> Error loading plan %s: %s\n", file, strerror(-res));
+                return finish(&context, EXIT_FAILURE);
+            }
+            startAddress = 0;
+            endAddress = plan.program_size;
+        } else {
+            micronucleus_image image;
+
+            if (file_type == FILE_TYPE_INTEL_HEX) {
+                res = micronucleus_loadIntelHex(file, &image);
+            } else if (file_type == FILE_TYPE_ELF) {
+                res = micronucleus_loadElf(file, &image);
+            } else {
+                res = micronucleus_loadRaw(file, &image);
+            }
+            if (res != 0) {
+                printf("> Error loading %s: %s\n", file, strerror(-res));
+                return finish(&context, EXIT_FAILURE);
+            }
+
+            startAddress = image.start_address;
+            endAddress = image.end_address;
+            if (image.end_address > MAX_PROGRAM_SIZE) {
+                printf("> The file contains data up to address 0x%x, beyond the 64 KB the bootloader can program.\n",
+                        image.end_address - 1);
+                micronucleus_freeImage(&image);
+                return finish(&context, EXIT_FAILURE);
+            }
+
+            // the regions are copied into one buffer which ends with the program
+            context.data_buffer = malloc(image.end_address ? image.end_address : 1);
+            if (context.data_buffer == NULL) {
+                printf("> Out of memory.\n");
+                return finish(&context, EXIT_FAILURE);
+            }
+            micronucleus_flattenImage(&image, context.data_buffer, image.end_address);
+            micronucleus_freeImage(&image);
+        }
+
+        context.parse_time = micros() - start_time;
+        printProgress(&context, 1.0);
+
+        if (startAddress >= endAddress) {
+            printf("> No data in input file, exiting.\n");
+            return finish(&context, EXIT_FAILURE);
+        }
+
+        if (file_type != FILE_TYPE_PLAN && micronucleus_checkProgram(endAddress, context.data_buffer) != 0) {
+            printf("> The reset vector of the program does not contain a branch instruction,\n");
+            printf("> therefore the bootloader can not be inserted. Please rearrange your code.\n");
+            return finish(&context, EXIT_FAILURE);
+        }
+    }
+
+    if (trace_file) {
+        context.trace = micronucleus_openTrace(trace_file, context.replay);
+        if (context.trace == NULL) {
+            printf("> Error opening trace %s: %s\n", trace_file, strerror(errno));
+            return finish(&context, EXIT_FAILURE);
+        }
+    }
+
+    setProgressData(&context, "waiting", 2);
+    if (context.dump_progress)
+        printProgress(&context, 0.5);
+    if (!target) {
+        printf("> Please plug in the device");
+        if (context.timeout > 0)
+            printf(" (will time out in %d seconds)", context.timeout);
+        printf(" ... \n");
+    }
+    // printf("> Press CTRL+C to terminate the program.\n"); // only true for Linux commandline :-(
+    fflush(stdout);
+
+    start_time = micros();
+    if (context.replay) {
+        my_device = micronucleus_replayDevice(context.trace, context.fast_mode);
+    } else if (!target) { // the device of --target is already there
+        my_device = micronucleus_waitForDevice(context.library, context.port_path, context.fast_mode, context.timeout);
+    }
+    context.detect_time = micros() - start_time;
+
     if (my_device == NULL) {
-        printf("> Device search timed out!\n");
-        return EXIT_FAILURE;
+        printf(context.replay ? "> No device in trace!\n" : "> Device search timed out!\n");
+        return finish(&context, EXIT_FAILURE);
+    }
+    if (context.trace && !context.replay) {
+        micronucleus_traceDevice(my_device, context.trace);
     }
 
-    printf("> Device is found!\n");
+    printf(target ? "> Target is %s\n" : "> Device is found at %s!\n", my_device->port_path);
+    context.device = *my_device;
+    context.have_device = 1;
+    if (context.report) {
+        my_device->stats = &context.stats;
+    }
 
-    if (!fast_mode) {
+    start_time = micros();
+    if (!context.fast_mode) {
         // wait for CONNECT_WAIT milliseconds with progress output
         float wait = 0.0f;
-        setProgressData("connecting", 2);
+        setProgressData(&context, "connecting", 3);
         while (wait < CONNECT_WAIT) {
-            printProgress((wait / ((float) CONNECT_WAIT)) * 0.9f);
+            printProgress(&context, (wait / ((float) CONNECT_WAIT)) * 0.9f);
             wait += 50.0f;
             delay(50);
         }
     }
+    context.connect_time = micros() - start_time;
 
-    printProgress(1.0);
+    printProgress(&context, 1.0);
+
+    // The bootloader waits the idle time after every request, so it is set before the job to keep it open
+    // during long jobs, too. An idle time of 0 starts the program and is only sent when the job is done.
+    if (idle_time > 0) {
+        res = micronucleus_setIdleTime(my_device, idle_time);
+        if (res == -ENOSYS) {
+            printf("> The bootloader can not set its idle time, it keeps its own timeout.\n");
+        } else if (res != 0) {
+            printf(">> Idle time error: %s has occured ...\n", strerror(-res));
+            return finish(&context, EXIT_FAILURE);
+        }
+    }
 
     printf("> Device has firmware version %d.%d\n", my_device->version.major, my_device->version.minor);
     if (my_device->signature1) {
@@ -258,6 +539,30 @@ int main(int argc, char **argv) {
         if (my_device->bootloader_feature_flags & SAVE_MCUSR_FEATURE_FLAG) {
             printf("> Bootloader saves MCUSR contents in GPIOR0 register.\n");
         }
+        if (my_device->extension_feature_flags & PAGE_DATA_TRANSFER_FEATURE_FLAG) {
+            printf("> Bootloader accepts a whole page in one transfer.\n");
+        }
+        if (my_device->extension_feature_flags & STATUS_REQUEST_FEATURE_FLAG) {
+            printf("> Bootloader can be polled for completion of page writes and erases.\n");
+        }
+        if (my_device->extension_feature_flags & BOUNDED_ERASE_FEATURE_FLAG) {
+            printf("> Bootloader erases only the pages used by the new program.\n");
+        }
+        if (my_device->extension_feature_flags & PAGE_CRC_FEATURE_FLAG) {
+            printf("> Bootloader reports page CRCs, only changed pages are written.\n");
+        }
+        if (my_device->extension_feature_flags & INCREMENTAL_ERASE_FEATURE_FLAG) {
+            printf("> Bootloader stays responsive while erasing.\n");
+        }
+        if (my_device->extension_feature_flags & ERASE_ON_WRITE_FEATURE_FLAG) {
+            printf("> Bootloader erases each page when writing it, no separate erase required.\n");
+        }
+        if (my_device->extension_feature_flags & FILL_AND_COPY_FEATURE_FLAG) {
+            printf("> Bootloader accepts repeated and already programmed words with one request.\n");
+        }
+        if (my_device->extension_feature_flags & IDLE_CONTROL_FEATURE_FLAG) {
+            printf("> Bootloader idle time can be set, it starts the program right after the run request.\n");
+        }
 
         if (my_device->application_version != 0) {
             printf("> Device has application version: %d.%d \n", (unsigned int) (my_device->application_version) >> 4,
@@ -270,119 +575,201 @@ int main(int argc, char **argv) {
     printf("> Erase function sleep duration: %dms\n", my_device->erase_sleep);
     fflush(stdout);
 
-    if (!info_only) {
-        int startAddress = 1, endAddress = 0;
-
-        if (!erase_only) {
-            setProgressData("parsing", 3);
-            printProgress(0.0);
-            memset(dataBuffer, 0xFF, sizeof(dataBuffer));
-
-            if (file_type == FILE_TYPE_INTEL_HEX) {
-                if (parseIntelHex(file, dataBuffer, &startAddress, &endAddress)) {
-                    printf("> Error loading or parsing hex file.\n");
-                    return EXIT_FAILURE;
-                }
-            } else if (file_type == FILE_TYPE_RAW) {
-                if (parseRaw(file, dataBuffer, &startAddress, &endAddress)) {
-                    printf("> Error loading raw file.\n");
-                    return EXIT_FAILURE;
-                }
+    if (!context.info_only) {
+        if (!context.erase_only) {
+            if (file_type == FILE_TYPE_PLAN && micronucleus_checkPlan(my_device, &plan) != 0) {
+                printf("> The plan was compiled for another device type.\n");
+                return finish(&context, EXIT_FAILURE);
             }
 
-            printProgress(1.0);
-
-            if (startAddress >= endAddress) {
-                printf("> No data in input file, exiting.\n");
-                return EXIT_FAILURE;
-            }
-
-            if (endAddress > my_device->flash_size) {
+            if ((unsigned int) endAddress > my_device->flash_size) {
                 printf("> Program file is %d bytes too big for the bootloader!\n", endAddress - my_device->flash_size);
-                return EXIT_FAILURE;
+                return finish(&context, EXIT_FAILURE);
             }
         }
 
-        printProgress(1.0);
+        if (compile_plan) {
+            res = micronucleus_createPlan(my_device, endAddress, context.data_buffer, &plan);
+            if (res == 0) {
+                res = micronucleus_savePlan(&plan, compile_plan);
+            }
+            micronucleus_close(my_device);
+            if (res != 0) {
+                printf(">> Compiling the plan failed: %s\n", strerror(-res));
+                return finish(&context, EXIT_FAILURE);
+            }
+            printf("> Plan with %u pages written to %s, content hash 0x%08x\n", plan.page_count, compile_plan, plan.hash);
+            micronucleus_freePlan(&plan);
+            free(context.data_buffer);
+            return finish(&context, EXIT_SUCCESS);
+        }
 
-        setProgressData("erasing", 4);
-        printf("> Erasing the memory ...\n");
-        res = micronucleus_eraseFlash(my_device, printProgress);
+        if (all_devices) {
+            // The pages are prepared once and written to all devices concurrently
+            micronucleus *devices[MAX_DEVICES];
+            int results[MAX_DEVICES];
+            int count, failed;
 
-        if (res == 1) { // erase disconnection bug workaround
-            printf(">> Eep! Connection to device lost during erase! Not to worry\n");
-            printf(">> This happens on some computers - reconnecting...\n");
-            my_device = NULL;
+            if (file_type != FILE_TYPE_PLAN) {
+                res = micronucleus_createPlan(my_device, endAddress, context.data_buffer, &plan);
+            }
+            micronucleus_close(my_device);
+            if (res != 0) {
+                printf(">> Preparing the upload failed: %s\n", strerror(-res));
+                return finish(&context, EXIT_FAILURE);
+            }
 
-            delay(CONNECT_WAIT);
+            count = micronucleus_enumerate(context.library, devices, MAX_DEVICES, context.fast_mode);
+            if (idle_time > 0) {
+                for (i = 0; i < count; i++) micronucleus_setIdleTime(devices[i], idle_time);
+            }
+            printf("> Uploading to %d devices ...\n", count);
+            context.progress_total_steps = 4;
+            setProgressData(&context, "programming", 4);
+            failed = micronucleus_gangProgram(context.library, devices, count, &plan, run, results, printProgress, &context);
+
+            for (i = 0; i < count; i++) {
+                if (results[i] == -EINVAL) {
+                    printf("> %s: Device type differs from the first device, skipped.\n", devices[i]->port_path);
+                } else if (results[i] != 0) {
+                    printf("> %s: Error: %s\n", devices[i]->port_path, strerror(-results[i]));
+                } else {
+                    printf("> %s: Done.\n", devices[i]->port_path);
+                    if (idle_time == 0 && !run) micronucleus_setIdleTime(devices[i], idle_time);
+                }
+                micronucleus_close(devices[i]);
+            }
+            micronucleus_freePlan(&plan);
+            free(context.data_buffer);
 
-            int deciseconds_till_reconnect_notice = 50; // notice after 5 seconds
-            while (my_device == NULL) {
-                delay(100);
-                my_device = micronucleus_connect(fast_mode);
-                deciseconds_till_reconnect_notice -= 1;
+            if (failed) {
+                printf(">> %d of %d devices failed.\n", failed, count);
+                return finish(&context, EXIT_FAILURE);
+            }
+            printf(">> Micronucleus done. Thank you!\n");
+            return finish(&context, EXIT_SUCCESS);
+        }
 
-                if (deciseconds_till_reconnect_notice == 0) {
-                    printf(">> (!) Automatic reconnection not working. Unplug and reconnect\n");
-                    printf("   device usb connector, or reset it some other way to continue.\n");
+        // A device with the page CRC extension erases and rewrites only the pages which have changed
+        int update_only = !context.erase_only && file_type != FILE_TYPE_PLAN
+                && (my_device->extension_feature_flags & PAGE_CRC_FEATURE_FLAG);
+        // A device with erase on write support erases each page just before writing it. The first page
+        // of each erase block is written even if it is empty, so the old program is erased, too.
+        int skip_erase = update_only || (!context.erase_only && (my_device->extension_feature_flags & ERASE_ON_WRITE_FEATURE_FLAG));
+
+        if (!skip_erase) {
+            setProgressData(&context, "erasing", 4);
+            printf("> Erasing the memory ...\n");
+            res = micronucleus_eraseFlash(my_device, context.erase_only ? 0 : endAddress, printProgress, &context);
+
+            if (res == 1) { // erase disconnection bug workaround
+                printf(">> Eep! Connection to device lost during erase! Not to worry\n");
+                printf(">> This happens on some computers - reconnecting...\n");
+                micronucleus_close(my_device);
+                my_device = NULL;
+
+                delay(CONNECT_WAIT);
+
+                int deciseconds_till_reconnect_notice = 50; // notice after 5 seconds
+                while (my_device == NULL) {
+                    delay(100);
+                    if (context.replay) {
+                        my_device = micronucleus_replayDevice(context.trace, context.fast_mode);
+                        if (my_device == NULL) {
+                            printf(">> The trace ends with the lost connection.\n");
+                            return finish(&context, EXIT_FAILURE);
+                        }
+                        break;
+                    }
+                    my_device = micronucleus_open(context.library, context.port_path, context.fast_mode);
+                    context.stats.retries++;
+                    deciseconds_till_reconnect_notice -= 1;
+
+                    if (deciseconds_till_reconnect_notice == 0) {
+                        printf(">> (!) Automatic reconnection not working. Unplug and reconnect\n");
+                        printf("   device usb connector, or reset it some other way to continue.\n");
+                    }
                 }
-            }
 
-            printf(">> Reconnected! Continuing upload sequence...\n");
+                printf(">> Reconnected! Continuing upload sequence...\n");
+                if (context.trace && !context.replay) {
+                    micronucleus_traceDevice(my_device, context.trace);
+                }
+                if (context.report) {
+                    my_device->stats = &context.stats;
+                }
 
-        } else if (res != 0) {
-            printf(">> Flash erase error: %s  has occured ...\n", strerror(-res));
-            printf(">> Consider to use another USB port or to restore the bootloader with an ISP, if this continues to happen.\n");
-            printf(">> Please unplug the device and restart the program.\n");
-            return EXIT_FAILURE;
+            } else if (res != 0) {
+                printf(">> Flash erase error: %s  has occured ...\n", strerror(-res));
+                printf(">> Consider to use another USB port or to restore the bootloader with an ISP, if this continues to happen.\n");
+                printf(">> Please unplug the device and restart the program.\n");
+                return finish(&context, EXIT_FAILURE);
+            }
+            printProgress(&context, 1.0);
         }
-        printProgress(1.0);
 
-        if (!erase_only) {
+        if (!context.erase_only) {
             printf("> Starting to upload ...\n");
-            setProgressData("writing", 5);
-            res = micronucleus_writeFlash(my_device, endAddress, dataBuffer, printProgress);
+            setProgressData(&context, "writing", 5);
+            if (file_type == FILE_TYPE_PLAN) {
+                res = micronucleus_writePlan(my_device, &plan, printProgress, &context);
+            } else if (update_only) {
+                res = micronucleus_updateFlash(my_device, endAddress, context.data_buffer, printProgress, &context);
+            } else {
+                res = micronucleus_writeFlash(my_device, endAddress, context.data_buffer, printProgress, &context);
+            }
             if (res != 0) {
                 printf(">> Flash write error: %s has occured ...\n", strerror(-res));
                 printf(
                         ">> Consider to use another USB port or to restore the bootloader with an ISP, if this continues to happen.\n");
                 printf(">> Please unplug the device and restart the program.\n");
-                return EXIT_FAILURE;
+                return finish(&context, EXIT_FAILURE);
             }
         }
 
         if (run) {
             printf("> Starting the user app ...\n");
-            setProgressData("running", 6);
-            printProgress(0.0);
+            setProgressData(&context, "running", 6);
+            printProgress(&context, 0.0);
 
             res = micronucleus_startApp(my_device);
 
             if (res != 0) {
                 printf(">> Run error: %s has occured ...\n", strerror(-res));
                 printf(">> Please unplug the device and restart the program. \n");
-                return EXIT_FAILURE;
+                return finish(&context, EXIT_FAILURE);
             }
 
-            printProgress(1.0);
+            printProgress(&context, 1.0);
+        }
+    }
+    if (idle_time == 0 && (context.info_only || !run)) {
+        res = micronucleus_setIdleTime(my_device, idle_time);
+        if (res == -ENOSYS) {
+            printf("> The bootloader can not set its idle time, it keeps its own timeout.\n");
+        } else if (res != 0) {
+            printf(">> Idle time error: %s has occured ...\n", strerror(-res));
+            return finish(&context, EXIT_FAILURE);
         }
     }
+    micronucleus_close(my_device);
+    micronucleus_freePlan(&plan);
+    free(context.data_buffer);
     printf(">> Micronucleus done. Thank you!\n");
 
-    return EXIT_SUCCESS;
+    return finish(&context, EXIT_SUCCESS);
 }
 /******************************************************************************/
 
 /******************************************************************************/
-static void printProgress(float progress) {
-    static int last_step;
-    static int last_integer_total_progress;
+static void printProgress(void *user_data, float progress) {
+    upload_context *context = user_data;
 
-    if (dump_progress) {
-        printf("{status:\"%s\",step:%d,steps:%d,progress:%f}\n", progress_friendly_name, progress_step, progress_total_steps,
+    if (context->dump_progress) {
+        printf("{status:\"%s\",step:%d,steps:%d,progress:%f}\n", context->progress_friendly_name, context->progress_step, context->progress_total_steps,
                 progress);
     } else {
-        if (last_step == progress_step && use_ansi) {
+        if (context->last_step == context->progress_step && context->use_ansi) {
 #ifndef WIN
             printf("\033[1F\033[2K"); // move cursor to previous line and erase last update in this progress sequence
 #else
@@ -390,126 +777,101 @@ static void printProgress(float progress) {
       #endif
         }
 
-        float total_progress = ((float) progress_step - 1.0f) / (float) progress_total_steps;
-        total_progress += progress / (float) progress_total_steps;
+        float total_progress = ((float) context->progress_step - 1.0f) / (float) context->progress_total_steps;
+        total_progress += progress / (float) context->progress_total_steps;
         int integer_total_progress = total_progress * 100.0f;
 
-        if (use_ansi || integer_total_progress >= last_integer_total_progress + 5) {
-            printf("%s: %d%% complete\n", progress_friendly_name, integer_total_progress);
-            last_integer_total_progress = integer_total_progress;
+        if (context->use_ansi || integer_total_progress >= context->last_integer_total_progress + 5) {
+            printf("%s: %d%% complete\n", context->progress_friendly_name, integer_total_progress);
+            context->last_integer_total_progress = integer_total_progress;
         }
     }
 
     fflush(stdout);
-    last_step = progress_step;
+    context->last_step = context->progress_step;
 }
 
-static void setProgressData(char *friendly, int step) {
-    progress_friendly_name = friendly;
-    progress_step = step;
-}
-/******************************************************************************/
-
-/******************************************************************************/
-static int parseUntilColon(FILE *file_pointer) {
-    int character;
-
-    do {
-        character = getc(file_pointer);
-    } while (character != ':' && character != EOF);
-
-    return character;
+static void setProgressData(upload_context *context, char *friendly, int step) {
+    context->progress_friendly_name = friendly;
+    context->progress_step = step;
 }
 /******************************************************************************/
 
-/******************************************************************************/
-static int parseHex(FILE *file_pointer, int num_digits) {
-    int iter;
-    char temp[9];
-
-    for (iter = 0; iter < num_digits; iter++) {
-        temp[iter] = getc(file_pointer);
+/******************************************************************************
+ * Write the JSON run report if requested, close the trace and return status.
+ * Times are in microseconds.
+ ******************************************************************************/
+static int finish(upload_context *context, int status) {
+    FILE *out = context->report;
+    micronucleus_stats *stats = &context->stats;
+    unsigned int i;
+
+    micronucleus_closeTrace(context->trace);
+    context->trace = NULL;
+    micronucleus_closeLibrary(context->library);
+    context->library = NULL;
+    if (out == NULL) {
+        return status;
     }
-    temp[iter] = 0;
-
-    return strtol(temp, NULL, 16);
-}
-/******************************************************************************/
 
-/******************************************************************************/
-static int parseIntelHex(char *hexfile, unsigned char *buffer, int *startAddr, int *endAddr) {
-    int address, base, d, segment, i, lineLen, sum;
-    FILE *input;
-
-    input = strcmp(hexfile, "-") == 0 ? stdin : fopen(hexfile, "r");
-    if (input == NULL) {
-        printf("> Error opening %s: %s\n", hexfile, strerror(errno));
-        return 1;
+    fprintf(out, "{\n  \"result\": \"%s\",\n", status == EXIT_SUCCESS ? "success" : "failure");
+    if (status != EXIT_SUCCESS) {
+        fprintf(out, "  \"failed_phase\": \"%s\",\n", context->progress_friendly_name ? context->progress_friendly_name : "");
     }
-
-    while (parseUntilColon(input) == ':') {
-        sum = 0;
-        sum += lineLen = parseHex(input, 2);
-        base = address = parseHex(input, 4);
-        sum += address >> 8;
-        sum += address;
-        sum += segment = parseHex(input, 2); /* segment value? */
-        if (segment != 0) { /* ignore lines where this byte is not 0 */
-            continue;
-        }
-
-        for (i = 0; i < lineLen; i++) {
-            d = parseHex(input, 2);
-            buffer[address++] = d;
-            sum += d;
-        }
-
-        sum += parseHex(input, 2);
-        if ((sum & 0xff) != 0) {
-            printf("> Warning: Checksum error between address 0x%x and 0x%x\n", base, address);
-        }
-
-        if (*startAddr > base) {
-            *startAddr = base;
-        }
-        if (*endAddr < address) {
-            *endAddr = address;
-        }
+    fprintf(out, "  \"file\": ");
+    printJsonString(out, context->file);
+    fprintf(out, ",\n");
+    if (context->have_device) {
+        micronucleus *device = &context->device;
+        fprintf(out, "  \"device\": {\"port\": ");
+        printJsonString(out, device->port_path);
+        fprintf(out, ", \"version\": \"%d.%d\", \"signature\": \"0x1e%02x%02x\", ",
+                device->version.major, device->version.minor, (int) device->signature1, (int) device->signature2);
+        fprintf(out, "\"flash_size\": %u, \"page_size\": %u, \"extension_feature_flags\": %u},\n",
+                device->flash_size, device->page_size, (unsigned int) device->extension_feature_flags);
+    } else {
+        fprintf(out, "  \"device\": null,\n");
     }
-
-    fclose(input);
-    return 0;
+    fprintf(out, "  \"phases\": {\"parse\": %u, \"detect\": %u, \"connect_wait\": %u, \"erase\": %u, \"write\": %u, \"run\": %u},\n",
+            context->parse_time, context->detect_time, context->connect_time, stats->erase_time, stats->write_time, stats->run_time);
+    fprintf(out, "  \"pages\": [");
+    for (i = 0; i < stats->page_count; i++) {
+        fprintf(out, "%s\n    {\"address\": %u, \"transfer\": %u, \"wait\": %u}", i ? "," : "",
+                stats->page_address[i], stats->page_transfer_time[i], stats->page_wait_time[i]);
+    }
+    fprintf(out, "%s],\n", stats->page_count ? "\n  " : "");
+    fprintf(out, "  \"transfers\": {\"count\": %u, \"errors\": %u, \"retries\": %u, \"status_polls\": %u, \"busy_polls\": %u, ",
+            stats->transfer_count, stats->transfer_errors, stats->retries, stats->status_polls, stats->busy_polls);
+    fprintf(out, "\"latency\": {\"p50\": %u, \"p90\": %u, \"p99\": %u, \"max\": %u}}\n}\n",
+            micronucleus_getLatency(stats, 50), micronucleus_getLatency(stats, 90), micronucleus_getLatency(stats, 99),
+            micronucleus_getLatency(stats, 100));
+    fclose(out);
+    context->report = NULL;
+    micronucleus_resetStats(stats);
+    return status;
 }
 /******************************************************************************/
 
-/******************************************************************************/
-static int parseRaw(char *filename, unsigned char *data_buffer, int *start_address, int *end_address) {
-    FILE *input;
-
-    input = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "r");
-
-    if (input == NULL) {
-        printf("> Error reading %s: %s\n", filename, strerror(errno));
-        return 1;
+/******************************************************************************
+ * Write string as a quoted JSON string, or null if it is NULL.
+ ******************************************************************************/
+static void printJsonString(FILE *out, const char *string) {
+    if (string == NULL) {
+        fputs("null", out);
+        return;
     }
-
-    *start_address = 0;
-    *end_address = 0;
-
-    // read in bytes from file
-    int byte = 0;
-    while (1) {
-        byte = getc(input);
-        if (byte == EOF) {
-            break;
+    fputc('"', out);
+    for (; *string; string++) {
+        unsigned char c = *string;
+
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
         }
-
-        *data_buffer = byte;
-        data_buffer += 1;
-        *end_address += 1;
     }
-
-    fclose(input);
-    return 0;
+    fputc('"', out);
 }
 /******************************************************************************/
@@ -0,0 +1,286 @@
+/*
+ * Cycle benchmark of the bootloader with simavr
+ *
+ * Runs main.bin, built with -DMICRONUCLEUS_BENCH, in the simulator and prints the cycles of
+ * - usbFunctionSetup() for each request,
+ * - writeWordToPageBuffer(), writeFlashPage() and eraseApplication(),
+ * - the reset until the jump to the application, with and without the entry condition of ENTRYMODE.
+ * The functions are called with a return address of 0 and stop there, the cycles include
+ * the call and return. SPM takes the time simavr assigns to it, not the milliseconds the
+ * ATtinies are halted, so the numbers are the cycles of the code, not of the flash.
+ * One line "<name> <cycles>" per measurement, so the output of two commits can be compared with diff.
+ *
+ * Usage: bench/bench_<config> [-f] main.bin main.sym
+ *   -f  measure the functions, otherwise the reset with the ENTRYMODE main.bin was built with
+ * main.sym is the output of avr-nm main.bin, see "make bench" in the Makefile.
+ *
+ *  This file is part of micronucleus https://github.com/micronucleus/micronucleus.
+ *
+ *  Micronucleus is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sim_avr.h"
+#include "sim_elf.h"
+#include "sim_io.h"
+#include "sim_irq.h"
+#include "sim_regbit.h"
+#include "avr_ioport.h"
+
+// the pins of the configuration, the native AVR headers of native/ define the registers
+#include "avr/io.h"
+#include "bootloaderconfig.h"
+
+#define TINYVECTOR_RESET_OFFSET     4 // from main.c
+#define CONFIGURATION_REPLY_ENTRYMODE 6
+
+// the registers bound by main.c
+#define REGISTER_COMMAND            3
+#define REGISTER_CURRENT_ADDRESS    4
+
+// bits of the MCUSR values below
+#define RESET_PORF  1
+#define RESET_EXTRF 2
+#define RESET_WDRF  8
+
+// the port letter of a PINx register of native/avr/io.h, its registers are PIN, DDR, PORT of A, B, C, D
+#define PORT_LETTER(pin_register) ('A' + (&(pin_register) - &PINA) / 3)
+#define BENCH_CONCAT(a, b) a ## b
+#define BENCH_INPORT(name) BENCH_CONCAT(PIN, name)
+
+volatile uint8_t nativeRegisters[64]; // only their addresses are used
+
+static avr_t *avr;
+static elf_firmware_t firmware;
+
+static struct {
+    char name[64];
+    uint32_t address;
+} symbols[256];
+static int symbolCount;
+
+static int readSymbols(const char *filename) {
+    FILE *file = fopen(filename, "r");
+    char line[256];
+
+    if (!file) {
+        perror(filename);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file) && symbolCount < (int) (sizeof(symbols) / sizeof(symbols[0]))) {
+        char type;
+        if (sscanf(line, "%x %c %63s", &symbols[symbolCount].address, &type, symbols[symbolCount].name) == 3) {
+            symbolCount++;
+        }
+    }
+    fclose(file);
+    return 0;
+}
+
+static uint32_t symbol(const char *name) {
+    int i;
+
+    for (i = 0; i < symbolCount; i++) {
+        if (!strcmp(symbols[i].name, name)) return symbols[i].address;
+    }
+    fprintf(stderr, "Symbol %s not found, was main.bin built with -DMICRONUCLEUS_BENCH?\n", name);
+    exit(1);
+}
+
+static void setPin(char port, int bit, int level) {
+    avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ(port), bit), level);
+}
+
+/*
+ * Run until the program counter reaches address, returns the cycles or 0 if it was not
+ * reached within limit cycles.
+ */
+static avr_cycle_count_t runUntil(avr_flashaddr_t address, avr_cycle_count_t limit) {
+    avr_cycle_count_t start = avr->cycle;
+
+    while (avr->pc != address) {
+        int state = avr_run(avr);
+        if (state == cpu_Done || state == cpu_Crashed || avr->cycle - start > limit) return 0;
+    }
+    return avr->cycle - start;
+}
+
+/*
+ * Call a function with its argument in r24/r25 and return to address 0.
+ */
+static void call(const char *name, const char *label, uint16_t argument, uint16_t currentAddress) {
+    uint16_t sp = avr->ramend;
+    avr_cycle_count_t cycles;
+
+    avr->data[sp] = 0; // return address 0
+    avr->data[sp - 1] = 0;
+    sp -= 2;
+    avr->data[R_SPL] = sp & 0xff;
+    avr->data[R_SPH] = sp >> 8;
+    avr->data[1] = 0; // zero register of avr-gcc
+    avr->data[24] = argument & 0xff;
+    avr->data[25] = argument >> 8;
+    avr->data[REGISTER_COMMAND] = 0;
+    avr->data[REGISTER_CURRENT_ADDRESS] = currentAddress & 0xff;
+    avr->data[REGISTER_CURRENT_ADDRESS + 1] = currentAddress >> 8;
+    avr->pc = symbol(name);
+
+    cycles = runUntil(0, F_CPU);
+    if (!cycles) {
+        fprintf(stderr, "%s(%s) did not return\n", name, label);
+        exit(1);
+    }
+    printf("%s.%s %llu\n", name, label, (unsigned long long) cycles);
+}
+
+/*
+ * usbFunctionSetup() with a setup packet in RAM
+ */
+static void setup(const char *label, uint8_t type, uint8_t request, uint16_t value, uint16_t index, uint16_t length,
+        uint16_t currentAddress) {
+    uint16_t packet = avr->ramend - 32;
+    uint8_t data[8] = { type, request, value & 0xff, value >> 8, index & 0xff, index >> 8, length & 0xff, length >> 8 };
+
+    memcpy(&avr->data[packet], data, sizeof(data));
+    call("usbFunctionSetup", label, packet, currentAddress);
+}
+
+static void measureFunctions(void) {
+    setup("device_info", 0xc0, 0, 0, 0, 9, 0);
+    setup("transfer_page", 0x40, 1, SPM_PAGESIZE, SPM_PAGESIZE, 0, 2);
+    setup("erase_application", 0x40, 2, 0, 0, 0, 0);
+    setup("write_data", 0x40, 3, 0x1234, 0x5678, 0, 2);
+    setup("write_data_last", 0x40, 3, 0x1234, 0x5678, 0, SPM_PAGESIZE - 4);
+    setup("exit", 0x40, 4, 0, 0, 0, 0);
+    setup("transfer_page_data", 0x40, 5, 0, SPM_PAGESIZE, SPM_PAGESIZE, 2);
+    setup("get_status", 0xc0, 6, 0, 0, 4, 0);
+    setup("get_page_crc", 0xc0, 7, 0, 0, 2, 0);
+    setup("erase_page", 0x40, 8, 0, SPM_PAGESIZE, 0, 0);
+    setup("fill_words", 0x40, 9, 0xffff, SPM_PAGESIZE / 2, 0, 0);
+    setup("copy_words", 0x40, 10, 0, SPM_PAGESIZE / 2, 0, 0);
+    setup("set_idle", 0x40, 11, 200, 0, 0, 0);
+
+    call("writeWordToPageBuffer", "reset_vector", 0x1234, 0);
+    call("writeWordToPageBuffer", "word", 0x1234, 2);
+    call("writeWordToPageBuffer", "tiny_vector", 0x1234, BOOTLOADER_ADDRESS - TINYVECTOR_RESET_OFFSET);
+    call("writeFlashPage", "page", 0, SPM_PAGESIZE);
+    call("eraseApplication", "all", 0, 0);
+    call("eraseApplication", "one_page", 0, SPM_PAGESIZE);
+}
+
+/*
+ * Reset with the flags and pins, the application is present, so the bootloader jumps to it
+ * either at once or after AUTO_EXIT_MS.
+ */
+static void measureReset(int entrymode, const char *label, int mcusr, int jumper, int dminus) {
+    avr_cycle_count_t cycles;
+    uint32_t vector = BOOTLOADER_ADDRESS - TINYVECTOR_RESET_OFFSET;
+
+    avr_reset(avr);
+    avr_regbit_setto(avr, avr->reset_flags.porf, !!(mcusr & RESET_PORF));
+    avr_regbit_setto(avr, avr->reset_flags.extrf, !!(mcusr & RESET_EXTRF));
+    avr_regbit_setto(avr, avr->reset_flags.borf, 0);
+    avr_regbit_setto(avr, avr->reset_flags.wdrf, !!(mcusr & RESET_WDRF));
+    setPin(PORT_LETTER(JUMPER_INP), JUMPER_PIN, jumper);
+    setPin(PORT_LETTER(BENCH_INPORT(USB_CFG_IOPORTNAME)), USB_CFG_DMINUS_BIT, dminus); // the pullup of an attached device
+    avr->pc = 0;
+
+    cycles = runUntil(vector, (avr_cycle_count_t) F_CPU * (AUTO_EXIT_MS + 1000) / 1000);
+    if (!cycles) {
+        printf("reset.entrymode%d.%s timeout\n", entrymode, label);
+    } else {
+        printf("reset.entrymode%d.%s %llu\n", entrymode, label, (unsigned long long) cycles);
+    }
+}
+
+int main(int argc, char **argv) {
+    int functions = 0;
+    int option, entrymode;
+    uint32_t vector = BOOTLOADER_ADDRESS - TINYVECTOR_RESET_OFFSET;
+    uint32_t reply;
+
+    while ((option = getopt(argc, argv, "f")) != -1) {
+        if (option == 'f') functions = 1;
+        else optind = argc + 1;
+    }
+    if (optind != argc - 2) {
+        fprintf(stderr, "Usage: %s [-f] main.bin main.sym\n", argv[0]);
+        return 1;
+    }
+    if (elf_read_firmware(argv[optind], &firmware) || readSymbols(argv[optind + 1])) {
+        fprintf(stderr, "Cannot read %s\n", argv[optind]);
+        return 1;
+    }
+
+    avr = avr_make_mcu_by_name(BENCH_MMCU);
+    if (!avr) {
+        fprintf(stderr, "simavr does not support %s\n", BENCH_MMCU);
+        return 1;
+    }
+    avr_init(avr);
+    avr->frequency = F_CPU;
+    avr->log = 0;
+    avr_load_firmware(avr, &firmware);
+
+    if (functions) {
+        measureFunctions();
+        return 0;
+    }
+
+    // an application with a reset vector patched by the bootloader and its own reset vector in the tiny vector table
+#if BOOTLOADER_ADDRESS < 8192
+    avr->flash[0] = (BOOTLOADER_ADDRESS / 2 - 1) & 0xff;
+    avr->flash[1] = 0xc0 | (((BOOTLOADER_ADDRESS / 2 - 1) >> 8) & 0x0f);
+#else
+    avr->flash[0] = 0x0c;
+    avr->flash[1] = 0x94;
+    avr->flash[2] = (BOOTLOADER_ADDRESS / 2) & 0xff;
+    avr->flash[3] = (BOOTLOADER_ADDRESS / 2) >> 8;
+#endif
+    avr->flash[vector] = 0xff; // rjmp .-2
+    avr->flash[vector + 1] = 0xcf;
+
+    reply = symbol("configurationReply");
+    if (reply >= avr->flashend) {
+        fprintf(stderr, "configurationReply is not in the flash\n");
+        return 1;
+    }
+    entrymode = avr->flash[reply + CONFIGURATION_REPLY_ENTRYMODE] & 0x0f;
+    switch (entrymode) {
+    case 0: // ENTRY_ALWAYS
+        measureReset(entrymode, "entry", RESET_EXTRF, 1, 1);
+        break;
+    case 1: // ENTRY_WATCHDOG
+        measureReset(entrymode, "entry", RESET_WDRF, 1, 1);
+        measureReset(entrymode, "no_entry", RESET_EXTRF, 1, 1);
+        break;
+    case 2: // ENTRY_EXT_RESET
+        measureReset(entrymode, "entry", RESET_EXTRF, 1, 1);
+        measureReset(entrymode, "no_entry", RESET_PORF | RESET_EXTRF, 1, 1);
+        break;
+    case 3: // ENTRY_JUMPER
+        measureReset(entrymode, "entry", RESET_EXTRF, 0, 1);
+        measureReset(entrymode, "no_entry", RESET_EXTRF, 1, 1);
+        break;
+    case 4: // ENTRY_POWER_ON
+        measureReset(entrymode, "entry", RESET_PORF, 1, 1);
+        measureReset(entrymode, "no_entry", RESET_EXTRF, 1, 1);
+        break;
+    case 5: // ENTRY_D_MINUS_PULLUP_ACTIVATED_AND_ENTRY_POWER_ON
+        measureReset(entrymode, "entry", RESET_PORF, 1, 1);
+        measureReset(entrymode, "no_entry", RESET_PORF, 1, 0);
+        break;
+    case 6: // ENTRY_D_MINUS_PULLUP_ACTIVATED_AND_ENTRY_EXT_RESET
+        measureReset(entrymode, "entry", RESET_EXTRF, 1, 1);
+        measureReset(entrymode, "no_entry", RESET_EXTRF, 1, 0);
+        break;
+    }
+    return 0;
+}
@@ -127,7 +127,9 @@
  *
  */
 
+#ifndef ENTRYMODE // allows make ENTRYMODE=<n>
 #define ENTRYMODE ENTRY_ALWAYS
+#endif
 
 #define JUMPER_PIN    PB0
 #define JUMPER_PORT   PORTB
@@ -218,6 +220,11 @@
 #define OSCCAL_HAVE_XTAL 1
 
 
+/*
+ *  Optional features like the protocol extensions are described in main.c and disabled by default.
+ *  Define them here to enable them for this configuration, e.g. #define ENABLE_PAGE_CRC 1
+ */
+
 /*
  *  Defines handling of an indicator LED while the bootloader is active.
  *
@@ -163,7 +163,9 @@
 #define ENTRY_D_MINUS_PULLUP_ACTIVATED_AND_ENTRY_POWER_ON  5
 #define ENTRY_D_MINUS_PULLUP_ACTIVATED_AND_ENTRY_EXT_RESET 6
 
+#ifndef ENTRYMODE // allows make ENTRYMODE=<n>
 #define ENTRYMODE ENTRY_ALWAYS
+#endif
 
 #if ENTRYMODE==ENTRY_ALWAYS
   #define bootLoaderInit()
@@ -270,6 +272,11 @@
 #define OSCCAL_SAVE_CALIB 0
 #define OSCCAL_HAVE_XTAL 1
 
+/*
+ *  Optional features like the protocol extensions are described in main.c and disabled by default.
+ *  Define them here to enable them for this configuration, e.g. #define ENABLE_PAGE_CRC 1
+ */
+
 /*
  *  Defines handling of an indicator LED while the bootloader is active.
  *
@@ -39,6 +39,83 @@
 #include <util/delay.h>
 
 #include "bootloaderconfig.h"
+
+/*
+ * Optional features, all disabled unless the bootloaderconfig.h of a configuration sets them to 1.
+ * The protocol extensions are announced to the host tool in byte 8 of the configuration reply,
+ * so older host tools simply do not use them. Each of them increases the size of the bootloader,
+ * so BOOTLOADER_ADDRESS in Makefile.inc may need to be lowered when enabling them. The build of
+ * main.hex fails if the bootloader does not fit below the end of the flash and prints the highest
+ * BOOTLOADER_ADDRESS which fits.
+ *
+ *  ENABLE_PAGE_DATA_TRANSFER  Set this to '1' to accept a whole page with one control transfer.
+ *                             The page content is sent in the data stage of the transfer instead
+ *                             of using one setup packet for every 4 bytes.
+ *
+ *  ENABLE_STATUS_REQUEST      Set this to '1' to answer status requests. The device does not answer before the
+ *                             last page write or erase is finished, so the host tool polls for a reply instead
+ *                             of waiting a fixed, padded time. Only an incremental erase is reported as pending.
+ *
+ *  ENABLE_BOUNDED_ERASE       Set this to '1' to accept the end address of the new application with the
+ *                             erase command. Only the pages below this address and the last page with the
+ *                             tiny vector table are erased, which saves time and flash wear for small programs.
+ *
+ *  ENABLE_PAGE_CRC            Set this to '1' to let the host query a CRC16 of each flash page and erase
+ *                             single pages. The host tool then rewrites only the pages which have changed.
+ *
+ *  ENABLE_INCREMENTAL_ERASE   Set this to '1' to erase only one page per 5 ms main loop pass and to answer
+ *                             USB requests in between. The host polls the erase progress instead of losing
+ *                             the device during a long erase. Requires ENABLE_STATUS_REQUEST.
+ *
+ *  ENABLE_ERASE_ON_WRITE      Set this to '1' to erase each page just before it is written, so the host tool
+ *                             can skip the erase of the whole application. The reported page write time is
+ *                             doubled to include the erase.
+ *
+ *  ENABLE_FILL_AND_COPY       Set this to '1' to accept requests which fill the page buffer with a repeated word
+ *                             or with words copied from already programmed flash. The host tool uses them
+ *                             for runs and repeated tables and sends fewer requests per page.
+ *
+ *  ENABLE_FAST_RECONNECT      Set this to '1' to skip the 300 ms USB disconnect at bootloader entry after a power
+ *                             on reset. The host has not enumerated the device before, so there is nothing to renew.
+ *                             Other resets still disconnect, since the host may hold an old enumeration.
+ *                             Without SAVE_MCUSR, the user program starts with PORF cleared.
+ *
+ *  ENABLE_IDLE_CONTROL        Set this to '1' to let the host set the idle time after each request until the user
+ *                             program is started, to hold the bootloader open for longer jobs or to start the
+ *                             program right after the reply instead of after the 5 ms exit timeout.
+ *                             Requires AUTO_EXIT_MS.
+ */
+#ifndef ENABLE_PAGE_DATA_TRANSFER
+#define ENABLE_PAGE_DATA_TRANSFER 0
+#endif
+#ifndef ENABLE_STATUS_REQUEST
+#define ENABLE_STATUS_REQUEST 0
+#endif
+#ifndef ENABLE_BOUNDED_ERASE
+#define ENABLE_BOUNDED_ERASE 0
+#endif
+#ifndef ENABLE_PAGE_CRC
+#define ENABLE_PAGE_CRC 0
+#endif
+#ifndef ENABLE_INCREMENTAL_ERASE
+#define ENABLE_INCREMENTAL_ERASE 0
+#endif
+#ifndef ENABLE_ERASE_ON_WRITE
+#define ENABLE_ERASE_ON_WRITE 0
+#endif
+#ifndef ENABLE_FILL_AND_COPY
+#define ENABLE_FILL_AND_COPY 0
+#endif
+#ifndef ENABLE_FAST_RECONNECT
+#define ENABLE_FAST_RECONNECT 0
+#endif
+#ifndef ENABLE_IDLE_CONTROL
+#define ENABLE_IDLE_CONTROL 0
+#endif
+
+#if ENABLE_PAGE_CRC
+#include <util/crc16.h>
+#endif
 #include "usbdrv/usbdrv.c"
 
 // Microcontroller vector table entries in the flash
@@ -60,15 +137,16 @@
 #endif
 #define PROGMEM_SIZE (BOOTLOADER_ADDRESS - POSTSCRIPT_SIZE) /* max size of user program */
 
-// verify the bootloader address aligns with page size
+// the ATtiny841/441/1634 erase 4 pages at once
 #if (defined __AVR_ATtiny841__)||(defined __AVR_ATtiny441__)||(defined __AVR_ATtiny1634__)
-#if BOOTLOADER_ADDRESS % ( SPM_PAGESIZE * 4 ) != 0
-#error "BOOTLOADER_ADDRESS in makefile must be a multiple of chip's pagesize"
-#endif
+#define ERASE_BLOCK_SIZE (SPM_PAGESIZE * 4)
 #else
-#if BOOTLOADER_ADDRESS % SPM_PAGESIZE != 0
-#error "BOOTLOADER_ADDRESS in makefile must be a multiple of chip's pagesize"
+#define ERASE_BLOCK_SIZE SPM_PAGESIZE
 #endif
+
+// verify the bootloader address aligns with page size
+#if BOOTLOADER_ADDRESS % ERASE_BLOCK_SIZE != 0
+#error "BOOTLOADER_ADDRESS in makefile must be a multiple of chip's pagesize"
 #endif
 
 #if SPM_PAGESIZE>256
@@ -95,6 +173,7 @@
 //   Byte 5:  SIGNATURE_2
 //   Byte 6:  Bootloader feature flags
 //   Byte 7:  Application major version<< 4 | Application minor version, 0 = no entry
+//   Byte 8:  Protocol extension flags. Only sent if at least one extension is enabled.
 #if FAST_EXIT_NO_USB_MS > 120
 #define FAST_EXIT_FEATURE_FLAG 0x10
 #else
@@ -106,30 +185,117 @@
 #define SAVE_MCUSR_FEATURE_FLAG 0x00
 #endif
 
+#if ENABLE_PAGE_DATA_TRANSFER
+#define PAGE_DATA_TRANSFER_FEATURE_FLAG 0x01
+#else
+#define PAGE_DATA_TRANSFER_FEATURE_FLAG 0x00
+#endif
+#if ENABLE_STATUS_REQUEST
+#define STATUS_REQUEST_FEATURE_FLAG 0x02
+#else
+#define STATUS_REQUEST_FEATURE_FLAG 0x00
+#endif
+#if ENABLE_BOUNDED_ERASE
+#define BOUNDED_ERASE_FEATURE_FLAG 0x04
+#else
+#define BOUNDED_ERASE_FEATURE_FLAG 0x00
+#endif
+#if ENABLE_PAGE_CRC
+#define PAGE_CRC_FEATURE_FLAG 0x08
+#else
+#define PAGE_CRC_FEATURE_FLAG 0x00
+#endif
+#if ENABLE_INCREMENTAL_ERASE
+#define INCREMENTAL_ERASE_FEATURE_FLAG 0x10
+#else
+#define INCREMENTAL_ERASE_FEATURE_FLAG 0x00
+#endif
+#if ENABLE_ERASE_ON_WRITE
+#define ERASE_ON_WRITE_FEATURE_FLAG 0x20
+// The reported page write time includes the erase, so host tools without erase on write support wait long enough
+#define CONFIGURATION_WRITE_SLEEP ((((MICRONUCLEUS_WRITE_SLEEP) & 0x7f) * 2) | ((MICRONUCLEUS_WRITE_SLEEP) & 0x80))
+#else
+#define ERASE_ON_WRITE_FEATURE_FLAG 0x00
+#define CONFIGURATION_WRITE_SLEEP MICRONUCLEUS_WRITE_SLEEP
+#endif
+#if ENABLE_FILL_AND_COPY
+#define FILL_AND_COPY_FEATURE_FLAG 0x40
+#else
+#define FILL_AND_COPY_FEATURE_FLAG 0x00
+#endif
+#if ENABLE_IDLE_CONTROL
+#define IDLE_CONTROL_FEATURE_FLAG 0x80
+#else
+#define IDLE_CONTROL_FEATURE_FLAG 0x00
+#endif
+#define EXTENSION_FEATURE_FLAGS (PAGE_DATA_TRANSFER_FEATURE_FLAG | STATUS_REQUEST_FEATURE_FLAG | BOUNDED_ERASE_FEATURE_FLAG \
+        | PAGE_CRC_FEATURE_FLAG | INCREMENTAL_ERASE_FEATURE_FLAG | ERASE_ON_WRITE_FEATURE_FLAG | FILL_AND_COPY_FEATURE_FLAG \
+        | IDLE_CONTROL_FEATURE_FLAG)
+
+#if ENABLE_INCREMENTAL_ERASE && !ENABLE_STATUS_REQUEST
+#error "ENABLE_INCREMENTAL_ERASE requires ENABLE_STATUS_REQUEST, the host polls the erase progress"
+#endif
+
+#if ENABLE_IDLE_CONTROL && (AUTO_EXIT_MS == 0)
+#error "ENABLE_IDLE_CONTROL requires AUTO_EXIT_MS, the idle time is counted by the exit timeout"
+#endif
+
 #if defined(STORE_CONFIGURATION_REPLY_IN_RAM)
-const uint8_t configurationReply[8] = { // dummy comment for eclipse formatter
+const uint8_t configurationReply[] = { // dummy comment for eclipse formatter
     (((uint16_t) PROGMEM_SIZE) >> 8) & 0xff,//
     ((uint16_t) PROGMEM_SIZE) & 0xff,
     SPM_PAGESIZE,
-    MICRONUCLEUS_WRITE_SLEEP,
+    CONFIGURATION_WRITE_SLEEP,
     SIGNATURE_1,
     SIGNATURE_2,
     FAST_EXIT_FEATURE_FLAG | ENTRYMODE, //
     0x0// 0x15 -> Application version 1.5
+#if EXTENSION_FEATURE_FLAGS
+    , EXTENSION_FEATURE_FLAGS
+#endif
 };
 #else
-PROGMEM const uint8_t configurationReply[8] = { // dummy comment for eclipse formatter
+PROGMEM const uint8_t configurationReply[] = { // dummy comment for eclipse formatter
         (((uint16_t) PROGMEM_SIZE) >> 8) & 0xff, //
         ((uint16_t) PROGMEM_SIZE) & 0xff,
         SPM_PAGESIZE,
-        MICRONUCLEUS_WRITE_SLEEP,
+        CONFIGURATION_WRITE_SLEEP,
         SIGNATURE_1,
         SIGNATURE_2,
         FAST_EXIT_FEATURE_FLAG | ENTRYMODE, //
                 0x0 // 0x15 -> Application version 1.5
+#if EXTENSION_FEATURE_FLAGS
+                , EXTENSION_FEATURE_FLAGS
+#endif
         };
 #endif
 
+#if ENABLE_STATUS_REQUEST || ENABLE_PAGE_CRC
+// Device status reply
+// Length: 2 bytes, 4 bytes with ENABLE_INCREMENTAL_ERASE
+//   Byte 0:  Command pending for the main loop, 0 = idle
+//   Byte 1:  SPM busy flag, 0 = idle
+//   Byte 2:  Erase address, low byte. Only with ENABLE_INCREMENTAL_ERASE, the erase is finished at address 0
+//   Byte 3:  Erase address, high byte
+// Page CRC reply
+// Length: 2 bytes
+//   Byte 0:  CRC16 of the page content, low byte
+//   Byte 1:  CRC16 of the page content, high byte
+#if ENABLE_INCREMENTAL_ERASE
+static uint8_t replyBuffer[4];
+#else
+static uint8_t replyBuffer[2];
+#endif
+#endif
+
+#if ENABLE_INCREMENTAL_ERASE && ENABLE_BOUNDED_ERASE
+static uint16_t eraseEndAddress; // currentAddress is used as erase pointer
+#endif
+
+#if ENABLE_IDLE_CONTROL
+static uint16_t idleStart; // idle counter value set by cmd_set_idle, loaded again by every request
+#endif
+
 typedef union {
     uint16_t w;
     uint8_t b[2];
@@ -147,18 +313,36 @@ enum {
     cmd_local_nop = 0,
     cmd_device_info = 0,
     cmd_transfer_page = 1,
-    cmd_erase_application = 2,
+    cmd_erase_application = 2, // optional end address of the new application in wIndex
     cmd_write_data = 3,
     cmd_exit = 4,
+    cmd_transfer_page_data = 5, // page address in wIndex, page content in the data stage
+    cmd_get_status = 6,
+    cmd_get_page_crc = 7, // page address in wIndex
+    cmd_erase_page = 8, // page address in wIndex, erases 4 pages on the ATtiny841/441/1634
+    cmd_fill_words = 9, // word in wValue, word count in wIndex, stops at the end of the page
+    cmd_copy_words = 10, // flash source address in wValue, word count in wIndex, stops at the end of the page
+    cmd_set_idle = 11, // idle time until the user program is started in wValue in 5 ms ticks, 0 starts it after the reply
     cmd_write_page = 64  // internal commands start at 64
 };
 register uint8_t command asm("r3");  // bind command to r3
 
+// The benchmark of bench/bench.c calls these functions in the simulator, so it needs their addresses
+#if defined(MICRONUCLEUS_BENCH)
+#define BENCH_NOINLINE __attribute__((noinline, used))
+#else
+#define BENCH_NOINLINE
+#endif
+
 /* ------------------------------------------------------------------------ */
-static inline void eraseApplication(void);
-static void writeFlashPage(void);
-static void writeWordToPageBuffer(uint16_t data);
-static uint8_t usbFunctionSetup(uint8_t data[8]);
+static inline void erasePage(uint16_t address);
+static inline void eraseApplication(void) BENCH_NOINLINE;
+static void writeFlashPage(void) BENCH_NOINLINE;
+static void writeWordToPageBuffer(uint16_t data) BENCH_NOINLINE;
+static uint8_t usbFunctionSetup(uint8_t data[8]) BENCH_NOINLINE;
+#if ENABLE_PAGE_DATA_TRANSFER
+static uint8_t usbFunctionWrite(uint8_t *data, uint8_t len);
+#endif
 static inline void leaveBootloader(void);
 void blinkLED(uint8_t aBlinkCount);
 
@@ -168,46 +352,84 @@ USB_PUBLIC usbMsgLen_t __attribute__((unused)) usbFunctionDescriptor(struct usbR
     return 0;
 }
 
+/*
+ * Erase the page at address, or the block of 4 pages on the ATtiny841/441/1634
+ */
+static inline void erasePage(uint16_t address) {
+    boot_page_erase(address);
+    /*
+     * Compiles to:
+     * 83 e0           ldi r24, 0x03   ; 3
+     * 80 93 57 00     sts 0x0057, r24 ; 0x800057
+     * e8 95           spm
+     *
+     * using the 2 lines instead saves 2 bytes, but then the bootloader does not work :-(
+     * __SPM_REG = (__BOOT_PAGE_ERASE);
+     * asm volatile("spm" : : "z" ((uint16_t)(address))); // the value of address is used and can not be optimized away
+     */
+#if (defined __AVR_ATmega328P__)||(defined __AVR_ATmega168P__)||(defined __AVR_ATmega88P__)||(defined __AVR_ATtiny828__)
+    // the ATmegaATmega328p/168p/88p don't halt the CPU when writing to RWW flash, so we need to wait here
+    boot_spm_busy_wait();
+#endif
+}
+
 /*
  * erase all pages until bootloader, in reverse order (so our vectors stay in place for as long as possible)
  * to minimize the chance of leaving the device in a state where the bootloader wont run, if there's power failure
  * during upload
+ * With ENABLE_BOUNDED_ERASE, currentAddress holds the end address of the new application sent by the host
+ * and only the pages below it and the last page with the tiny vector table are erased.
+ * With ENABLE_INCREMENTAL_ERASE, only one page is erased per call, so USB is serviced between the pages.
+ * currentAddress holds the last erased page then and the main loop calls us again until it is 0.
  */
 static inline void eraseApplication(void) {
+#if ENABLE_INCREMENTAL_ERASE
+    uint16_t ptr = currentAddress.w;
+#else
     uint16_t ptr = BOOTLOADER_ADDRESS; // from Makefile.inc
+#endif
+#if ENABLE_BOUNDED_ERASE
+#  if ENABLE_INCREMENTAL_ERASE
+    uint16_t lastUsedAddress = eraseEndAddress - 1;
+#  else
+    uint16_t lastUsedAddress = currentAddress.w - 1; // end address 0 wraps around and erases all pages
+#  endif
+#endif
 
     while (ptr) {
-#if (defined __AVR_ATtiny841__)||(defined __AVR_ATtiny441__)||(defined __AVR_ATtiny1634__)
-    ptr -= SPM_PAGESIZE * 4;
-#else
-        ptr -= SPM_PAGESIZE;
+        ptr -= ERASE_BLOCK_SIZE;
+#if ENABLE_BOUNDED_ERASE
+        if (ptr > lastUsedAddress && ptr != BOOTLOADER_ADDRESS - ERASE_BLOCK_SIZE) {
+            continue; // page is not used by the new application
+        }
 #endif
-        boot_page_erase(ptr);
-        /*
-         * Compiles to:
-         * 83 e0           ldi r24, 0x03   ; 3
-         * 80 93 57 00     sts 0x0057, r24 ; 0x800057
-         * e8 95           spm
-         *
-         * using the 2 lines instead saves 2 bytes, but then the bootloader does not work :-(
-         * __SPM_REG = (__BOOT_PAGE_ERASE);
-         * asm volatile("spm" : : "z" ((uint16_t)(ptr))); // the value of ptr is used and can not be optimized away
-         */
-#if (defined __AVR_ATmega328P__)||(defined __AVR_ATmega168P__)||(defined __AVR_ATmega88P__)||(defined __AVR_ATtiny828__)
-    // the ATmegaATmega328p/168p/88p don't halt the CPU when writing to RWW flash, so we need to wait here
-    boot_spm_busy_wait();
+        erasePage(ptr);
+#if ENABLE_INCREMENTAL_ERASE
+        break;
 #endif
     }
 
+#if ENABLE_INCREMENTAL_ERASE
+    // Address is 0 after the last page, which also ensures the reset vector is written first.
+    currentAddress.w = ptr;
+#else
     // Reset address to ensure the reset vector is written first.
     currentAddress.w = 0;
+#endif
 }
 
 /*
  * Simply write currently stored page in to already erased flash memory
+ * With ENABLE_ERASE_ON_WRITE, the page is erased just before. On the ATtiny841/441/1634 the block of 4 pages
+ * is erased when its first page is written, so the host must write all pages of a block starting with the first one.
  */
 static inline void writeFlashPage(void) {
     if (currentAddress.w - 2 < BOOTLOADER_ADDRESS) {
+#if ENABLE_ERASE_ON_WRITE
+        if (((currentAddress.w - 2) % ERASE_BLOCK_SIZE) < SPM_PAGESIZE) {
+            erasePage(currentAddress.w - 2); // the page buffer is not affected by the erase
+        }
+#endif
         boot_page_write(currentAddress.w - 2);   // will halt CPU, no waiting required
 #if (defined __AVR_ATmega328P__)||(defined __AVR_ATmega168P__)||(defined __AVR_ATmega88P__)||(defined __AVR_ATtiny828__)
     // the ATmega328p/168p/88p don't halt the CPU when writing to RWW flash
@@ -274,14 +496,22 @@ static void writeWordToPageBuffer(uint16_t data) {
 static uint8_t usbFunctionSetup(uint8_t data[8]) {
     usbRequest_t *rq = (void*) data;
 
+#if ENABLE_IDLE_CONTROL
+    idlePolls.w = idleStart; // start the idle time set by the host again, AUTO_EXIT_MS if it was not set
+#else
     idlePolls.b[1] = 0; // reset high byte of idle counter when we get usb class or vendor requests to start a new timeout
+#endif
     if (rq->bRequest == cmd_device_info) { // get device info
         usbMsgPtr = (usbMsgPtr_t) configurationReply;
 #if defined(STORE_CONFIGURATION_REPLY_IN_RAM)
         usbMsgPtrIsRAMAddress = 0;
 #endif
         return sizeof(configurationReply);
-    } else if (rq->bRequest == cmd_transfer_page) {
+    } else if (rq->bRequest == cmd_transfer_page
+#if ENABLE_PAGE_DATA_TRANSFER
+            || rq->bRequest == cmd_transfer_page_data
+#endif
+            ) {
         // Set page address. Address zero always has to be written first to ensure reset vector patching.
         // Mask to page boundary to prevent vulnerability to partial page write "attacks"
         if (currentAddress.w != 0) {
@@ -299,15 +529,110 @@ static uint8_t usbFunctionSetup(uint8_t data[8]) {
             __SPM_REG=_BV(__SPM_ENABLE);
   #endif
 #endif
+#if defined(MICRONUCLEUS_NATIVE)
+            nativeSpm(currentAddress.w, 0);
+#else
             asm volatile("spm");
+#endif
 
         }
+#if ENABLE_PAGE_DATA_TRANSFER
+        if (rq->bRequest == cmd_transfer_page_data) {
+            return USB_NO_MSG; // page content follows in the data stage and is passed to usbFunctionWrite()
+        }
+#endif
+#if ENABLE_STATUS_REQUEST
+    } else if (rq->bRequest == cmd_get_status) { // let the host poll for completion of the last command
+        /*
+         * The main loop executes a command before it processes the next request and the CPU of the tinies does not
+         * even answer during SPM, so any reply means that the last write or erase is finished. Only an incremental
+         * erase is still pending between the passes of the main loop. The SPM busy flag is always 0 here.
+         */
+        replyBuffer[0] = command;
+        replyBuffer[1] = boot_spm_busy();
+#if ENABLE_INCREMENTAL_ERASE
+        replyBuffer[2] = currentAddress.b[0];
+        replyBuffer[3] = currentAddress.b[1];
+#endif
+        usbMsgPtr = (usbMsgPtr_t) replyBuffer;
+        usbMsgPtrIsRAMAddress = 1;
+        return sizeof(replyBuffer);
+#endif
+#if ENABLE_PAGE_CRC
+    } else if (rq->bRequest == cmd_get_page_crc) { // let the host skip pages which are already up to date
+        uint16_t crc = 0xffff;
+        uint16_t address = rq->wIndex.word & ~(SPM_PAGESIZE - 1);
+        uint8_t wordCount = SPM_PAGESIZE / 2;
+#if (defined __AVR_ATmega328P__)||(defined __AVR_ATmega168P__)||(defined __AVR_ATmega88P__)||(defined __AVR_ATtiny828__)
+        // the RWW section can not be read after an erase or write until it is enabled again
+        boot_rww_enable();
+#endif
+        do {
+            uint16_t word = pgm_read_word(address);
+#if OSCCAL_SAVE_CALIB
+            if (address == BOOTLOADER_ADDRESS - TINYVECTOR_OSCCAL_OFFSET) {
+                word = 0xffff; // the stored OSCCAL is not sent by the host, so it is reported as erased
+            }
+#endif
+            crc = _crc16_update(crc, word & 0xff);
+            crc = _crc16_update(crc, word >> 8);
+            address += 2;
+        } while (--wordCount);
+        replyBuffer[0] = crc & 0xff;
+        replyBuffer[1] = crc >> 8;
+        usbMsgPtr = (usbMsgPtr_t) replyBuffer;
+        usbMsgPtrIsRAMAddress = 1;
+        return 2;
+    } else if (rq->bRequest == cmd_erase_page) {
+        // The erased address is also used by the next cmd_transfer_page, even if it is zero
+        currentAddress.b[0] = rq->wIndex.bytes[0] & (uint8_t) (~(ERASE_BLOCK_SIZE - 1));
+        currentAddress.b[1] = rq->wIndex.bytes[1];
+        command = cmd_erase_page;
+#endif
+#if ENABLE_BOUNDED_ERASE || ENABLE_INCREMENTAL_ERASE
+    } else if (rq->bRequest == cmd_erase_application) {
+#  if ENABLE_INCREMENTAL_ERASE
+        currentAddress.w = BOOTLOADER_ADDRESS; // erase starts below the bootloader
+#    if ENABLE_BOUNDED_ERASE
+        eraseEndAddress = rq->wIndex.word; // end address of the new application, 0 = erase all pages
+#    endif
+#  else
+        currentAddress.w = rq->wIndex.word; // end address of the new application, 0 = erase all pages
+#  endif
+        command = cmd_erase_application;
+#endif
     } else if (rq->bRequest == cmd_write_data) { // Write data
         writeWordToPageBuffer(rq->wValue.word);
         writeWordToPageBuffer(rq->wIndex.word);
         if ((currentAddress.b[0] % SPM_PAGESIZE) == 0) {
             command = cmd_write_page; // ask main loop to write our page
         }
+#if ENABLE_FILL_AND_COPY
+    } else if (rq->bRequest == cmd_fill_words || rq->bRequest == cmd_copy_words) { // Write repeated or already programmed data
+        uint8_t wordCount = rq->wIndex.bytes[0];
+        uint16_t source = rq->wValue.word;
+        do {
+            uint16_t data = source;
+            if (rq->bRequest == cmd_copy_words) {
+                data = pgm_read_word(source);
+                source += 2;
+            }
+            writeWordToPageBuffer(data);
+            if ((currentAddress.b[0] % SPM_PAGESIZE) == 0) {
+                command = cmd_write_page; // ask main loop to write our page
+                break;
+            }
+        } while (--wordCount);
+#endif
+#if ENABLE_IDLE_CONTROL
+    } else if (rq->bRequest == cmd_set_idle) { // let the host hold the bootloader open or start the user program at once
+        // The exit timeout in the main loop is reached after wValue ticks without a request, the counter wraps for values above AUTO_EXIT_MS / 5
+        idleStart = (AUTO_EXIT_MS / 5) - rq->wValue.word;
+        idlePolls.w = idleStart;
+        if (rq->wValue.word == 0) {
+            command = cmd_set_idle; // exit as soon as the reply is sent
+        }
+#endif
     } else {
         // Handle cmd_erase_application and cmd_exit
         command = rq->bRequest & 0x3f;
@@ -315,6 +640,25 @@ static uint8_t usbFunctionSetup(uint8_t data[8]) {
     return 0;
 }
 
+#if ENABLE_PAGE_DATA_TRANSFER
+/*
+ * Called by the driver for each data packet of a cmd_transfer_page_data transfer.
+ * Returns 1 if the page buffer is full, which lets the driver send the status stage.
+ */
+static uint8_t usbFunctionWrite(uint8_t *data, uint8_t len) {
+    while (len >= 2) {
+        writeWordToPageBuffer(*(uint16_t*) data);
+        data += 2;
+        len -= 2;
+        if ((currentAddress.b[0] % SPM_PAGESIZE) == 0) {
+            command = cmd_write_page; // ask main loop to write our page
+            return 1;
+        }
+    }
+    return 0;
+}
+#endif
+
 /*
  * Try to disable watchdog and set timeout to maximum in case the WDT can not be disabled, because it is fused on.
  * Shortest watchdog timeout is 16 ms.
@@ -343,13 +687,34 @@ static void inactivateWatchdog(void) {
 #endif
 }
 
+#if OSCCAL_SAVE_CALIB
+/*
+ * Adjust clock to previous calibration value, so bootloader AND User program starts with proper clock calibration, even when not connected to USB
+ */
+static inline void loadStoredCalibration(void) {
+    unsigned char stored_osc_calibration = pgm_read_byte(BOOTLOADER_ADDRESS - TINYVECTOR_OSCCAL_OFFSET);
+    if (stored_osc_calibration != 0xFF) {
+        OSCCAL = stored_osc_calibration;
+        // we changed clock so "wait" for one cycle
+        asm volatile("nop");
+    }
+}
+#endif
+
 /*
  * USB disconnect by disabling pullup resistor by pull down D-, wait 300ms and reconnect
+ * With ENABLE_FAST_RECONNECT, the disconnect is skipped after a power on reset
  * Initialize interrupt settings after reconnect but let the global interrupt be disabled
  */
-static void reconnectAndInitUSB(void) {
-    usbDeviceDisconnect(); // Disable pullup resistor by pull down D-
-    _delay_ms(RECONNECT_DELAY_MILLIS); // Even 250 is to fast!
+static void reconnectAndInitUSB(uint8_t powerOnReset) {
+#if ENABLE_FAST_RECONNECT
+    // The host has not enumerated the device before it was powered on, so there is no enumeration to renew
+    if (!powerOnReset)
+#endif
+    {
+        usbDeviceDisconnect(); // Disable pullup resistor by pull down D-
+        _delay_ms(RECONNECT_DELAY_MILLIS); // Even 250 is to fast!
+    }
     usbDeviceConnect(); // Enable pullup resistor by changing D- to input
 
     usbInit();    // Initialize interrupt settings after reconnect but let the global interrupt be disabled
@@ -366,21 +731,20 @@ __attribute__((__noreturn__)) static inline void leaveBootloader(void) {
     GPIOR0 = MCUSR;
     MCUSR = 0;
 #endif
-
-#if OSCCAL_RESTORE_DEFAULT
-  OSCCAL=osccal_default;
-  asm volatile("nop"); // NOP to avoid CPU hickup during oscillator stabilization
-#endif
-
-#if (defined __AVR_ATmega328P__)||(defined __AVR_ATmega168P__)||(defined __AVR_ATmega88P__)||(defined __AVR_ATtiny828__)
-  // Tell the system that we want to read from the RWW memory again.
-  boot_rww_enable();
+#if ENABLE_FAST_RECONNECT && !defined(SAVE_MCUSR)
+    // Only inactivateWatchdog() clears MCUSR, which did not run if the bootloader was not entered.
+    // A later reset into the bootloader must not see the PORF of this start and skip the disconnect.
+    MCUSR &= ~_BV(PORF);
 #endif
 
 #define STR_HELPER(x) #x
 #define STR(x) STR_HELPER(x)
     // jump to application reset vector at end of flash
+#if defined(MICRONUCLEUS_NATIVE)
+    nativeLeaveBootloader(); // the native build has no application, see native/native.c
+#else
     asm volatile ("rjmp __vectors - " STR(TINYVECTOR_RESET_OFFSET));
+#endif
     __builtin_unreachable(); // Tell the compiler function does not return, to help compiler optimize
 }
 
@@ -391,29 +755,35 @@ int main(void) {
     // bootLoaderInit() is a Macro defined in bootloaderconfig.h and mainly empty except for ENTRY_JUMPER, where it sets the pullup and waits 1 ms.
     bootLoaderInit();
 
-    /* save default OSCCAL calibration  */
-#if OSCCAL_RESTORE_DEFAULT
-  osccal_default = OSCCAL;
-#endif
-
-#if OSCCAL_SAVE_CALIB
-    // Adjust clock to previous calibration value, so bootloader AND User program starts with proper clock calibration, even when not connected to USB
-    unsigned char stored_osc_calibration = pgm_read_byte(BOOTLOADER_ADDRESS - TINYVECTOR_OSCCAL_OFFSET);
-    if (stored_osc_calibration != 0xFF) {
-        OSCCAL = stored_osc_calibration;
-        // we changed clock so "wait" for one cycle
-        asm volatile("nop");
-    }
+    /*
+     * If the bootloader is not entered, only the entry check and leaveBootloader() run before the user program.
+     * The OSCCAL default is saved and restored only if the bootloader is entered, since OSCCAL is not changed otherwise.
+     */
+#if OSCCAL_SAVE_CALIB && !OSCCAL_RESTORE_DEFAULT
+    loadStoredCalibration(); // the user program starts with the stored calibration, too
 #endif
     // bootLoaderStartCondition() is a Macro defined in bootloaderconfig.h and mainly is set to true or checks a bit in MCUSR
     if (bootLoaderStartCondition() || (pgm_read_byte(BOOTLOADER_ADDRESS - TINYVECTOR_RESET_OFFSET + 1) == 0xff)) {
         /*
          * Here boot condition matches or vector table is empty / no program loaded
          */
+#if OSCCAL_RESTORE_DEFAULT
+        /* save default OSCCAL calibration  */
+        osccal_default = OSCCAL;
+#  if OSCCAL_SAVE_CALIB
+        loadStoredCalibration();
+#  endif
+#endif
+
+#if ENABLE_FAST_RECONNECT
+        uint8_t powerOnReset = MCUSR & _BV(PORF); // read before inactivateWatchdog(), which clears MCUSR without SAVE_MCUSR
+#else
+        uint8_t powerOnReset = 0;
+#endif
 
         inactivateWatchdog(); // Sets at least watchdog timeout to 2 seconds.
 
-        reconnectAndInitUSB(); // USB disconnect by disabling pullup resistor by pull down D-, wait 300ms and reconnect, and enable USB interrupts
+        reconnectAndInitUSB(powerOnReset); // USB disconnect by disabling pullup resistor by pull down D-, wait 300ms and reconnect, and enable USB interrupts
 
         LED_INIT(); // Set LED pin to output, if LED exists
 
@@ -494,7 +864,7 @@ int main(void) {
 
             } while (--t5msTimeoutCounter); // after 5 ms t5msTimeoutCounter is 0.
 
-            asm volatile("wdr");
+            wdt_reset();
             // perform cyclically watchdog reset, for the case it is fused on and we can not disable it.
 
 #if OSCCAL_SLOW_PROGRAMMING // reduce clock to enable save flash programming timing
@@ -510,6 +880,18 @@ int main(void) {
             if (command == cmd_write_page) {
                 writeFlashPage();
             }
+#if ENABLE_PAGE_CRC
+            if (command == cmd_erase_page && currentAddress.w < BOOTLOADER_ADDRESS) {
+                erasePage(currentAddress.w); // never erase the bootloader itself
+            }
+#endif
+#if ENABLE_FILL_AND_COPY && ((defined __AVR_ATmega328P__)||(defined __AVR_ATmega168P__)||(defined __AVR_ATmega88P__)||(defined __AVR_ATtiny828__))
+            // cmd_copy_words reads the RWW flash, which must be enabled again after an erase or write.
+            // This must not be done while the page buffer is filled, since it clears the buffer.
+            if (command == cmd_erase_application || command == cmd_write_page || command == cmd_erase_page) {
+                boot_rww_enable();
+            }
+#endif
 #if OSCCAL_SLOW_PROGRAMMING
             OSCCAL      = osccal_tmp;
 #endif
@@ -518,7 +900,16 @@ int main(void) {
                 if (!t5msTimeoutCounter) {
                     break;  // Only exit after 5 ms timeout
                 }
+#if ENABLE_IDLE_CONTROL
+            } else if (command == cmd_set_idle) {
+                if (usbTxLen & 0x10) {
+                    break; // The zero length reply was built in the last pass and the host has fetched it
+                }
+#endif
             } else {
+#if ENABLE_INCREMENTAL_ERASE
+                if (command != cmd_erase_application || currentAddress.w == 0) // continue erasing in the next loop
+#endif
                 command = cmd_local_nop;
             }
 
@@ -531,7 +922,7 @@ int main(void) {
                 if (len >= 0) {
                     usbProcessRx(usbRxBuf + 1, len); // only single buffer due to in-order processing
                     usbRxLen = 0; /* mark rx buffer as available */
-#if (FAST_EXIT_NO_USB_MS > 0)
+#if (FAST_EXIT_NO_USB_MS > 0) && !ENABLE_IDLE_CONTROL // usbFunctionSetup() resets the counter, too, and must not be overruled after cmd_set_idle
                     if ((*(usbRxBuf + 1) & USBRQ_TYPE_MASK) != USBRQ_TYPE_STANDARD) {
                         // we have a request from a running micronucleus program here
                         idlePolls.b[1] = 0; // Reset counter to have 6 seconds timeout since we detected running micronucleus program here
@@ -566,6 +957,7 @@ int main(void) {
 
             if (USB_INTR_PENDING & (_BV(USB_INTR_PENDING_BIT))) {
                 // Usbpoll() collided with data packet
+#if !defined(MICRONUCLEUS_NATIVE)
                 uint8_t ctr;
 
                 // loop takes 5 cycles
@@ -578,6 +970,7 @@ int main(void) {
                         : "=&d" (ctr)
                         : "M" ((uint8_t)(8.8f*(F_CPU/1.0e6f)/5.0f+0.5)), "I" (_SFR_IO_ADDR(USBIN)), "M" (USB_CFG_DMINUS_BIT)
                 );
+#endif
                 USB_INTR_PENDING = _BV(USB_INTR_PENDING_BIT);
             }
         } while (1);
@@ -612,6 +1005,15 @@ int main(void) {
         USB_INTR_ENABLE = 0;
         USB_INTR_CFG = 0; /* also reset config bits */
 
+#if OSCCAL_RESTORE_DEFAULT
+        OSCCAL = osccal_default;
+        asm volatile("nop"); // NOP to avoid CPU hickup during oscillator stabilization
+#endif
+
+#if (defined __AVR_ATmega328P__)||(defined __AVR_ATmega168P__)||(defined __AVR_ATmega88P__)||(defined __AVR_ATtiny828__)
+        // Tell the system that we want to read from the RWW memory again. Only required after we programmed the flash.
+        boot_rww_enable();
+#endif
     }
 
     leaveBootloader();
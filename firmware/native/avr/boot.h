@@ -0,0 +1,33 @@
+/*
+ * avr/boot.h of the native build, see native.c
+ *
+ * The SPM instructions work on nativeFlash and the page buffer. Erasing and writing take the
+ * virtual time of the SPM, the ATtinies are halted during this time, the ATmegas keep running
+ * and are busy until the time has passed.
+ */
+#ifndef NATIVE_AVR_BOOT_H
+#define NATIVE_AVR_BOOT_H
+
+#include <stdint.h>
+
+void nativeSpm(uint16_t address, uint16_t data);
+uint8_t nativeSpmBusy(void);
+void nativeSpmBusyWait(void);
+
+#define __BOOT_PAGE_ERASE   (_BV(__SPM_ENABLE) | _BV(PGERS))
+#define __BOOT_PAGE_WRITE   (_BV(__SPM_ENABLE) | _BV(PGWRT))
+#define __BOOT_PAGE_FILL    _BV(__SPM_ENABLE)
+
+#define boot_page_fill(address, data) (__SPM_REG = __BOOT_PAGE_FILL, nativeSpm((address), (data)))
+#define boot_page_erase(address)      (__SPM_REG = __BOOT_PAGE_ERASE, nativeSpm((address), 0))
+#define boot_page_write(address)      (__SPM_REG = __BOOT_PAGE_WRITE, nativeSpm((address), 0))
+#define boot_spm_busy()               nativeSpmBusy()
+#define boot_spm_busy_wait()          nativeSpmBusyWait()
+
+#ifdef RWWSRE
+#define boot_rww_enable()             (__SPM_REG = (_BV(RWWSRE) | _BV(__SPM_ENABLE)), nativeSpm(0, 0))
+#else
+#define boot_rww_enable()
+#endif
+
+#endif
@@ -0,0 +1,184 @@
+/*
+ * avr/io.h of the native build, see native.c
+ *
+ * The I/O registers are bytes in memory. Only the registers and bits used by main.c, usbdrv
+ * and the bootloaderconfig.h files are defined, with the device specific ones selected by
+ * the __AVR_<device>__ macro like avr-libc does.
+ * Reading the interrupt flag registers lets the virtual time pass and reports USB traffic.
+ */
+#ifndef NATIVE_AVR_IO_H
+#define NATIVE_AVR_IO_H
+
+#include <stdint.h>
+
+#define _BV(bit) (1 << (bit))
+
+extern volatile uint8_t nativeRegisters[64];
+volatile uint8_t *nativeInterruptFlags(void);
+
+#define PINA    nativeRegisters[0]
+#define DDRA    nativeRegisters[1]
+#define PORTA   nativeRegisters[2]
+#define PINB    nativeRegisters[3]
+#define DDRB    nativeRegisters[4]
+#define PORTB   nativeRegisters[5]
+#define PINC    nativeRegisters[6]
+#define DDRC    nativeRegisters[7]
+#define PORTC   nativeRegisters[8]
+#define PIND    nativeRegisters[9]
+#define DDRD    nativeRegisters[10]
+#define PORTD   nativeRegisters[11]
+#define MCUSR   nativeRegisters[12]
+#define MCUCR   nativeRegisters[13]
+#define OSCCAL  nativeRegisters[14]
+#define GPIOR0  nativeRegisters[15]
+#define SPMCSR  nativeRegisters[16]
+#define PCMSK   nativeRegisters[17]
+#define PCMSK0  nativeRegisters[18]
+#define PCMSK1  nativeRegisters[19]
+#define PCMSK2  nativeRegisters[20]
+#define EICRA   nativeRegisters[21]
+#define CLKPR   nativeRegisters[22]
+
+#define GIFR    (*nativeInterruptFlags())
+#define EIFR    (*nativeInterruptFlags())
+#define PCIFR   (*nativeInterruptFlags())
+
+// MCUSR
+#define PORF    0
+#define EXTRF   1
+#define BORF    2
+#define WDRF    3
+
+// watchdog
+#define WDP0    0
+#define WDP1    1
+#define WDP2    2
+#define WDE     3
+#define WDCE    4
+#define WDP3    5
+
+// pin change and external interrupts
+#define INT0    6
+#define INTF0   6
+#define PCIE    5
+#define PCIF    5
+#define PCIE0   4
+#define PCIF0   4
+#define PCIE1   5
+#define PCIF1   5
+#define PCIE2   3
+#define PCIF2   3
+#define ISC00   0
+#define ISC01   1
+
+// SPMCSR
+#define SPMEN   0
+#define SELFPRGEN 0
+#define PGERS   1
+#define PGWRT   2
+#define RWWSRE  4
+#define CTPB    4
+#define __SPM_REG SPMCSR
+#define __SPM_ENABLE SPMEN
+
+#define PA0 0
+#define PA1 1
+#define PA2 2
+#define PA3 3
+#define PA4 4
+#define PA5 5
+#define PA6 6
+#define PA7 7
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PB6 6
+#define PB7 7
+#define PC0 0
+#define PC1 1
+#define PC2 2
+#define PC3 3
+#define PC4 4
+#define PC5 5
+#define PC6 6
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PD6 6
+#define PD7 7
+
+#if defined(__AVR_ATtiny85__) || defined(__AVR_ATtiny45__)
+#  define SPM_PAGESIZE 64
+#  define GIMSK   nativeRegisters[30]
+#  define WDTCR   nativeRegisters[31]
+#  undef RWWSRE
+#  if defined(__AVR_ATtiny85__)
+#    define SIGNATURE_1 0x93
+#    define SIGNATURE_2 0x0B
+#  else
+#    define SIGNATURE_1 0x92
+#    define SIGNATURE_2 0x06
+#  endif
+#elif defined(__AVR_ATtiny84__)
+#  define SPM_PAGESIZE 64
+#  define GIMSK   nativeRegisters[30]
+#  define WDTCSR  nativeRegisters[31]
+#  define SIGNATURE_1 0x93
+#  define SIGNATURE_2 0x0C
+#  undef RWWSRE
+#elif defined(__AVR_ATtiny841__)
+#  define SPM_PAGESIZE 16
+#  define GIMSK   nativeRegisters[30]
+#  define WDTCSR  nativeRegisters[31]
+#  define CCP     nativeRegisters[32]
+#  define SIGNATURE_1 0x93
+#  define SIGNATURE_2 0x15
+#  undef RWWSRE
+#elif defined(__AVR_ATtiny4313__)
+#  define SPM_PAGESIZE 64
+#  define GIMSK   nativeRegisters[30]
+#  define WDTCSR  nativeRegisters[31]
+#  define SIGNATURE_1 0x92
+#  define SIGNATURE_2 0x0D
+#  undef RWWSRE
+#elif defined(__AVR_ATtiny88__)
+#  define SPM_PAGESIZE 64
+#  define EIMSK   nativeRegisters[30]
+#  define PCICR   nativeRegisters[33]
+#  define WDTCSR  nativeRegisters[31]
+#  define SIGNATURE_1 0x93
+#  define SIGNATURE_2 0x11
+#  undef RWWSRE
+#elif defined(__AVR_ATtiny167__)
+#  define SPM_PAGESIZE 128
+#  define EIMSK   nativeRegisters[30]
+#  define PCICR   nativeRegisters[33]
+#  define WDTCR   nativeRegisters[31]
+#  define SIGNATURE_1 0x94
+#  define SIGNATURE_2 0x87
+#  undef RWWSRE
+#elif defined(__AVR_ATmega168P__) || defined(__AVR_ATmega328P__)
+#  define SPM_PAGESIZE 128
+#  define EIMSK   nativeRegisters[30]
+#  define PCICR   nativeRegisters[33]
+#  define WDTCSR  nativeRegisters[31]
+#  undef CTPB
+#  if defined(__AVR_ATmega168P__)
+#    define SIGNATURE_1 0x94
+#    define SIGNATURE_2 0x0B
+#  else
+#    define SIGNATURE_1 0x95
+#    define SIGNATURE_2 0x0F
+#  endif
+#else
+#  error "Device not supported by the native build"
+#endif
+
+#endif
@@ -0,0 +1,21 @@
+/*
+ * avr/pgmspace.h of the native build, see native.c
+ *
+ * Addresses below 64k are addresses in the flash of the emulated device, like the ones main.c
+ * reads for the CRC and the vectors. The constant data of the firmware itself, like the
+ * descriptors, is in the memory of the host and read with its pointer.
+ */
+#ifndef NATIVE_AVR_PGMSPACE_H
+#define NATIVE_AVR_PGMSPACE_H
+
+#include <stdint.h>
+
+#define PROGMEM
+
+extern uint8_t nativeFlash[0x10000];
+
+#define pgm_read_byte(address) ((uintptr_t) (address) < sizeof(nativeFlash) \
+        ? nativeFlash[(uintptr_t) (address)] : *(const uint8_t *) (uintptr_t) (address))
+#define pgm_read_word(address) ((uint16_t) (pgm_read_byte(address) | (pgm_read_byte((uintptr_t) (address) + 1) << 8)))
+
+#endif
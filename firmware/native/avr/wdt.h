@@ -0,0 +1,13 @@
+/*
+ * avr/wdt.h of the native build, see native.c
+ *
+ * main.c resets the watchdog once per main loop pass, which is counted.
+ */
+#ifndef NATIVE_AVR_WDT_H
+#define NATIVE_AVR_WDT_H
+
+void nativeWatchdogReset(void);
+
+#define wdt_reset() nativeWatchdogReset()
+
+#endif
@@ -0,0 +1,91 @@
+#!/bin/sh
+#
+# Regression test of main.c and the command line tool, run by "make check" in firmware/.
+#
+# For each configuration and set of protocol extensions, a program is uploaded to the emulated
+# bootloader of the command line tool with --trace. The trace is replayed with the native build of
+# main.c with the same extensions, which must give the same replies and leave the same flash.
+# A second upload of a partly changed program starts from the flash of the first one.
+#
+# Environment:
+#   CHECK_CONFIGS          configurations to test, default all of configuration/
+#   COMMANDLINE_MAKEFLAGS  passed to make of the command line tool, e.g. USE_USBFS=1 or USE_LIBUSB1=1
+#   MAKE                   make program, set by make
+#
+# Exit code 0 if all tests passed, 1 otherwise.
+#
+#  This file is part of micronucleus https://github.com/micronucleus/micronucleus.
+#
+#  Micronucleus is free software: you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation, either version 2 of the License, or
+#  (at your option) any later version.
+
+cd "$(dirname "$0")/.." || exit 1
+MAKE=${MAKE:-make}
+CONFIGS=${CHECK_CONFIGS:-$(ls configuration)}
+TOOL=../commandline/micronucleus
+
+# The emulator is only built with USE_EMULATOR=1, the objects of another build are removed first
+$MAKE -s -C ../commandline clean || exit 1
+$MAKE -s -C ../commandline USE_EMULATOR=1 $COMMANDLINE_MAKEFLAGS >/dev/null || exit 1
+
+WORK=$(mktemp -d) || exit 1
+trap 'rm -rf "$WORK"; rm -f native/main_* native/*.o' EXIT
+
+# Programs start with an rjmp as reset vector, the second one keeps the first 1 KB of the first one
+{ printf '\100\300'; head -c 1998 usbdrv/usbdrv.c; } > "$WORK/first.bin"
+{ printf '\100\300'; head -c 1022 usbdrv/usbdrv.c; head -c 976 main.c; } > "$WORK/second.bin"
+
+# One set of extensions per line: EXTENSION_FEATURE_FLAGS of the emulator, defines of main.c,
+# options of the native build and options of the command line tool. The native options only apply
+# to the empty flash, since the entry mode may start the application after a power on reset.
+SETS="0x00|||
+0xdf|-DENABLE_PAGE_DATA_TRANSFER=1 -DENABLE_STATUS_REQUEST=1 -DENABLE_BOUNDED_ERASE=1 -DENABLE_PAGE_CRC=1 -DENABLE_INCREMENTAL_ERASE=1 -DENABLE_FILL_AND_COPY=1 -DENABLE_IDLE_CONTROL=1||--idle 500
+0xff|-DENABLE_PAGE_DATA_TRANSFER=1 -DENABLE_STATUS_REQUEST=1 -DENABLE_BOUNDED_ERASE=1 -DENABLE_PAGE_CRC=1 -DENABLE_INCREMENTAL_ERASE=1 -DENABLE_ERASE_ON_WRITE=1 -DENABLE_FILL_AND_COPY=1 -DENABLE_IDLE_CONTROL=1 -DENABLE_FAST_RECONNECT=1|-r 1|"
+
+failed=0
+for config in $CONFIGS; do
+  echo "$SETS" | { status=0; while IFS='|' read -r extensions defines native_options tool_options; do
+    rm -f native/main_$config
+    if ! $MAKE -s native CONFIG=$config NATIVE_DEFINES="$defines" > "$WORK/build.log" 2>&1; then
+      echo "$config ext=$extensions: native build failed"
+      cat "$WORK/build.log"
+      exit 1
+    fi
+    result=ok
+    previous=
+    for program in first second; do
+      emulator="emulator:$config,ext=$extensions,save=$WORK/emulated_$program.bin"
+      options=$native_options
+      if [ -n "$previous" ]; then
+        emulator="$emulator,load=$WORK/emulated_$previous.bin"
+        options="-l $WORK/native_$previous.bin"
+      fi
+      if ! $TOOL --transport "$emulator" --trace "$WORK/$program.trace" --run --no-ansi $tool_options \
+               --type raw "$WORK/$program.bin" > "$WORK/tool.log" 2>&1; then
+        result="upload of the $program program failed"
+        cat "$WORK/tool.log"
+        break
+      fi
+      if ! native/main_$config $options -s "$WORK/native_$program.bin" "$WORK/$program.trace" > "$WORK/native.log" 2>&1; then
+        result="replay of the $program program failed"
+        cat "$WORK/native.log"
+        break
+      fi
+      if ! cmp -s "$WORK/emulated_$program.bin" "$WORK/native_$program.bin"; then
+        result="flash differs after the $program program"
+        break
+      fi
+      previous=$program
+    done
+    echo "$config ext=$extensions: $result"
+    [ "$result" = ok ] || status=1
+  done; exit $status; } || failed=1
+done
+
+if [ $failed -ne 0 ]; then
+  echo "check failed"
+  exit 1
+fi
+echo "check passed"
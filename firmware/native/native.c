@@ -0,0 +1,434 @@
+/*
+ * Native build of the bootloader
+ *
+ * main.c of a configuration is compiled for the host together with this file, which replaces
+ * the hardware: the I/O registers are variables, the flash is an array, the SPM instructions and
+ * delays let a virtual clock pass, and USB_handler() of usbdrvasm.S is replaced by a feed which
+ * delivers the control transfers of a trace recorded by the command line tool with --trace.
+ * The firmware runs its unmodified main loop on this feed, so the number of main loop passes,
+ * the latency of each request and the resulting flash content can be measured without an AVR.
+ *
+ * Usage: native/main_<config> [-l flash.bin] [-s flash.bin] [-r mcusr] trace
+ *   -l  load the flash before the bootloader starts, it is empty otherwise
+ *   -s  save the flash below the bootloader after the bootloader has left
+ *   -r  value of MCUSR at reset, default is EXTRF
+ * Exit code 0 if the application was started after all transfers, 1 if a reply did not match
+ * the trace or the bootloader left early and 2 if the bootloader did not leave at all.
+ *
+ * Limitations: int is 32 bit on the host, only the vendor requests of the trace are fed, no
+ * standard requests, string descriptors or bus resets. A request which is not accepted at once
+ * waits until the firmware polls again, instead of being retried by the host after a NAK.
+ *
+ *  This file is part of micronucleus https://github.com/micronucleus/micronucleus.
+ *
+ *  Micronucleus is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 2 of the License, or
+ *  (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "avr/io.h"
+#include "avr/pgmspace.h"
+#include "usbdrv/usbdrv.h"
+
+#define NATIVE_CYCLES_PER_US    (F_CPU / 1000000.0)
+#define NATIVE_POLL_CYCLES      15      // one pass of the inner main loop, see main.c
+#define NATIVE_PACKET_US        100     // one packet and its handshake at low speed
+#define NATIVE_SPM_US           4500    // page erase or write
+#define NATIVE_LATE_US          1000    // a transfer accepted later than this is counted as late
+#define NATIVE_MAX_TRANSFERS    4096
+#if ENABLE_IDLE_CONTROL
+#define NATIVE_EXIT_MS          (0xFFFF * 5 + 1000) // the host may set the idle time with cmd_set_idle
+#else
+#define NATIVE_EXIT_MS          (AUTO_EXIT_MS + 1000)
+#endif
+
+// of usbdrv.c, written by USB_handler() in usbdrvasm.S on the AVR
+extern uchar usbRxBuf[];
+extern volatile schar usbRxLen;
+extern uchar usbRxToken;
+extern volatile uchar usbTxLen;
+extern uchar usbTxBuf[];
+
+int nativeFirmwareMain(void);
+
+volatile uint8_t nativeRegisters[64];
+uint8_t nativeFlash[0x10000];
+
+// one control transfer of the trace
+typedef struct {
+    unsigned long start;    // microseconds from the start of the trace
+    uint8_t setup[8];
+    int result;
+    uint8_t data[256];      // sent or received
+} nativeTransfer;
+
+enum {
+    feed_setup, feed_data_out, feed_data_in, feed_status, feed_done
+};
+
+static nativeTransfer transfers[NATIVE_MAX_TRANSFERS];
+static unsigned int transferCount;
+
+static struct {
+    unsigned int transfer;  // index of the current transfer
+    int phase;
+    unsigned int offset;    // bytes of the data stage already transferred
+    uint8_t reply[256];
+    double due;             // cycle the current transfer is sent by the host
+    double offsetCycles;    // maps the trace time to cycles, set by the first poll
+    int started;
+} feed;
+
+static struct {
+    double cycles;          // virtual time since reset
+    double busyUntil;       // SPM of the ATmegas
+    unsigned long passes;   // main loop passes
+    unsigned long polls;    // inner loop passes
+    unsigned long pageWrites;
+    unsigned long erases;
+    unsigned long late;
+    unsigned long mismatches;
+    double maxLatency;
+    unsigned long requestCount[256];
+    unsigned long requestPasses[256];
+    unsigned long requestLatency[256];
+} stats;
+
+static uint8_t interruptFlags;
+static uint8_t pageBuffer[SPM_PAGESIZE];
+static const char *saveFile;
+
+static double microseconds(double cycles) {
+    return cycles / NATIVE_CYCLES_PER_US;
+}
+
+static int isIn(const nativeTransfer *transfer) {
+    return transfer->setup[0] & USBRQ_DIR_DEVICE_TO_HOST;
+}
+
+static unsigned int length(const nativeTransfer *transfer) {
+    return transfer->setup[6] | (transfer->setup[7] << 8);
+}
+
+/*
+ * Read the first device of a trace, failed transfers did not reach the firmware and are skipped.
+ */
+static int readTrace(const char *filename) {
+    FILE *file = fopen(filename, "r");
+    char line[1024];
+    char data[600];
+    int devices = 0;
+
+    if (!file) {
+        perror(filename);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), file)) {
+        unsigned long start, duration;
+        unsigned int type, request, value, index, size, i;
+        int result;
+        nativeTransfer *transfer = &transfers[transferCount];
+
+        if (!strncmp(line, "# device", 8) && ++devices > 1) break;
+        if (line[0] == '#') continue;
+        if (sscanf(line, "%lu %lu %x %u %u %u %u %d %599s", &start, &duration, &type, &request, &value, &index,
+                &size, &result, data) != 9 || size > sizeof(transfer->data)) {
+            fprintf(stderr, "%s: invalid transfer %s", filename, line);
+            fclose(file);
+            return -1;
+        }
+        if (result < 0) continue;
+        if (transferCount == NATIVE_MAX_TRANSFERS) {
+            fprintf(stderr, "%s: more than %d transfers\n", filename, NATIVE_MAX_TRANSFERS);
+            fclose(file);
+            return -1;
+        }
+
+        transfer->start = start;
+        transfer->setup[0] = type;
+        transfer->setup[1] = request;
+        transfer->setup[2] = value & 0xff;
+        transfer->setup[3] = value >> 8;
+        transfer->setup[4] = index & 0xff;
+        transfer->setup[5] = index >> 8;
+        transfer->setup[6] = size & 0xff;
+        transfer->setup[7] = size >> 8;
+        transfer->result = result;
+        for (i = 0; data[0] != '-' && i < sizeof(transfer->data) && sscanf(data + 2 * i, "%2hhx", &transfer->data[i]) == 1;
+                i++) {
+        }
+        transferCount++;
+    }
+    fclose(file);
+    return 0;
+}
+
+/*
+ * Start the next transfer, it is sent by the host at its time in the trace, but not before the
+ * previous one has completed.
+ */
+static void nextTransfer(void) {
+    double due;
+
+    if (++feed.transfer == transferCount) {
+        feed.phase = feed_done;
+        return;
+    }
+    feed.phase = feed_setup;
+    feed.offset = 0;
+    due = transfers[feed.transfer].start * NATIVE_CYCLES_PER_US + feed.offsetCycles;
+    feed.due = due > stats.cycles ? due : stats.cycles;
+}
+
+/*
+ * The interrupt flag register signals a packet for the firmware. Each read is one pass of the
+ * inner main loop.
+ */
+volatile uint8_t *nativeInterruptFlags(void) {
+    stats.cycles += NATIVE_POLL_CYCLES;
+    stats.polls++;
+
+    if (!feed.started) {
+        // the first transfer is sent when the firmware polls the first time
+        feed.started = 1;
+        feed.offsetCycles = stats.cycles - (transferCount ? transfers[0].start * NATIVE_CYCLES_PER_US : 0);
+        feed.transfer = -1;
+        nextTransfer();
+    }
+
+    interruptFlags = 0;
+    if (feed.phase == feed_done) {
+        if (microseconds(stats.cycles - feed.due) > NATIVE_EXIT_MS * 1000.0) {
+            fprintf(stderr, "Bootloader did not leave within %d ms after the last transfer\n", NATIVE_EXIT_MS);
+            exit(2);
+        }
+    } else if (stats.cycles >= feed.due) {
+        if (feed.phase == feed_setup || feed.phase == feed_data_out) {
+            if (usbRxLen == 0) interruptFlags = 0xff;
+        } else if (!(usbTxLen & 0x10)) {
+            interruptFlags = 0xff; // reply or status stage ready
+        } else if (usbTxLen == USBPID_STALL) {
+            interruptFlags = 0xff;
+        }
+    }
+    return &interruptFlags;
+}
+
+/*
+ * Deliver one packet of the current transfer, like the interrupt routine of V-USB does.
+ */
+void USB_handler(void) {
+    nativeTransfer *transfer = &transfers[feed.transfer];
+    double latency = microseconds(stats.cycles - feed.due);
+    unsigned int count;
+
+    stats.cycles += NATIVE_PACKET_US * NATIVE_CYCLES_PER_US;
+
+    if (usbTxLen == USBPID_STALL) {
+        fprintf(stderr, "Transfer %u: request %u stalled\n", feed.transfer, transfer->setup[1]);
+        stats.mismatches++;
+        usbTxLen = USBPID_NAK;
+        nextTransfer();
+        return;
+    }
+
+    switch (feed.phase) {
+    case feed_setup:
+        if (latency > NATIVE_LATE_US) stats.late++;
+        if (latency > stats.maxLatency) stats.maxLatency = latency;
+        stats.requestCount[transfer->setup[1]]++;
+        stats.requestLatency[transfer->setup[1]] += latency;
+
+        usbRxBuf[0] = USBPID_DATA0;
+        memcpy(&usbRxBuf[1], transfer->setup, 8);
+        usbRxToken = USBPID_SETUP;
+        usbRxLen = 11;
+        feed.phase = isIn(transfer) ? feed_data_in : (length(transfer) ? feed_data_out : feed_status);
+        break;
+
+    case feed_data_out:
+        count = length(transfer) - feed.offset;
+        if (count > 8) count = 8;
+        usbRxBuf[0] = (feed.offset / 8) & 1 ? USBPID_DATA0 : USBPID_DATA1;
+        memcpy(&usbRxBuf[1], &transfer->data[feed.offset], count);
+        usbRxToken = USBPID_OUT;
+        usbRxLen = count + 3;
+        feed.offset += count;
+        if (feed.offset == length(transfer)) feed.phase = feed_status;
+        break;
+
+    case feed_data_in:
+        count = usbTxLen - 4;
+        if (feed.offset + count > length(transfer)) count = length(transfer) - feed.offset;
+        memcpy(&feed.reply[feed.offset], &usbTxBuf[1], count);
+        feed.offset += count;
+        usbTxLen = USBPID_NAK;
+        if (count < 8 || feed.offset == length(transfer)) {
+            // the status stage of IN transfers is answered by the driver without the firmware
+            if ((int) feed.offset != transfer->result || memcmp(feed.reply, transfer->data, feed.offset)) {
+                fprintf(stderr, "Transfer %u: reply of request %u does not match the trace\n", feed.transfer,
+                        transfer->setup[1]);
+                stats.mismatches++;
+            }
+            nextTransfer();
+        }
+        break;
+
+    case feed_status:
+        usbTxLen = USBPID_NAK; // zero length packet
+        nextTransfer();
+        break;
+    }
+}
+
+void nativeWatchdogReset(void) {
+    if (!feed.started) return; // not in the main loop yet
+    stats.passes++;
+    if (feed.phase != feed_done) stats.requestPasses[transfers[feed.transfer].setup[1]]++;
+}
+
+void nativeDelayMicroseconds(double microseconds) {
+    stats.cycles += microseconds * NATIVE_CYCLES_PER_US;
+}
+
+/*
+ * Executes the SPM instruction for the command in SPMCSR.
+ */
+void nativeSpm(uint16_t address, uint16_t data) {
+    unsigned int i;
+
+    if (SPMCSR & _BV(PGERS)) {
+        unsigned int size = SPM_PAGESIZE;
+#if defined(__AVR_ATtiny841__)
+        size *= 4; // erases 4 pages at once
+#endif
+        memset(&nativeFlash[address & ~(size - 1)], 0xff, size);
+        stats.erases++;
+    } else if (SPMCSR & _BV(PGWRT)) {
+        address &= ~(SPM_PAGESIZE - 1);
+        for (i = 0; i < SPM_PAGESIZE; i++) nativeFlash[address + i] &= pageBuffer[i];
+        memset(pageBuffer, 0xff, sizeof(pageBuffer));
+        stats.pageWrites++;
+    } else {
+        if (SPMCSR & _BV(4)) { // CTPB or RWWSRE clears the page buffer
+            memset(pageBuffer, 0xff, sizeof(pageBuffer));
+        } else {
+            pageBuffer[address % SPM_PAGESIZE] &= data & 0xff;
+            pageBuffer[(address + 1) % SPM_PAGESIZE] &= data >> 8;
+        }
+        SPMCSR = 0;
+        return;
+    }
+    SPMCSR = 0;
+
+#if (defined __AVR_ATmega328P__)||(defined __AVR_ATmega168P__)
+    // the CPU keeps running
+    stats.busyUntil = stats.cycles + NATIVE_SPM_US * NATIVE_CYCLES_PER_US;
+#else
+    stats.cycles += NATIVE_SPM_US * NATIVE_CYCLES_PER_US; // the CPU is halted
+#endif
+}
+
+uint8_t nativeSpmBusy(void) {
+    return stats.cycles < stats.busyUntil;
+}
+
+void nativeSpmBusyWait(void) {
+    if (stats.cycles < stats.busyUntil) stats.cycles = stats.busyUntil;
+}
+
+void tuneOsccal(void) {
+}
+
+unsigned (usbCrc16Append)(unsigned data, uchar len) {
+    // the host does not check the CRC of the fed packets
+    (void) data;
+    (void) len;
+    return 0;
+}
+
+void nativeLeaveBootloader(void) {
+    static const char *names[] = {
+        "device info", "transfer page", "erase application", "write data", "exit", "transfer page data",
+        "get status", "get page crc", "erase page", "fill words", "copy words", "set idle"
+    };
+    unsigned int i;
+    int early = feed.phase != feed_done;
+
+    printf("Configuration:       " MICRONUCLEUS_CONFIG "\n");
+    printf("Transfers:           %u of %u\n", early ? feed.transfer : transferCount, transferCount);
+    printf("Late transfers:      %lu, maximum latency %.0f us\n", stats.late, stats.maxLatency);
+    printf("Main loop passes:    %lu\n", stats.passes);
+    printf("Inner loop passes:   %lu\n", stats.polls);
+    printf("Page writes:         %lu\n", stats.pageWrites);
+    printf("Erases:              %lu\n", stats.erases);
+    printf("Virtual time:        %.1f ms\n", microseconds(stats.cycles) / 1000.0);
+    printf("Left bootloader:     %s\n", early ? "before the end of the trace" : "after the last transfer");
+    for (i = 0; i < 256; i++) {
+        if (!stats.requestCount[i]) continue;
+        printf("  request %-3u %-18s %6lu transfers, %8lu main loop passes, %6.0f us mean latency\n", i,
+                i < sizeof(names) / sizeof(names[0]) ? names[i] : "", stats.requestCount[i], stats.requestPasses[i],
+                (double) stats.requestLatency[i] / stats.requestCount[i]);
+    }
+
+    if (saveFile) {
+        FILE *file = fopen(saveFile, "wb");
+        if (!file || fwrite(nativeFlash, 1, BOOTLOADER_ADDRESS, file) != BOOTLOADER_ADDRESS) {
+            perror(saveFile);
+            exit(1);
+        }
+        fclose(file);
+    }
+    exit(early || stats.mismatches ? 1 : 0);
+}
+
+int main(int argc, char **argv) {
+    int option;
+
+    MCUSR = _BV(EXTRF);
+    OSCCAL = 0x80; // same as the emulator of the command line tool
+    memset(nativeFlash, 0xff, sizeof(nativeFlash));
+    memset(pageBuffer, 0xff, sizeof(pageBuffer));
+
+    while ((option = getopt(argc, argv, "l:s:r:")) != -1) {
+        FILE *file;
+        switch (option) {
+        case 'l':
+            file = fopen(optarg, "rb");
+            if (!file) {
+                perror(optarg);
+                return 1;
+            }
+            if (fread(nativeFlash, 1, BOOTLOADER_ADDRESS, file) == 0) {
+                fprintf(stderr, "%s: empty\n", optarg);
+                return 1;
+            }
+            fclose(file);
+            break;
+        case 's':
+            saveFile = optarg;
+            break;
+        case 'r':
+            MCUSR = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            optind = argc + 1;
+            break;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-l flash.bin] [-s flash.bin] [-r mcusr] trace\n", argv[0]);
+        return 1;
+    }
+    if (readTrace(argv[optind])) return 1;
+
+    USBIN |= USBIDLE; // D- is pulled up by the device, the bus is idle
+    nativeFirmwareMain();
+    return 1;
+}
@@ -0,0 +1,21 @@
+/*
+ * Native build of the bootloader, see native.c
+ *
+ * This header is included before main.c by the compiler option -include native/native.h.
+ * The AVR register variables of main.c become plain global variables and the AVR specific
+ * headers are replaced by the ones in this directory.
+ */
+#ifndef NATIVE_NATIVE_H
+#define NATIVE_NATIVE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// register uint8_t command asm("r3") -> uint8_t command
+#define register
+#define asm(reg)
+
+// called by main.c instead of jumping to the application
+void nativeLeaveBootloader(void) __attribute__((__noreturn__));
+
+#endif
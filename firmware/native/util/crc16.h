@@ -0,0 +1,23 @@
+/*
+ * util/crc16.h of the native build, the CRC16 of avr-libc with the polynomial 0xA001
+ */
+#ifndef NATIVE_UTIL_CRC16_H
+#define NATIVE_UTIL_CRC16_H
+
+#include <stdint.h>
+
+static inline uint16_t _crc16_update(uint16_t crc, uint8_t data) {
+    int i;
+
+    crc ^= data;
+    for (i = 0; i < 8; ++i) {
+        if (crc & 1) {
+            crc = (crc >> 1) ^ 0xA001;
+        } else {
+            crc = (crc >> 1);
+        }
+    }
+    return crc;
+}
+
+#endif
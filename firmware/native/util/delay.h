@@ -0,0 +1,14 @@
+/*
+ * util/delay.h of the native build, see native.c
+ *
+ * Delays let the virtual time pass.
+ */
+#ifndef NATIVE_UTIL_DELAY_H
+#define NATIVE_UTIL_DELAY_H
+
+void nativeDelayMicroseconds(double microseconds);
+
+#define _delay_ms(ms) nativeDelayMicroseconds((ms) * 1000.0)
+#define _delay_us(us) nativeDelayMicroseconds(us)
+
+#endif
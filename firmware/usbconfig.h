@@ -69,6 +69,24 @@
  * run the AVR close to its limit.
  */
 
+#if ENABLE_PAGE_DATA_TRANSFER
+#define USB_CFG_IMPLEMENT_FN_WRITE      1
+#else
+#define USB_CFG_IMPLEMENT_FN_WRITE      0
+#endif
+/* Set this to 1 if you want usbFunctionWrite() to be called for control-out
+ * transfers. Only required for the page data transfer protocol extension.
+ */
+
+#if defined(STORE_CONFIGURATION_REPLY_IN_RAM) || ENABLE_STATUS_REQUEST || ENABLE_PAGE_CRC
+#define USB_CFG_IMPLEMENT_RAM_REPLIES   1
+#else
+#define USB_CFG_IMPLEMENT_RAM_REPLIES   0
+#endif
+/* Set this to 1 if replies to control-in transfers may be read from RAM by
+ * setting usbMsgPtrIsRAMAddress. Otherwise all replies are read from flash.
+ */
+
 /* -------------------------- Device Description --------------------------- */
 
 #define USB_CFG_VENDOR_ID 0xD0, 0x16 /* = 0x16d0 */
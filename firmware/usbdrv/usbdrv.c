@@ -45,7 +45,7 @@ uchar usbTxBuf[USB_BUFSIZE];/* data to transmit with next IN, free if usbTxLen c
 
 /* USB status registers / not shared with asm code */
 usbMsgPtr_t usbMsgPtr; /* data to transmit next -- ROM or RAM address */
-#if defined(STORE_CONFIGURATION_REPLY_IN_RAM)
+#if USB_CFG_IMPLEMENT_RAM_REPLIES
 uchar usbMsgPtrIsRAMAddress = 0; /* true if RAM address */
 #endif
 static usbMsgLen_t usbMsgLen; /* remaining number of bytes */
@@ -263,12 +263,20 @@ static inline void usbProcessRx(uchar *data, uchar len) {
         usbMsgLen_t replyLen;
         usbTxBuf[0] = USBPID_DATA0; /* initialize data toggling */
         usbTxLen = USBPID_NAK; /* abort pending transmit */
+#if USB_CFG_IMPLEMENT_RAM_REPLIES
+        usbMsgPtrIsRAMAddress = 0; /* reply is read from flash unless usbFunctionSetup() selects RAM */
+#endif
         uchar type = rq->bmRequestType & USBRQ_TYPE_MASK; // masking is essential here
         if (type != USBRQ_TYPE_STANDARD) { /* standard requests are handled by driver */
             replyLen = usbFunctionSetup(data); // for USBRQ_TYPE_CLASS or USBRQ_TYPE_VENDOR
         } else {
             replyLen = usbDriverSetup(rq);
         }
+#if USB_CFG_IMPLEMENT_FN_WRITE
+        if (replyLen == USB_NO_MSG) {
+            /* data stage follows and is passed to usbFunctionWrite(), no reply until it is complete */
+        } else
+#endif
         if (sizeof(replyLen) < sizeof(rq->wLength.word)) { /* help compiler with optimizing */
             if (!rq->wLength.bytes[1] && replyLen > rq->wLength.bytes[0]) /* limit length to max */
                 replyLen = rq->wLength.bytes[0];
@@ -277,6 +285,15 @@ static inline void usbProcessRx(uchar *data, uchar len) {
                 replyLen = rq->wLength.word;
         }
         usbMsgLen = replyLen;
+#if USB_CFG_IMPLEMENT_FN_WRITE
+    } else if (usbMsgLen == USB_NO_MSG) { /* usbRxToken is USBPID_OUT: data stage of a control-out transfer */
+        uchar rval = usbFunctionWrite(data, len);
+        if (rval == 0xff) { /* an error occurred */
+            usbTxLen = USBPID_STALL;
+        } else if (rval != 0) { /* This was the final package */
+            usbMsgLen = 0; /* answer status stage with a zero-sized data packet */
+        }
+#endif
     }
 }
 
@@ -289,7 +306,7 @@ static void usbDeviceRead(uchar *data, usbMsgLen_t len) {
     if (len > 0) { /* don't bother app with 0 sized reads */
         uchar i = len;
         usbMsgPtr_t r = usbMsgPtr;
-#if defined(STORE_CONFIGURATION_REPLY_IN_RAM)
+#if USB_CFG_IMPLEMENT_RAM_REPLIES
         if (usbMsgPtrIsRAMAddress) {
             // RAM data
             do {
@@ -304,7 +321,7 @@ static void usbDeviceRead(uchar *data, usbMsgLen_t len) {
                 *data++ = c;
                 r++;
             } while (--i);
-#if defined(STORE_CONFIGURATION_REPLY_IN_RAM)
+#if USB_CFG_IMPLEMENT_RAM_REPLIES
         }
 #endif
         usbMsgPtr = r;
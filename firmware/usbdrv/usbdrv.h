@@ -196,7 +196,21 @@ USB_PUBLIC usbMsgLen_t usbFunctionSetup(uchar data[8]);
  * (1) Set the global pointer 'usbMsgPtr' to the base of the static RAM data
  * block and return the length of the data in 'usbFunctionSetup()'. The driver
  * will handle the rest. Or (2) return USB_NO_MSG in 'usbFunctionSetup()'. Not implemented.
+ * For control-out transfers with a data stage, return USB_NO_MSG to receive the
+ * data with usbFunctionWrite() below.
  */
+#if USB_CFG_IMPLEMENT_FN_WRITE
+USB_PUBLIC uchar usbFunctionWrite(uchar *data, uchar len);
+/* This function is called by the driver to provide a control transfer's
+ * payload data (control-out). It is called in chunks of up to 8 bytes. The
+ * total count provided in the current control transfer can be obtained from
+ * the 'length' property in the setup data. If an error occurred during
+ * processing, return 0xff (== -1). The driver will answer the entire transfer
+ * with a STALL token in this case. If you have received the entire payload
+ * successfully, return 1. If you expect more data, return 0.
+ * This function is only called if usbFunctionSetup() returned USB_NO_MSG.
+ */
+#endif
 
 //extern uchar usbRxToken;    /* may be used in usbFunctionWriteOut() below */
 #ifdef USB_CFG_PULLUP_IOPORTNAME
@@ -470,7 +484,7 @@ extern usbTxStatus_t   usbTxStatus1, usbTxStatus3;
 
 
 typedef union usbWord{
-    unsigned    word;
+    unsigned short  word;   /* 16 bit on the host, too, see native/native.c */
     uchar       bytes[2];
 }usbWord_t;
 